@@ -0,0 +1,110 @@
+#!/bin/sh
+# Run xinfo repeatedly against the fake X server and report, for every
+# scenario, the wall time of a whole run (process startup included), the time
+# spent probing as measured by xinfo itself, and the number of round-trips,
+# system calls and bytes exchanged with the server per run.
+#
+# Environment:
+#   XINFO    xinfo executable (default: ./xinfo)
+#   FAKEX    fake server executable (default: bench/fakex)
+#   RUNS     number of runs per scenario (default: 200)
+#   DISPLAY_NUMBER  display to serve the fake server on (default: 73)
+set -e
+
+XINFO=${XINFO:-./xinfo}
+FAKEX=${FAKEX:-bench/fakex}
+RUNS=${RUNS:-200}
+DISPLAY_NUMBER=${DISPLAY_NUMBER:-73}
+
+work_directory=$(mktemp -d)
+fakex_pid=
+cleanup() {
+  if [ -n "$fakex_pid" ]; then
+    kill "$fakex_pid" 2>/dev/null || true
+    wait "$fakex_pid" 2>/dev/null || true
+  fi
+  rm -rf "$work_directory"
+}
+trap cleanup EXIT INT TERM
+
+now_ms() {
+  # Nanoseconds are not POSIX, fall back to seconds where unsupported
+  t=$(date +%s%N)
+  case $t in
+  *N) echo $(($(date +%s) * 1000)) ;;
+  *) echo $((t / 1000000)) ;;
+  esac
+}
+
+# Scenarios are made of a name, the options of the fake server and the
+# options of xinfo, separated by "|"
+scenarios='local||
+local, visuals|--visuals=1024|--visuals
+local, 4 screens|--screens=4|
+local, cached||--cache
+local, extensions only||--only=extensions
+1 ms latency|--latency=1|
+1 ms latency, cached|--latency=1|--cache
+1 ms latency, 1 extension|--latency=1|--extension=RANDR
+1 ms latency, 6 monitors|--latency=1 --monitors=6|--only=monitors
+1 ms latency, 100 properties|--latency=1 --properties=100|--only=properties
+1 ms latency, 2000 clients|--latency=1 --clients=2000|--only=clients'
+
+printf '%-28s %10s %10s %12s %9s %10s %10s\n' scenario 'wall ms' 'probe ms' \
+  round-trips syscalls 'bytes out' 'bytes in'
+while IFS='|' read -r name fakex_options xinfo_options; do
+  # shellcheck disable=SC2086
+  "$FAKEX" --display="$DISPLAY_NUMBER" \
+    --xauthority="$work_directory/xauthority" $fakex_options &
+  fakex_pid=$!
+  while [ ! -S "/tmp/.X11-unix/X$DISPLAY_NUMBER" ] ||
+    [ ! -f "$work_directory/xauthority" ]; do
+    sleep 0.01
+  done
+  rm -rf "$work_directory/cache"
+
+  # One run to fill the cache, if used, then the measured runs
+  results="$work_directory/results"
+  : >"$results"
+  run=0
+  start=$(now_ms)
+  while [ $run -le "$RUNS" ]; do
+    # shellcheck disable=SC2086
+    XAUTHORITY="$work_directory/xauthority" \
+      XDG_CACHE_HOME="$work_directory/cache" \
+      "$XINFO" --timings --format=line $xinfo_options ":$DISPLAY_NUMBER" \
+      >"$work_directory/output"
+    if [ $run -eq 0 ]; then
+      start=$(now_ms)
+    else
+      cat "$work_directory/output" >>"$results"
+    fi
+    run=$((run + 1))
+  done
+  end=$(now_ms)
+
+  awk -v name="$name" -v runs="$RUNS" -v wall_ms=$((end - start)) '
+    # Connecting over a local socket and reading the Xauthority file do not
+    # involve the server, every other phase is one round-trip
+    / timings\.phases\.[0-9]+\.name=/ {
+      phase = substr($0, index($0, "=") + 1)
+      if (phase != "Xauthority lookup" && phase != "Host name resolution" &&
+          phase != "Connection to server" && phase != "Cache lookup")
+        ++round_trips
+    }
+    / timings\.total_ms=/ { probe_ms += substr($0, index($0, "=") + 1) }
+    / timings\.(reads|writes)=/ { syscalls += substr($0, index($0, "=") + 1) }
+    / timings\.bytes_sent=/ { bytes_out += substr($0, index($0, "=") + 1) }
+    / timings\.bytes_received=/ { bytes_in += substr($0, index($0, "=") + 1) }
+    END {
+      printf "%-28s %10.3f %10.3f %12.1f %9.1f %10.0f %10.0f\n", name,
+        wall_ms / runs, probe_ms / runs, round_trips / runs, syscalls / runs,
+        bytes_out / runs, bytes_in / runs
+    }' "$results"
+
+  kill "$fakex_pid"
+  wait "$fakex_pid" 2>/dev/null || true
+  fakex_pid=
+done <<SCENARIOS
+$scenarios
+SCENARIOS
@@ -0,0 +1,954 @@
+/* Fake X server for benchmarking xinfo. It speaks just enough of the X11
+ * protocol for xinfo: the connection handshake, QueryExtension,
+ * ListExtensions, GetFontPath, GetGeometry, ListProperties, GetProperty,
+ * GetAtomName, BIG-REQUESTS Enable, the version queries of the extensions it
+ * advertises, the RANDR and XINERAMA monitor queries and the X-Resource client
+ * queries. Replies can be delayed to simulate the round-trip time of
+ * a remote server. */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define NORETURN __attribute__((noreturn))
+#else
+#define NORETURN
+#endif
+
+NORETURN static void die(const char *msg) {
+  fprintf(stderr, "FATAL ERROR: %s\n", msg);
+  exit(1);
+}
+
+#define X_PAD(n) ((4 - ((n) % 4)) % 4)
+
+#define X_OPCODE_GET_GEOMETRY 14
+#define X_OPCODE_GET_ATOM_NAME 17
+#define X_OPCODE_GET_PROPERTY 20
+#define X_OPCODE_LIST_PROPERTIES 21
+#define X_OPCODE_GET_INPUT_FOCUS 43
+#define X_OPCODE_GET_FONT_PATH 52
+#define X_OPCODE_QUERY_EXTENSION 98
+#define X_OPCODE_LIST_EXTENSIONS 99
+#define X_FIRST_EXTENSION_OPCODE 128
+
+#define ROOT_WINDOW 0x0000079f
+
+#define RANDR_GET_OUTPUT_INFO 9
+#define RANDR_GET_CRTC_INFO 20
+#define RANDR_GET_SCREEN_RESOURCES_CURRENT 25
+#define XINERAMA_QUERY_SCREENS 5
+#define X_RESOURCE_QUERY_CLIENTS 1
+#define X_RESOURCE_QUERY_CLIENT_RESOURCES 2
+#define X_RESOURCE_QUERY_CLIENT_PIXMAP_BYTES 3
+
+/* Clients own consecutive ranges of resource identifiers */
+#define CLIENT_RESOURCE_SHIFT 16
+#define CLIENT_RESOURCE_MASK 0x0000ffff
+
+/* Every monitor has its own output and CRTC, side by side, all showing the
+ * same 1920x1080 60 Hz mode */
+#define FIRST_CRTC 0x00000100
+#define FIRST_OUTPUT 0x00000200
+#define MODE 0x00000300
+#define CONFIG_TIMESTAMP 1000
+
+/* Root windows have string properties made of the same repeated line, named
+ * after the atoms they are interned as */
+#define FIRST_PROPERTY_ATOM 100
+#define ATOM_STRING 31
+static const char property_line[] = "Fake.resource:\tvalue\n";
+
+/* Layout of the version replies, which differs between extensions */
+enum version_format {
+  VERSION_NONE, /* BIG-REQUESTS */
+  VERSION_8,
+  VERSION_16,
+  VERSION_32,
+  VERSION_XTEST, /* Major version in the second byte of the reply */
+};
+
+static const struct fake_extension {
+  const char *name;
+  enum version_format format;
+  unsigned int major;
+  unsigned int minor;
+} known_extensions[] = {
+    {"BIG-REQUESTS", VERSION_NONE, 0, 0},
+    {"Composite", VERSION_32, 0, 4},
+    {"DAMAGE", VERSION_32, 1, 1},
+    {"DOUBLE-BUFFER", VERSION_8, 1, 0},
+    {"DPMS", VERSION_16, 1, 2},
+    {"DRI2", VERSION_32, 1, 4},
+    {"DRI3", VERSION_32, 1, 2},
+    {"GLX", VERSION_32, 1, 4},
+    {"Generic Event Extension", VERSION_16, 1, 0},
+    {"MIT-SCREEN-SAVER", VERSION_16, 1, 1},
+    {"MIT-SHM", VERSION_16, 1, 2},
+    {"Present", VERSION_32, 1, 2},
+    {"RANDR", VERSION_32, 1, 6},
+    {"RECORD", VERSION_16, 1, 13},
+    {"RENDER", VERSION_32, 0, 11},
+    {"SECURITY", VERSION_16, 1, 0},
+    {"SHAPE", VERSION_16, 1, 1},
+    {"SYNC", VERSION_8, 3, 1},
+    {"X-Resource", VERSION_8, 1, 2},
+    {"XC-MISC", VERSION_16, 1, 1},
+    {"XFIXES", VERSION_32, 5, 0},
+    {"XFree86-DGA", VERSION_16, 2, 0},
+    {"XFree86-VidModeExtension", VERSION_16, 2, 2},
+    {"XINERAMA", VERSION_8, 1, 1},
+    {"XInputExtension", VERSION_16, 2, 3},
+    {"XKEYBOARD", VERSION_16, 1, 0},
+    {"XTEST", VERSION_XTEST, 2, 2},
+    {"XVideo", VERSION_16, 2, 2},
+};
+
+#define NUM_KNOWN_EXTENSIONS                                                   \
+  (sizeof(known_extensions) / sizeof(known_extensions[0]))
+
+static const char *font_paths[] = {
+    "/usr/share/fonts/misc",
+    "/usr/share/fonts/TTF",
+    "built-ins",
+};
+
+struct options {
+  unsigned int display;
+  const char *xauthority_path;
+  unsigned int latency_ms;
+  unsigned int num_screens;
+  unsigned int num_visuals;
+  unsigned int num_extensions;
+  unsigned int num_monitors;
+  unsigned int num_properties;
+  unsigned int num_clients;
+  unsigned int property_len; /* In lines */
+  int no_abstract_socket;
+};
+
+/* Extensions beyond the known ones get made up names */
+static void extension_name(unsigned int index, char *name, size_t name_len) {
+  if (index < NUM_KNOWN_EXTENSIONS)
+    snprintf(name, name_len, "%s", known_extensions[index].name);
+  else
+    snprintf(name, name_len, "FAKE-EXTENSION-%u", index);
+}
+
+static double monotonic_now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+/* Growable byte buffer */
+struct buffer {
+  char *data;
+  size_t len;
+  size_t capacity;
+};
+
+static char *buffer_reserve(struct buffer *buffer, size_t len) {
+  if (buffer->capacity - buffer->len < len) {
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity - buffer->len < len)
+      capacity *= 2;
+    char *data = realloc(buffer->data, capacity);
+    if (!data)
+      die("Memory allocation failed");
+    buffer->data = data;
+    buffer->capacity = capacity;
+  }
+  char *result = buffer->data + buffer->len;
+  memset(result, 0, len);
+  buffer->len += len;
+  return result;
+}
+
+static void buffer_consume(struct buffer *buffer, size_t len) {
+  memmove(buffer->data, buffer->data + len, buffer->len - len);
+  buffer->len -= len;
+}
+
+/* Output is released in chunks, each one once its delay has expired */
+struct release {
+  double due_ms;
+  size_t end; /* Offset in the output buffer */
+};
+
+struct client {
+  int fd;
+  int set_up;
+  uint16_t sequence_number;
+  struct buffer input;
+  struct buffer output;
+  struct release *releases;
+  size_t num_releases;
+  size_t releases_capacity;
+};
+
+static void client_release(struct client *client, unsigned int latency_ms) {
+  if (client->num_releases == client->releases_capacity) {
+    size_t capacity =
+        client->releases_capacity ? 2 * client->releases_capacity : 16;
+    struct release *releases =
+        realloc(client->releases, capacity * sizeof(struct release));
+    if (!releases)
+      die("Memory allocation failed");
+    client->releases = releases;
+    client->releases_capacity = capacity;
+  }
+  struct release release = {
+      .due_ms = monotonic_now_ms() + latency_ms,
+      .end = client->output.len,
+  };
+  client->releases[client->num_releases++] = release;
+}
+
+static void put16(char *data, uint16_t value) { memcpy(data, &value, 2); }
+static void put32(char *data, uint32_t value) { memcpy(data, &value, 4); }
+
+/* Start a reply with the given variable data length, returning a pointer to
+ * the reply */
+static char *reply(struct client *client, uint8_t data1, size_t data_len) {
+  size_t len = 32 + data_len + X_PAD(data_len);
+  char *data = buffer_reserve(&client->output, len);
+  data[0] = 1;
+  data[1] = data1;
+  put16(data + 2, client->sequence_number);
+  put32(data + 4, (len - 32) / 4);
+  return data;
+}
+
+static void send_error(struct client *client, uint8_t code, uint8_t major,
+                       uint16_t minor) {
+  char *data = buffer_reserve(&client->output, 32);
+  data[1] = code;
+  put16(data + 2, client->sequence_number);
+  put16(data + 8, minor);
+  data[10] = major;
+}
+
+static void send_setup(struct client *client, const struct options *options) {
+  static const char vendor[] = "Fake X server";
+  static const uint8_t formats[][2] = {{1, 1}, {8, 8}, {24, 32}, {32, 32}};
+  size_t vendor_len = sizeof(vendor) - 1;
+  size_t num_formats = sizeof(formats) / sizeof(formats[0]);
+  size_t depth_len = 8;
+  size_t visual_len = 24;
+  size_t screen_len = 40 + 3 * depth_len + (options->num_visuals + 24) *
+                                               visual_len;
+  size_t len = 40 + vendor_len + X_PAD(vendor_len) + num_formats * 8 +
+               options->num_screens * screen_len;
+
+  if (len - 8 > 4 * 65535)
+    die("Too many screens or visuals for the connection setup");
+  char *data = buffer_reserve(&client->output, len);
+  data[0] = 1;
+  put16(data + 2, 11);
+  put16(data + 4, 0);
+  put16(data + 6, (len - 8) / 4);
+  put32(data + 8, 12101004);
+  put32(data + 12, 0x04000000);
+  put32(data + 16, 0x001fffff);
+  put32(data + 20, 256);
+  put16(data + 24, vendor_len);
+  put16(data + 26, 65535);
+  data[28] = options->num_screens;
+  data[29] = num_formats;
+  data[30] = 0; /* Little endian images */
+  data[31] = 0;
+  data[32] = 32;
+  data[33] = 32;
+  data[34] = 8;
+  data[35] = (char)255;
+  char *curr = data + 40;
+  memcpy(curr, vendor, vendor_len);
+  curr += vendor_len + X_PAD(vendor_len);
+  for (size_t i = 0; i < num_formats; ++i, curr += 8) {
+    curr[0] = formats[i][0];
+    curr[1] = formats[i][1];
+    curr[2] = 32;
+  }
+
+  for (unsigned int screen = 0; screen < options->num_screens; ++screen) {
+    put32(curr, ROOT_WINDOW + screen);
+    put32(curr + 4, 0x20);
+    put32(curr + 8, 0xffffff);
+    put32(curr + 12, 0);
+    put32(curr + 16, 0xfa8033);
+    put16(curr + 20, 1920);
+    put16(curr + 22, 1080);
+    put16(curr + 24, 508);
+    put16(curr + 26, 285);
+    put16(curr + 28, 1);
+    put16(curr + 30, 1);
+    put32(curr + 32, 0x21);
+    curr[36] = 1;    /* Backing stores when mapped */
+    curr[37] = 0;    /* No save unders */
+    curr[38] = 24;   /* Root depth */
+    curr[39] = 3;    /* Allowed depths */
+    curr += 40;
+    static const unsigned int depths[] = {24, 1, 32};
+    for (size_t depth = 0; depth < 3; ++depth) {
+      unsigned int num_visuals = depth == 0   ? options->num_visuals
+                                 : depth == 2 ? 24
+                                              : 0;
+      curr[0] = depths[depth];
+      put16(curr + 2, num_visuals);
+      curr += depth_len;
+      for (unsigned int i = 0; i < num_visuals; ++i, curr += visual_len) {
+        put32(curr, (depth == 0 ? 0x21 : 0x1000) + i);
+        curr[4] = depth == 0 && i % 2 ? 5 : 4; /* DirectColor, TrueColor */
+        curr[5] = 8;
+        put16(curr + 6, 256);
+        put32(curr + 8, 0xff0000);
+        put32(curr + 12, 0xff00);
+        put32(curr + 16, 0xff);
+      }
+    }
+  }
+}
+
+/* Answer the monitor requests of RANDR. Returns non-zero if the request is
+ * not one of them. */
+static int handle_randr_request(struct client *client,
+                                const struct options *options, uint8_t opcode,
+                                const char *request, size_t len) {
+  unsigned int num_monitors = options->num_monitors;
+  static const char mode_name[] = "1920x1080";
+  uint8_t minor = request[1];
+  uint32_t id = 0;
+  if (len >= 8)
+    memcpy(&id, request + 4, 4);
+  char *data;
+  switch (minor) {
+  case RANDR_GET_SCREEN_RESOURCES_CURRENT:
+    data = reply(client, 0, 8 * num_monitors + 32 + sizeof(mode_name) - 1);
+    put32(data + 8, CONFIG_TIMESTAMP);
+    put32(data + 12, CONFIG_TIMESTAMP);
+    put16(data + 16, num_monitors);
+    put16(data + 18, num_monitors);
+    put16(data + 20, 1);
+    put16(data + 22, sizeof(mode_name) - 1);
+    char *curr = data + 32;
+    for (unsigned int i = 0; i < num_monitors; ++i, curr += 4)
+      put32(curr, FIRST_CRTC + i);
+    for (unsigned int i = 0; i < num_monitors; ++i, curr += 4)
+      put32(curr, FIRST_OUTPUT + i);
+    put32(curr, MODE);
+    put16(curr + 4, 1920);
+    put16(curr + 6, 1080);
+    put32(curr + 8, 148500000);
+    put16(curr + 16, 2200);
+    put16(curr + 24, 1125);
+    put16(curr + 26, sizeof(mode_name) - 1);
+    memcpy(curr + 32, mode_name, sizeof(mode_name) - 1);
+    return 0;
+  case RANDR_GET_CRTC_INFO:
+    if (id - FIRST_CRTC >= num_monitors) {
+      send_error(client, 2, opcode, minor);
+      return 0;
+    }
+    data = reply(client, 0, 4);
+    put32(data + 8, CONFIG_TIMESTAMP);
+    put16(data + 12, 1920 * (id - FIRST_CRTC));
+    put16(data + 16, 1920);
+    put16(data + 18, 1080);
+    put32(data + 20, MODE);
+    put16(data + 24, 1);
+    put16(data + 26, 1);
+    put16(data + 28, 1);
+    put16(data + 30, 1);
+    put32(data + 32, FIRST_OUTPUT + (id - FIRST_CRTC));
+    return 0;
+  case RANDR_GET_OUTPUT_INFO:
+    if (id - FIRST_OUTPUT >= num_monitors) {
+      send_error(client, 2, opcode, minor);
+      return 0;
+    }
+    char name[16];
+    int name_len = snprintf(name, sizeof(name), "DP-%u", id - FIRST_OUTPUT);
+    data = reply(client, 0, 4 + 8 + name_len);
+    put32(data + 8, CONFIG_TIMESTAMP);
+    put32(data + 12, FIRST_CRTC + (id - FIRST_OUTPUT));
+    put32(data + 16, 527);
+    put32(data + 20, 296);
+    put16(data + 26, 1);
+    put16(data + 28, 1);
+    put16(data + 30, 1);
+    put16(data + 34, name_len);
+    put32(data + 36, FIRST_CRTC + (id - FIRST_OUTPUT));
+    put32(data + 40, MODE);
+    memcpy(data + 44, name, name_len);
+    return 0;
+  default:
+    return 1;
+  }
+}
+
+static void handle_xinerama_query_screens(struct client *client,
+                                          const struct options *options) {
+  char *data = reply(client, 0, 8 * options->num_monitors);
+  put32(data + 8, options->num_monitors);
+  for (unsigned int i = 0; i < options->num_monitors; ++i) {
+    put16(data + 32 + 8 * i, 1920 * i);
+    put16(data + 36 + 8 * i, 1920);
+    put16(data + 38 + 8 * i, 1080);
+  }
+}
+
+/* Answer the client requests of X-Resource, making up the usage of every
+ * client from its index. Returns non-zero if the request is not one of
+ * them. */
+static int handle_x_resource_request(struct client *client,
+                                     const struct options *options,
+                                     uint8_t opcode, const char *request,
+                                     size_t len) {
+  uint8_t minor = request[1];
+  uint32_t xid = 0;
+  if (len >= 8)
+    memcpy(&xid, request + 4, 4);
+  uint32_t index = (xid >> CLIENT_RESOURCE_SHIFT) - 1;
+  char *data;
+  switch (minor) {
+  case X_RESOURCE_QUERY_CLIENTS:
+    data = reply(client, 0, 8 * options->num_clients);
+    put32(data + 8, options->num_clients);
+    for (unsigned int i = 0; i < options->num_clients; ++i) {
+      put32(data + 32 + 8 * i, (i + 1) << CLIENT_RESOURCE_SHIFT);
+      put32(data + 36 + 8 * i, CLIENT_RESOURCE_MASK);
+    }
+    return 0;
+  case X_RESOURCE_QUERY_CLIENT_RESOURCES:
+    if (index >= options->num_clients) {
+      send_error(client, 2, opcode, minor);
+      return 0;
+    }
+    data = reply(client, 0, 16);
+    put32(data + 8, 2);
+    put32(data + 32, ATOM_STRING);
+    put32(data + 36, index % 7 + 1);
+    put32(data + 40, FIRST_PROPERTY_ATOM);
+    put32(data + 44, index % 13);
+    return 0;
+  case X_RESOURCE_QUERY_CLIENT_PIXMAP_BYTES:
+    if (index >= options->num_clients) {
+      send_error(client, 2, opcode, minor);
+      return 0;
+    }
+    data = reply(client, 0, 0);
+    put32(data + 8, (index * 2654435761u) & 0x0fffffff);
+    return 0;
+  default:
+    return 1;
+  }
+}
+
+static void handle_extension_request(struct client *client,
+                                     const struct options *options,
+                                     const char *request, size_t len) {
+  uint8_t opcode = request[0];
+  uint8_t minor = request[1];
+  unsigned int index = opcode - X_FIRST_EXTENSION_OPCODE;
+  if (index >= options->num_extensions || index >= NUM_KNOWN_EXTENSIONS) {
+    send_error(client, 1, opcode, minor);
+    return;
+  }
+  const struct fake_extension *extension = &known_extensions[index];
+  if (strcmp(extension->name, "RANDR") == 0 &&
+      handle_randr_request(client, options, opcode, request, len) == 0)
+    return;
+  if (strcmp(extension->name, "X-Resource") == 0 &&
+      handle_x_resource_request(client, options, opcode, request, len) == 0)
+    return;
+  if (strcmp(extension->name, "XINERAMA") == 0 &&
+      minor == XINERAMA_QUERY_SCREENS) {
+    handle_xinerama_query_screens(client, options);
+    return;
+  }
+  char *data;
+  switch (extension->format) {
+  case VERSION_NONE:
+    data = reply(client, 0, 0);
+    put32(data + 8, 4194303);
+    break;
+  case VERSION_8:
+    data = reply(client, 0, 0);
+    data[8] = extension->major;
+    data[9] = extension->minor;
+    break;
+  case VERSION_16:
+    data = reply(client, 0, 0);
+    put16(data + 8, extension->major);
+    put16(data + 10, extension->minor);
+    break;
+  case VERSION_32:
+    data = reply(client, 0, 0);
+    put32(data + 8, extension->major);
+    put32(data + 12, extension->minor);
+    break;
+  case VERSION_XTEST:
+    data = reply(client, extension->major, 0);
+    put16(data + 8, extension->minor);
+    break;
+  }
+}
+
+static void handle_get_property(struct client *client,
+                                const struct options *options,
+                                const char *request, size_t len) {
+  uint32_t property = 0;
+  uint32_t long_offset = 0;
+  uint32_t long_length = 0;
+  if (len >= 24) {
+    memcpy(&property, request + 8, 4);
+    memcpy(&long_offset, request + 16, 4);
+    memcpy(&long_length, request + 20, 4);
+  }
+  if (property - FIRST_PROPERTY_ATOM >= options->num_properties) {
+    /* Missing properties have no type */
+    reply(client, 0, 0);
+    return;
+  }
+  size_t line_len = sizeof(property_line) - 1;
+  size_t value_len = line_len * options->property_len;
+  size_t offset = 4 * (size_t)long_offset;
+  if (offset > value_len) {
+    send_error(client, 2, X_OPCODE_GET_PROPERTY, 0);
+    return;
+  }
+  size_t chunk_len = value_len - offset;
+  if (chunk_len > 4 * (size_t)long_length)
+    chunk_len = 4 * (size_t)long_length;
+  char *data = reply(client, 8, chunk_len);
+  put32(data + 8, ATOM_STRING);
+  put32(data + 12, value_len - offset - chunk_len);
+  put32(data + 16, chunk_len);
+  for (size_t i = 0; i < chunk_len; ++i)
+    data[32 + i] = property_line[(offset + i) % line_len];
+}
+
+static void handle_request(struct client *client, const struct options *options,
+                           const char *request, size_t len) {
+  uint8_t opcode = request[0];
+  ++client->sequence_number;
+  if (opcode == X_OPCODE_QUERY_EXTENSION && len >= 8) {
+    uint16_t name_len;
+    memcpy(&name_len, request + 4, 2);
+    char *data = reply(client, 0, 0);
+    for (unsigned int i = 0; i < options->num_extensions; ++i) {
+      char name[64];
+      extension_name(i, name, sizeof(name));
+      if (name_len <= len - 8 && strlen(name) == name_len &&
+          memcmp(name, request + 8, name_len) == 0) {
+        data[8] = 1;
+        data[9] = X_FIRST_EXTENSION_OPCODE + i;
+        break;
+      }
+    }
+  } else if (opcode == X_OPCODE_LIST_EXTENSIONS) {
+    size_t data_len = 0;
+    char name[64];
+    for (unsigned int i = 0; i < options->num_extensions; ++i) {
+      extension_name(i, name, sizeof(name));
+      data_len += 1 + strlen(name);
+    }
+    size_t num_names = options->num_extensions;
+    char *curr = reply(client, num_names, data_len) + 32;
+    for (unsigned int i = 0; i < options->num_extensions; ++i) {
+      extension_name(i, name, sizeof(name));
+      *curr = strlen(name);
+      memcpy(curr + 1, name, strlen(name));
+      curr += 1 + strlen(name);
+    }
+  } else if (opcode == X_OPCODE_GET_FONT_PATH) {
+    size_t num_paths = sizeof(font_paths) / sizeof(font_paths[0]);
+    size_t data_len = 0;
+    for (size_t i = 0; i < num_paths; ++i)
+      data_len += 1 + strlen(font_paths[i]);
+    char *data = reply(client, 0, data_len);
+    put16(data + 8, num_paths);
+    char *curr = data + 32;
+    for (size_t i = 0; i < num_paths; ++i) {
+      *curr = strlen(font_paths[i]);
+      memcpy(curr + 1, font_paths[i], strlen(font_paths[i]));
+      curr += 1 + strlen(font_paths[i]);
+    }
+  } else if (opcode == X_OPCODE_GET_GEOMETRY) {
+    char *data = reply(client, 24, 0);
+    put32(data + 8, ROOT_WINDOW);
+    put16(data + 16, 1920);
+    put16(data + 18, 1080);
+  } else if (opcode == X_OPCODE_LIST_PROPERTIES) {
+    char *data = reply(client, 0, 4 * options->num_properties);
+    put16(data + 8, options->num_properties);
+    for (unsigned int i = 0; i < options->num_properties; ++i)
+      put32(data + 32 + 4 * i, FIRST_PROPERTY_ATOM + i);
+  } else if (opcode == X_OPCODE_GET_PROPERTY) {
+    handle_get_property(client, options, request, len);
+  } else if (opcode == X_OPCODE_GET_INPUT_FOCUS) {
+    char *data = reply(client, 1, 0); /* RevertToPointerRoot */
+    put32(data + 8, ROOT_WINDOW);
+  } else if (opcode == X_OPCODE_GET_ATOM_NAME && len >= 8) {
+    uint32_t atom;
+    memcpy(&atom, request + 4, 4);
+    if (atom - FIRST_PROPERTY_ATOM >= options->num_properties) {
+      send_error(client, 5, opcode, 0);
+      return;
+    }
+    char name[32];
+    int name_len = snprintf(name, sizeof(name), "FAKE_PROPERTY_%u",
+                            atom - FIRST_PROPERTY_ATOM);
+    char *data = reply(client, 0, name_len);
+    put16(data + 8, name_len);
+    memcpy(data + 32, name, name_len);
+  } else if (opcode >= X_FIRST_EXTENSION_OPCODE) {
+    handle_extension_request(client, options, request, len);
+  } else {
+    send_error(client, 1, opcode, 0);
+  }
+}
+
+/* Handle everything received so far. Returns non-zero if the client must be
+ * dropped. */
+static int client_process_input(struct client *client,
+                                const struct options *options) {
+  struct buffer *input = &client->input;
+  if (!client->set_up) {
+    if (input->len < 12)
+      return 0;
+    uint16_t name_len;
+    uint16_t data_len;
+    memcpy(&name_len, input->data + 6, 2);
+    memcpy(&data_len, input->data + 8, 2);
+    size_t len = 12 + name_len + X_PAD(name_len) + data_len + X_PAD(data_len);
+    if (input->len < len)
+      return 0;
+    /* Only clients using the byte order of the server are supported */
+    uint16_t one = 1;
+    char byte_order = *(char *)&one ? 'l' : 'B';
+    if (input->data[0] != byte_order)
+      return 1;
+    buffer_consume(input, len);
+    send_setup(client, options);
+    client->set_up = 1;
+  }
+
+  size_t offset = 0;
+  for (;;) {
+    if (input->len - offset < 4)
+      break;
+    const char *request = input->data + offset;
+    uint16_t request_len;
+    memcpy(&request_len, request + 2, 2);
+    size_t len = 4 * (size_t)request_len;
+    if (request_len == 0) {
+      /* BIG-REQUESTS extended length */
+      if (input->len - offset < 8)
+        break;
+      uint32_t big_request_len;
+      memcpy(&big_request_len, request + 4, 4);
+      len = 4 * (size_t)big_request_len;
+      if (len < 8)
+        return 1;
+    }
+    if (len < 4)
+      return 1;
+    if (input->len - offset < len)
+      break;
+    handle_request(client, options, request, len);
+    offset += len;
+  }
+  buffer_consume(input, offset);
+  return 0;
+}
+
+/* Send the output whose delay expired. Returns non-zero on failure. */
+static int client_flush(struct client *client) {
+  double now = monotonic_now_ms();
+  size_t releasable = 0;
+  size_t num_released = 0;
+  while (num_released < client->num_releases &&
+         client->releases[num_released].due_ms <= now)
+    releasable = client->releases[num_released++].end;
+  size_t sent = 0;
+  while (sent < releasable) {
+    ssize_t written = send(client->fd, client->output.data + sent,
+                           releasable - sent, MSG_NOSIGNAL);
+    if (written == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      return 1;
+    }
+    sent += written;
+  }
+  buffer_consume(&client->output, sent);
+  /* Releases of partially sent output are kept */
+  size_t kept = 0;
+  for (size_t i = 0; i < client->num_releases; ++i) {
+    if (client->releases[i].end <= sent)
+      continue;
+    client->releases[kept] = client->releases[i];
+    client->releases[kept++].end -= sent;
+  }
+  client->num_releases = kept;
+  return 0;
+}
+
+static void client_free(struct client *client) {
+  close(client->fd);
+  free(client->input.data);
+  free(client->output.data);
+  free(client->releases);
+}
+
+/* Write an Xauthority file with an entry for the local display, so that
+ * xinfo finds something to send */
+static void write_xauthority(const struct options *options) {
+  char hostname[256] = {0};
+  gethostname(hostname, sizeof(hostname) - 1);
+  char number[16];
+  snprintf(number, sizeof(number), "%u", options->display);
+  static const char protocol[] = "MIT-MAGIC-COOKIE-1";
+  char cookie[16] = {0};
+  const char *fields[] = {hostname, number, protocol, cookie};
+  size_t lengths[] = {strlen(hostname), strlen(number), sizeof(protocol) - 1,
+                      sizeof(cookie)};
+
+  FILE *file = fopen(options->xauthority_path, "wb");
+  if (!file)
+    die("Failed to create Xauthority file");
+  fputc(1, file); /* FamilyLocal, in big endian */
+  fputc(0, file);
+  for (size_t i = 0; i < 4; ++i) {
+    fputc(lengths[i] >> 8, file);
+    fputc(lengths[i] & 0xff, file);
+    fwrite(fields[i], 1, lengths[i], file);
+  }
+  if (fclose(file) != 0)
+    die("Failed to write Xauthority file");
+}
+
+static void usage(const char *program_name) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "\n"
+          "Options:\n"
+          "  --display=N       Serve display :N (default: 73)\n"
+          "  --xauthority=PATH Write an Xauthority file for the display\n"
+          "  --latency=MS      Delay every answer by MS milliseconds\n"
+          "  --screens=N       Number of screens (default: 1)\n"
+          "  --visuals=N       Number of visuals of depth 24 per screen\n"
+          "                    (default: 32)\n"
+          "  --extensions=N    Number of extensions (default: %zu),\n"
+          "                    extensions past the known ones have made up\n"
+          "                    names\n"
+          "  --monitors=N      Number of monitors (default: 1)\n"
+          "  --properties=N    Number of properties of every root window\n"
+          "                    (default: 0)\n"
+          "  --property-lines=N\n"
+          "                    Number of lines of every property\n"
+          "                    (default: 16)\n"
+          "  --clients=N       Number of clients reported by X-Resource\n"
+          "                    (default: 0)\n"
+          "  --no-abstract     Do not listen in the abstract socket\n"
+          "                    namespace\n",
+          program_name, NUM_KNOWN_EXTENSIONS);
+}
+
+static int parse_uint(const char *arg, const char *prefix,
+                      unsigned int *value) {
+  size_t prefix_len = strlen(prefix);
+  if (strncmp(arg, prefix, prefix_len) != 0)
+    return 0;
+  char *end;
+  unsigned long parsed = strtoul(arg + prefix_len, &end, 10);
+  if (end == arg + prefix_len || *end != '\0' || parsed > 65535)
+    die("Invalid option value");
+  *value = parsed;
+  return 1;
+}
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int signal_number) {
+  (void)signal_number;
+  stopping = 1;
+}
+
+int main(int argc, char **argv) {
+  struct options options = {
+      .display = 73,
+      .num_screens = 1,
+      .num_visuals = 32,
+      .num_extensions = NUM_KNOWN_EXTENSIONS,
+      .num_monitors = 1,
+      .property_len = 16,
+  };
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--xauthority=", 13) == 0) {
+      options.xauthority_path = argv[i] + 13;
+    } else if (strcmp(argv[i], "--no-abstract") == 0) {
+      options.no_abstract_socket = 1;
+    } else if (!parse_uint(argv[i], "--display=", &options.display) &&
+               !parse_uint(argv[i], "--latency=", &options.latency_ms) &&
+               !parse_uint(argv[i], "--screens=", &options.num_screens) &&
+               !parse_uint(argv[i], "--visuals=", &options.num_visuals) &&
+               !parse_uint(argv[i], "--extensions=",
+                           &options.num_extensions) &&
+               !parse_uint(argv[i], "--monitors=", &options.num_monitors) &&
+               !parse_uint(argv[i], "--properties=",
+                           &options.num_properties) &&
+               !parse_uint(argv[i], "--property-lines=",
+                           &options.property_len) &&
+               !parse_uint(argv[i], "--clients=", &options.num_clients)) {
+      usage(argv[0]);
+      return strcmp(argv[i], "--help") != 0;
+    }
+  }
+  if (options.num_screens == 0 || options.num_screens > 255 ||
+      options.num_extensions > 127)
+    die("Unsupported number of screens or extensions");
+  if (options.xauthority_path)
+    write_xauthority(&options);
+
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  mkdir("/tmp/.X11-unix", 01777);
+  snprintf(address.sun_path, sizeof(address.sun_path), "/tmp/.X11-unix/X%u",
+           options.display);
+  unlink(address.sun_path);
+  /* Like the X server on Linux, also listen on the same path in the abstract
+   * namespace */
+  struct sockaddr_un abstract_address = {.sun_family = AF_UNIX};
+  size_t path_len = strlen(address.sun_path);
+  memcpy(abstract_address.sun_path + 1, address.sun_path, path_len);
+  const struct sockaddr_un *addresses[] = {&address, &abstract_address};
+  const socklen_t address_lens[] = {
+      sizeof(address), offsetof(struct sockaddr_un, sun_path) + 1 + path_len};
+  int listen_fds[2] = {-1, -1};
+  size_t num_listen_fds = 0;
+#ifdef __linux__
+  size_t num_addresses = options.no_abstract_socket ? 1 : 2;
+#else
+  size_t num_addresses = 1;
+#endif
+  for (size_t i = 0; i < num_addresses; ++i) {
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1 ||
+        bind(listen_fd, (const struct sockaddr *)addresses[i],
+             address_lens[i]) == -1 ||
+        listen(listen_fd, 128) == -1)
+      die("Failed to listen on the display socket");
+    fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+    listen_fds[num_listen_fds++] = listen_fd;
+  }
+
+  struct sigaction action = {.sa_handler = stop};
+  sigaction(SIGINT, &action, 0);
+  sigaction(SIGTERM, &action, 0);
+
+  struct client *clients = 0;
+  struct pollfd *fds = 0;
+  size_t num_clients = 0;
+  size_t capacity = 0;
+  while (!stopping) {
+    if (num_clients + num_listen_fds >= capacity) {
+      capacity = capacity ? 2 * capacity : 64;
+      clients = realloc(clients, capacity * sizeof(struct client));
+      fds = realloc(fds, capacity * sizeof(struct pollfd));
+      if (!clients || !fds)
+        die("Memory allocation failed");
+    }
+
+    /* Wake up when the next delayed answer is due */
+    double next_due = 0;
+    for (size_t i = 0; i < num_listen_fds; ++i) {
+      fds[i].fd = listen_fds[i];
+      fds[i].events = POLLIN;
+    }
+    struct pollfd *client_fds = fds + num_listen_fds;
+    for (size_t i = 0; i < num_clients; ++i) {
+      client_fds[i].fd = clients[i].fd;
+      client_fds[i].events = POLLIN;
+      if (clients[i].num_releases > 0) {
+        double due = clients[i].releases[0].due_ms;
+        if (next_due == 0 || due < next_due)
+          next_due = due;
+        if (due <= monotonic_now_ms())
+          client_fds[i].events |= POLLOUT;
+      }
+    }
+    int timeout_ms = -1;
+    if (next_due != 0) {
+      double delay_ms = next_due - monotonic_now_ms();
+      timeout_ms = delay_ms <= 0 ? 0 : (int)delay_ms + 1;
+    }
+    if (poll(fds, num_listen_fds + num_clients, timeout_ms) == -1) {
+      if (errno == EINTR)
+        continue;
+      die("Failed to wait for clients");
+    }
+
+    for (size_t i = num_clients; i-- > 0;) {
+      struct client *client = &clients[i];
+      int failed = 0;
+      if (client_fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        char *data = buffer_reserve(&client->input, 65536);
+        client->input.len -= 65536;
+        ssize_t received = recv(client->fd, data, 65536, 0);
+        if (received > 0) {
+          client->input.len += received;
+          size_t output_len = client->output.len;
+          failed = client_process_input(client, &options) != 0;
+          if (client->output.len != output_len)
+            client_release(client, options.latency_ms);
+        } else if (received == 0 || (errno != EAGAIN && errno != EINTR)) {
+          failed = 1;
+        }
+      }
+      if (!failed && client->num_releases > 0)
+        failed = client_flush(client) != 0;
+      if (failed) {
+        client_free(client);
+        clients[i] = clients[--num_clients];
+      }
+    }
+
+    for (size_t i = 0; i < num_listen_fds; ++i) {
+      if (!(fds[i].revents & POLLIN))
+        continue;
+      int fd;
+      while (num_clients + num_listen_fds < capacity &&
+             (fd = accept(listen_fds[i], 0, 0)) != -1) {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        struct client client = {.fd = fd};
+        clients[num_clients++] = client;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < num_clients; ++i)
+    client_free(&clients[i]);
+  free(clients);
+  free(fds);
+  for (size_t i = 0; i < num_listen_fds; ++i)
+    close(listen_fds[i]);
+  unlink(address.sun_path);
+  return 0;
+}
@@ -5,18 +5,26 @@
  *
  */
 
-#define _POSIX_C_SOURCE 200112L
+#define _POSIX_C_SOURCE 200809L
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #if defined(__GNUC__)
@@ -30,22 +38,87 @@ NORETURN static void die(const char *msg) {
   exit(1);
 }
 
-static ssize_t read_n(int fd, void *buffer, size_t n) {
-  char *buf = buffer;
-  size_t total_read;
-  for (total_read = 0; total_read < n;) {
-    ssize_t num_read = read(fd, buf, n - total_read);
+/* Growable input buffer. Data is received in large chunks and handed out as
+ * views pointing directly into the buffer. Consumed data at the front of the
+ * buffer is only reclaimed when more room is needed, so a view stays valid
+ * until the next time data is received. */
+struct input_buffer {
+  char *data;
+  size_t capacity;
+  size_t start; /* Offset of the first byte that was not consumed yet */
+  size_t end;   /* Offset of the end of the received data */
+  /* Number of unconsumed bytes the parser knows it needs, from the header of
+   * a message that is not complete yet */
+  size_t wanted;
+  size_t num_syscalls;
+  size_t num_bytes;
+};
+
+#define INPUT_BUFFER_MIN_CAPACITY 16384
+#define INPUT_BUFFER_MIN_RECEIVE 4096
+
+/* Record that n unconsumed bytes are needed to complete the message at the
+ * front of the buffer, so that the next receive makes room for all of them at
+ * once */
+static void input_buffer_want(struct input_buffer *buffer, size_t n) {
+  buffer->wanted = n;
+}
+
+/* Receive whatever data is available from the non-blocking socket fd with a
+ * single call to recv. Returns non-zero on failure or if the connection was
+ * closed. */
+static int input_buffer_receive(struct input_buffer *buffer, int fd) {
+  /* Large messages, such as the setup data of a server with many visuals,
+   * are received in as few calls as the socket allows instead of growing the
+   * buffer and moving the data around a little at a time */
+  size_t pending = buffer->end - buffer->start;
+  size_t room = INPUT_BUFFER_MIN_RECEIVE;
+  if (buffer->wanted > pending + room)
+    room = buffer->wanted - pending;
+  buffer->wanted = 0;
+  /* Reclaim the consumed data, then grow the buffer if there is still not
+   * enough room left at its end */
+  if (buffer->capacity - buffer->end < room && buffer->start > 0) {
+    memmove(buffer->data, buffer->data + buffer->start, pending);
+    buffer->end -= buffer->start;
+    buffer->start = 0;
+  }
+  if (buffer->capacity - buffer->end < room) {
+    size_t capacity = buffer->capacity ? 2 * buffer->capacity
+                                       : INPUT_BUFFER_MIN_CAPACITY;
+    while (capacity - buffer->end < room)
+      capacity *= 2;
+    char *data = realloc(buffer->data, capacity);
+    if (!data)
+      return 1;
+    buffer->data = data;
+    buffer->capacity = capacity;
+  }
+
+  for (;;) {
+    ssize_t num_read = recv(fd, buffer->data + buffer->end,
+                            buffer->capacity - buffer->end, 0);
+    ++buffer->num_syscalls;
     if (num_read == 0) /* EOF */
-      return total_read;
+      return 1;
     if (num_read == -1) {
       if (errno == EINTR)
         continue; /* We got interrupted, try again */
-      return -1;
+      return errno != EAGAIN && errno != EWOULDBLOCK;
     }
-    total_read += num_read;
-    buf += num_read;
+    buffer->end += num_read;
+    buffer->num_bytes += num_read;
+    return 0;
   }
-  return total_read;
+}
+
+static void input_buffer_free(struct input_buffer *buffer) {
+  free(buffer->data);
+  buffer->data = 0;
+  buffer->capacity = 0;
+  buffer->start = 0;
+  buffer->end = 0;
+  buffer->wanted = 0;
 }
 
 static ssize_t write_n(int fd, const void *buffer, size_t n) {
@@ -64,6 +137,159 @@ static ssize_t write_n(int fd, const void *buffer, size_t n) {
   return total_written;
 }
 
+/* Growable output buffer. Requests are appended to the buffer and only sent
+ * when it is flushed, so that a batch of requests goes out with a single write
+ * instead of one per request. */
+struct output_buffer {
+  char *data;
+  size_t capacity;
+  size_t len;
+  size_t num_syscalls;
+  size_t num_bytes;
+};
+
+#define OUTPUT_BUFFER_MIN_CAPACITY 4096
+
+/* Reserve n zero-initialized bytes at the end of the buffer. Returns null on
+ * allocation failure. */
+static char *output_buffer_reserve(struct output_buffer *buffer, size_t n) {
+  if (buffer->capacity - buffer->len < n) {
+    size_t capacity = buffer->capacity ? 2 * buffer->capacity
+                                       : OUTPUT_BUFFER_MIN_CAPACITY;
+    while (capacity - buffer->len < n)
+      capacity *= 2;
+    char *data = realloc(buffer->data, capacity);
+    if (!data)
+      return 0;
+    buffer->data = data;
+    buffer->capacity = capacity;
+  }
+  char *result = buffer->data + buffer->len;
+  memset(result, 0, n);
+  buffer->len += n;
+  return result;
+}
+
+/* Send as much of the buffered data as the non-blocking socket fd accepts.
+ * Whatever could not be sent yet stays in the buffer. Returns non-zero on
+ * failure. */
+static int output_buffer_flush(struct output_buffer *buffer, int fd) {
+  size_t total_written = 0;
+  while (total_written < buffer->len) {
+    ssize_t num_written = send(fd, buffer->data + total_written,
+                               buffer->len - total_written, MSG_NOSIGNAL);
+    ++buffer->num_syscalls;
+    if (num_written <= 0) {
+      if (num_written == -1 && errno == EINTR)
+        continue; /* We got interrupted, try again */
+      if (num_written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        break; /* The socket is full, try again once it is writable */
+      return 1;
+    }
+    total_written += num_written;
+    buffer->num_bytes += num_written;
+  }
+  if (total_written > 0) {
+    memmove(buffer->data, buffer->data + total_written,
+            buffer->len - total_written);
+    buffer->len -= total_written;
+  }
+  return 0;
+}
+
+static void output_buffer_free(struct output_buffer *buffer) {
+  free(buffer->data);
+  buffer->data = 0;
+  buffer->capacity = 0;
+  buffer->len = 0;
+}
+
+/* Buffered stream for the reports, so that they are written with a few large
+ * writes instead of one call to stdio per line. Streams without a file
+ * descriptor collect everything in memory instead. */
+struct output_stream {
+  int fd; /* -1 to write to memory */
+  int failed; /* Set if writing failed at some point */
+  size_t len;
+  char data[65536];
+  char *memory;
+  size_t memory_len;
+  size_t memory_capacity;
+};
+
+/* Write data past the buffer. Returns -1 on failure. */
+static int output_emit(struct output_stream *out, const char *data,
+                       size_t len) {
+  if (out->fd >= 0)
+    return write_n(out->fd, data, len) == -1 ? -1 : 0;
+  if (out->memory_capacity - out->memory_len < len) {
+    size_t capacity = out->memory_capacity ? out->memory_capacity : 4096;
+    while (capacity - out->memory_len < len)
+      capacity *= 2;
+    char *memory = realloc(out->memory, capacity);
+    if (!memory)
+      return -1;
+    out->memory = memory;
+    out->memory_capacity = capacity;
+  }
+  memcpy(out->memory + out->memory_len, data, len);
+  out->memory_len += len;
+  return 0;
+}
+
+static void output_flush(struct output_stream *out) {
+  if (out->len > 0 && output_emit(out, out->data, out->len) == -1)
+    out->failed = 1;
+  out->len = 0;
+}
+
+static void output_write(struct output_stream *out, const char *data,
+                         size_t len) {
+  if (sizeof(out->data) - out->len < len) {
+    output_flush(out);
+    if (len > sizeof(out->data)) {
+      if (output_emit(out, data, len) == -1)
+        out->failed = 1;
+      return;
+    }
+  }
+  memcpy(out->data + out->len, data, len);
+  out->len += len;
+}
+
+static void output_printf(struct output_stream *out, const char *format, ...) {
+  va_list args;
+  /* Format directly into the buffer, flushing it first if it turns out to be
+   * too full */
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    size_t room = sizeof(out->data) - out->len;
+    va_start(args, format);
+    int len = vsnprintf(out->data + out->len, room, format, args);
+    va_end(args);
+    if (len < 0)
+      return;
+    if ((size_t)len < room) {
+      out->len += len;
+      return;
+    }
+    output_flush(out);
+  }
+  /* Larger than the whole buffer */
+  va_start(args, format);
+  int len = vsnprintf(0, 0, format, args);
+  va_end(args);
+  char *data = len >= 0 ? malloc((size_t)len + 1) : 0;
+  if (!data) {
+    out->failed = 1;
+    return;
+  }
+  va_start(args, format);
+  vsnprintf(data, (size_t)len + 1, format, args);
+  va_end(args);
+  output_write(out, data, len);
+  free(data);
+}
+
 #define X_VERSION_MAJOR 11
 #define X_VERSION_MINOR 0
 #define X_BASE_TCP_PORT 6000
@@ -71,13 +297,22 @@ static ssize_t write_n(int fd, const void *buffer, size_t n) {
 #define X_PADDING(x) ((4 - ((x) % 4)) % 4)
 #define X_PAD(x) ((x) + X_PADDING((x)))
 
+#define X_ERROR 0
 #define X_REPLY 1
+#define X_GENERIC_EVENT 35
 #define X_CONNECTION_STATUS_SUCCESS 1
 #define X_BYTE_ORDER_LITTLE_ENDIAN 0
 #define X_BITMAP_FORMAT_BIT_ORDER_LEAST_SIGNIFICANT 0
 #define X_BACKING_STORES_NEVER 0
 #define X_BACKING_STORES_WHEN_MAPPED 1
 
+#define X_VISUAL_CLASS_STATIC_GRAY 0
+#define X_VISUAL_CLASS_GRAY_SCALE 1
+#define X_VISUAL_CLASS_STATIC_COLOR 2
+#define X_VISUAL_CLASS_PSEUDO_COLOR 3
+#define X_VISUAL_CLASS_TRUE_COLOR 4
+#define X_VISUAL_CLASS_DIRECT_COLOR 5
+
 #define X_EVENT_MASK_KEY_PRESS 0x00000001u
 #define X_EVENT_MASK_KEY_RELEASE 0x00000002u
 #define X_EVENT_MASK_BUTTON_PRESS 0x00000004u
@@ -104,10 +339,32 @@ static ssize_t write_n(int fd, const void *buffer, size_t n) {
 #define X_EVENT_MASK_COLORMAP_CHANGE 0x00800000u
 #define X_EVENT_MASK_OWNER_GRAB_BUTTON 0x01000000u
 
+#define X_OPCODE_GET_GEOMETRY 14
+#define X_OPCODE_GET_ATOM_NAME 17
+#define X_OPCODE_GET_PROPERTY 20
+#define X_OPCODE_LIST_PROPERTIES 21
+#define X_OPCODE_GET_INPUT_FOCUS 43
 #define X_OPCODE_GET_FONT_PATH 52
 #define X_OPCODE_QUERY_EXTENSION 98
 #define X_OPCODE_LIST_EXTENSIONS 99
 
+/* The server encodes everything it sends in the byte order chosen by the
+ * client in the setup request, and expects requests in that order. Choosing
+ * the byte order of the host lets all the protocol structures be copied in and
+ * out of the buffers as is, without swapping any field, on either endianness.
+ * Compilers without the byte order macros fold the fallback into a constant
+ * anyway. */
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__)
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define X_HOST_BYTE_ORDER 'B'
+#else
+#define X_HOST_BYTE_ORDER 'l'
+#endif
+#else
+#define X_HOST_BYTE_ORDER                                                      \
+  (*(const unsigned char *)&(const uint16_t){1} ? 'l' : 'B')
+#endif
+
 struct x_setup_request {
   uint8_t byte_order; /* Either 'B' for big endian, or 'l' for little endian */
   uint8_t pad1;
@@ -188,32 +445,323 @@ struct x_visual_type {
   uint32_t pad;
 };
 
-struct x_depth {
-  struct x_depth_data data;
-  struct x_visual_type *visuals;
-};
-
-struct x_screen {
-  struct x_screen_data data;
-  struct x_depth *allowed_depths;
-};
-
+/* The connection setup information is kept as the raw block received from the
+ * server. Screens, allowed depths and visuals are variable length records that
+ * are only decoded on demand, when iterating over them. */
 struct x_setup_data {
-  char *vendor_name;
-  struct x_format *pixmap_formats;
-  struct x_screen *roots;
+  char *raw;
+  size_t raw_len;
+  const char *vendor_name; /* Not null-terminated, see data.vendor_length */
+  const char *pixmap_formats;
+  const char *roots;
   struct x_setup_data_impl data;
   uint16_t version_major;
   uint16_t version_minor;
 };
 
-static struct {
+/* Timing instrumentation, only collected when enabled. Phases are the main
+ * steps of a run, requests are timed from the moment they are sent to the
+ * moment their reply or error is received. */
+#define TIMINGS_MAX_PHASES 32
+
+struct timing_phase {
+  const char *name;
+  double duration_ms;
+};
+
+struct request_timing {
+  uint16_t sequence_number;
+  uint8_t opcode;
+  uint8_t minor_opcode;
+  double sent_ms;  /* Negative until the request is flushed */
+  double reply_ms; /* Negative until the reply is received */
+};
+
+struct timings {
+  int enabled;
+  double start_ms;
+  double end_ms;
+  struct timing_phase phases[TIMINGS_MAX_PHASES];
+  size_t num_phases;
+  struct request_timing *requests;
+  size_t num_requests;
+  size_t requests_capacity;
+  /* Name of the extension behind every extension major opcode, if known */
+  const char *extension_names[128];
+};
+
+static double monotonic_now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+static void timings_add_phase(struct timings *timings, const char *name,
+                              double start_ms) {
+  if (!timings->enabled || timings->num_phases == TIMINGS_MAX_PHASES)
+    return;
+  struct timing_phase phase = {
+      .name = name,
+      .duration_ms = monotonic_now_ms() - start_ms,
+  };
+  timings->phases[timings->num_phases++] = phase;
+}
+
+static void timings_add_request(struct timings *timings,
+                                uint16_t sequence_number, const void *request) {
+  if (!timings->enabled)
+    return;
+  if (timings->num_requests == timings->requests_capacity) {
+    size_t capacity =
+        timings->requests_capacity ? 2 * timings->requests_capacity : 64;
+    struct request_timing *requests =
+        realloc(timings->requests, capacity * sizeof(struct request_timing));
+    if (!requests)
+      return;
+    timings->requests = requests;
+    timings->requests_capacity = capacity;
+  }
+  const uint8_t *bytes = request;
+  struct request_timing timing = {
+      .sequence_number = sequence_number,
+      .opcode = bytes[0],
+      .minor_opcode = bytes[1],
+      .sent_ms = -1,
+      .reply_ms = -1,
+  };
+  timings->requests[timings->num_requests++] = timing;
+}
+
+static void timings_requests_sent(struct timings *timings) {
+  if (!timings->enabled)
+    return;
+  double now = monotonic_now_ms();
+  for (size_t i = timings->num_requests; i > 0; --i) {
+    if (timings->requests[i - 1].sent_ms >= 0)
+      break;
+    timings->requests[i - 1].sent_ms = now;
+  }
+}
+
+static void timings_reply_received(struct timings *timings,
+                                   uint16_t sequence_number) {
+  if (!timings->enabled)
+    return;
+  for (size_t i = timings->num_requests; i > 0; --i) {
+    struct request_timing *timing = &timings->requests[i - 1];
+    if (timing->sequence_number == sequence_number) {
+      if (timing->reply_ms < 0)
+        timing->reply_ms = monotonic_now_ms();
+      break;
+    }
+  }
+}
+
+/* Remember which extension a major opcode belongs to, for reporting. The name
+ * must have static storage duration. */
+static void timings_set_extension_name(struct timings *timings,
+                                       unsigned int major_opcode,
+                                       const char *name) {
+  if (major_opcode >= 128 && major_opcode < 256)
+    timings->extension_names[major_opcode - 128] = name;
+}
+
+static void timings_free(struct timings *timings) {
+  free(timings->requests);
+  timings->requests = 0;
+  timings->num_requests = 0;
+  timings->requests_capacity = 0;
+}
+
+/* State of a connection to an X server. Connections are independent of each
+ * other so that several displays can be probed at the same time. */
+struct x_connection {
+  int fd; /* Non-blocking socket */
   struct x_setup_data setup_data;
-  int fd;
-} x_connection = {
-    .fd = -1,
+  struct input_buffer input;
+  struct output_buffer output;
+  struct timings timings;
+  /* Sequence number of the last request queued for the server. The server
+   * stamps every reply with the low 16 bits of the sequence number of the
+   * request it answers, which allows matching replies to pipelined requests. */
+  uint16_t sequence_number;
+  /* Events are never asked for, but some servers send them anyway, for
+   * instance to clients of extensions which select some by default */
+  size_t num_discarded_events;
+};
+
+struct x_get_geometry_request {
+  uint8_t opcode;
+  uint8_t pad;
+  uint16_t request_len;
+  uint32_t drawable;
+};
+
+struct x_get_geometry_reply {
+  uint8_t status;
+  uint8_t depth;
+  uint16_t sequence_number;
+  uint32_t data_len;
+  uint32_t root;
+  int16_t x;
+  int16_t y;
+  uint16_t width;
+  uint16_t height;
+  uint16_t border_width;
+  uint8_t pad[10];
+};
+
+struct x_get_atom_name_request {
+  uint8_t opcode;
+  uint8_t pad;
+  uint16_t request_len;
+  uint32_t atom;
+};
+
+/* Followed by the name */
+struct x_get_atom_name_reply {
+  uint8_t status;
+  uint8_t pad1;
+  uint16_t sequence_number;
+  uint32_t data_len;
+  uint16_t name_len;
+  uint8_t pad2[22];
+};
+
+#define X_ANY_PROPERTY_TYPE 0
+
+struct x_get_property_request {
+  uint8_t opcode;
+  uint8_t delete_property;
+  uint16_t request_len;
+  uint32_t window;
+  uint32_t property;
+  uint32_t type;
+  uint32_t long_offset; /* In 4-byte units */
+  uint32_t long_length;
+};
+
+/* Followed by the value */
+struct x_get_property_reply {
+  uint8_t status;
+  uint8_t format;
+  uint16_t sequence_number;
+  uint32_t data_len;
+  uint32_t type;
+  uint32_t bytes_after;
+  uint32_t value_len; /* In format units */
+  uint8_t pad[12];
+};
+
+struct x_get_input_focus_request {
+  uint8_t opcode;
+  uint8_t pad;
+  uint16_t request_len;
+};
+
+struct x_list_properties_request {
+  uint8_t opcode;
+  uint8_t pad;
+  uint16_t request_len;
+  uint32_t window;
+};
+
+/* Followed by the atoms */
+struct x_list_properties_reply {
+  uint8_t status;
+  uint8_t pad1;
+  uint16_t sequence_number;
+  uint32_t data_len;
+  uint16_t num_atoms;
+  uint8_t pad2[22];
 };
 
+/* Names of the atoms every server defines, which never need to be looked up */
+static const char *const x_predefined_atoms[] = {
+    0,
+    "PRIMARY",
+    "SECONDARY",
+    "ARC",
+    "ATOM",
+    "BITMAP",
+    "CARDINAL",
+    "COLORMAP",
+    "CURSOR",
+    "CUT_BUFFER0",
+    "CUT_BUFFER1",
+    "CUT_BUFFER2",
+    "CUT_BUFFER3",
+    "CUT_BUFFER4",
+    "CUT_BUFFER5",
+    "CUT_BUFFER6",
+    "CUT_BUFFER7",
+    "DRAWABLE",
+    "FONT",
+    "INTEGER",
+    "PIXMAP",
+    "POINT",
+    "RECTANGLE",
+    "RESOURCE_MANAGER",
+    "RGB_COLOR_MAP",
+    "RGB_BEST_MAP",
+    "RGB_BLUE_MAP",
+    "RGB_DEFAULT_MAP",
+    "RGB_GRAY_MAP",
+    "RGB_GREEN_MAP",
+    "RGB_RED_MAP",
+    "STRING",
+    "VISUALID",
+    "WINDOW",
+    "WM_COMMAND",
+    "WM_HINTS",
+    "WM_CLIENT_MACHINE",
+    "WM_ICON_NAME",
+    "WM_ICON_SIZE",
+    "WM_NAME",
+    "WM_NORMAL_HINTS",
+    "WM_SIZE_HINTS",
+    "WM_ZOOM_HINTS",
+    "MIN_SPACE",
+    "NORM_SPACE",
+    "MAX_SPACE",
+    "END_SPACE",
+    "SUPERSCRIPT_X",
+    "SUPERSCRIPT_Y",
+    "SUBSCRIPT_X",
+    "SUBSCRIPT_Y",
+    "UNDERLINE_POSITION",
+    "UNDERLINE_THICKNESS",
+    "STRIKEOUT_ASCENT",
+    "STRIKEOUT_DESCENT",
+    "ITALIC_ANGLE",
+    "X_HEIGHT",
+    "QUAD_WIDTH",
+    "WEIGHT",
+    "POINT_SIZE",
+    "RESOLUTION",
+    "COPYRIGHT",
+    "NOTICE",
+    "FONT_NAME",
+    "FAMILY_NAME",
+    "FULL_NAME",
+    "CAP_HEIGHT",
+    "WM_CLASS",
+    "WM_TRANSIENT_FOR",
+};
+
+#define X_NUM_PREDEFINED_ATOMS                                                 \
+  (sizeof(x_predefined_atoms) / sizeof(x_predefined_atoms[0]))
+
+#define X_ATOM_ATOM 4
+#define X_ATOM_COLORMAP 7
+#define X_ATOM_CURSOR 8
+#define X_ATOM_DRAWABLE 17
+#define X_ATOM_FONT 18
+#define X_ATOM_INTEGER 19
+#define X_ATOM_PIXMAP 20
+#define X_ATOM_VISUALID 32
+#define X_ATOM_WINDOW 33
+
 struct x_get_font_path_request {
   uint8_t opcode;
   uint8_t pad;
@@ -263,169 +811,363 @@ struct x_query_extension_reply {
   uint8_t pad[20];
 };
 
-static void x_disconnect(void) {
-  if (x_connection.fd != -1) {
-    close(x_connection.fd);
-    x_connection.fd = -1;
-  }
+/* Send as many of the queued requests to the server as possible without
+ * blocking. Returns non-zero on failure. */
+static int x_flush(struct x_connection *c) {
+  if (c->output.len == 0)
+    return 0;
+  timings_requests_sent(&c->timings);
+  return output_buffer_flush(&c->output, c->fd);
+}
+
+/* Queue a request made of a fixed-size part followed by optional variable
+ * length data, which is padded to a multiple of four bytes. The request is
+ * only sent when the output is flushed. Returns non-zero on failure. */
+static int x_send_request(struct x_connection *c, const void *request,
+                          size_t request_len, const void *data,
+                          size_t data_len) {
+  char *buffer =
+      output_buffer_reserve(&c->output, request_len + X_PAD(data_len));
+  if (!buffer)
+    return 1;
+  memcpy(buffer, request, request_len);
+  if (data_len > 0)
+    memcpy(buffer + request_len, data, data_len);
+  ++c->sequence_number;
+  timings_add_request(&c->timings, c->sequence_number, request);
+  return 0;
+}
 
-  if (x_connection.setup_data.roots) {
-    for (size_t i = 0; i < x_connection.setup_data.data.num_roots; ++i) {
-      if (x_connection.setup_data.roots[i].allowed_depths) {
-        for (size_t j = 0;
-             j < x_connection.setup_data.roots[i].data.num_allowed_depths; ++j)
-          free(x_connection.setup_data.roots[i].allowed_depths[j].visuals);
-        free(x_connection.setup_data.roots[i].allowed_depths);
+/* Consume the next reply or error from the connection input if it was
+ * received entirely, discarding the events found on the way. Replies and
+ * generic events come with variable length data, whose size is encoded in the
+ * header, everything else is 32 bytes long. The total length of the reply is
+ * stored in reply_len. The returned view is only valid until more data is
+ * received. Returns null if no complete reply or error is available. */
+static const char *x_next_reply(struct x_connection *c, size_t *reply_len) {
+  struct input_buffer *input = &c->input;
+  for (;;) {
+    size_t available = input->end - input->start;
+    const char *data = input->data + input->start;
+    size_t len = 32;
+    if (available < len)
+      return 0;
+    /* The most significant bit of the type tells events generated through
+     * SendEvent apart */
+    uint8_t type = (uint8_t)data[0] & 0x7f;
+    if (type == X_REPLY || type == X_GENERIC_EVENT) {
+      uint32_t data_len;
+      memcpy(&data_len, data + 4, sizeof(data_len));
+      len += 4 * (size_t)data_len;
+      if (available < len) {
+        input_buffer_want(input, len);
+        return 0;
       }
     }
-    free(x_connection.setup_data.roots);
+    input->start += len;
+    if (type != X_REPLY && type != X_ERROR) {
+      ++c->num_discarded_events;
+      continue;
+    }
+    uint16_t sequence_number;
+    memcpy(&sequence_number, data + 2, sizeof(sequence_number));
+    timings_reply_received(&c->timings, sequence_number);
+    *reply_len = len;
+    return data;
+  }
+}
+
+/* Close the socket and release the I/O buffers, keeping everything that was
+ * learned about the server. */
+static void x_close(struct x_connection *c) {
+  if (c->fd != -1) {
+    close(c->fd);
+    c->fd = -1;
+  }
+  input_buffer_free(&c->input);
+  output_buffer_free(&c->output);
+}
+
+static void x_disconnect(struct x_connection *c) {
+  x_close(c);
+  timings_free(&c->timings);
+
+  free(c->setup_data.raw);
+  c->setup_data.raw = 0;
+}
+
+/* Walk the setup data once to make sure that it is not truncated, so that the
+ * iterators below never need to check bounds. Returns non-zero if the setup
+ * data is invalid. */
+static int x_validate_setup_data(const char *data, size_t data_len,
+                                 const struct x_setup_data_impl *header) {
+  size_t offset = sizeof(struct x_setup_data_impl) +
+                  X_PAD((size_t)header->vendor_length) +
+                  header->num_pixmap_formats * sizeof(struct x_format);
+  for (size_t i = 0; i < header->num_roots; ++i) {
+    struct x_screen_data screen;
+    if (data_len < offset + sizeof(screen))
+      return 1;
+    memcpy(&screen, data + offset, sizeof(screen));
+    offset += sizeof(screen);
+    for (size_t j = 0; j < screen.num_allowed_depths; ++j) {
+      struct x_depth_data depth;
+      if (data_len < offset + sizeof(depth))
+        return 1;
+      memcpy(&depth, data + offset, sizeof(depth));
+      offset +=
+          sizeof(depth) + depth.num_visuals * sizeof(struct x_visual_type);
+    }
+  }
+  return data_len < offset;
+}
+
+static struct x_format
+x_get_pixmap_format(const struct x_setup_data *setup_data, size_t index) {
+  struct x_format format;
+  memcpy(&format, setup_data->pixmap_formats + index * sizeof(struct x_format),
+         sizeof(format));
+  return format;
+}
+
+/* Iterators over the records of the setup data. Calling the next function
+ * decodes the header of the following record into data and returns zero once
+ * all records have been visited. Skipping over a screen or a depth only
+ * requires decoding the headers of the depths it contains, visuals are never
+ * touched unless explicitly iterated over. */
+struct x_screen_iterator {
+  struct x_screen_data data;
+  size_t index;
+  const char *depths; /* Start of the allowed depths of the current screen */
+  const char *next;
+  size_t remaining;
+};
+
+struct x_depth_iterator {
+  struct x_depth_data data;
+  const char *visuals; /* Start of the visuals of the current depth */
+  const char *next;
+  size_t remaining;
+};
+
+struct x_visual_iterator {
+  struct x_visual_type data;
+  const char *next;
+  size_t remaining;
+};
+
+static struct x_screen_iterator
+x_screens_begin(const struct x_setup_data *setup_data) {
+  struct x_screen_iterator it = {
+      .index = (size_t)-1,
+      .next = setup_data->roots,
+      .remaining = setup_data->data.num_roots,
+  };
+  return it;
+}
+
+static struct x_depth_iterator
+x_depths_begin(const struct x_screen_iterator *screen) {
+  struct x_depth_iterator it = {
+      .next = screen->depths,
+      .remaining = screen->data.num_allowed_depths,
+  };
+  return it;
+}
+
+static struct x_visual_iterator
+x_visuals_begin(const struct x_depth_iterator *depth) {
+  struct x_visual_iterator it = {
+      .next = depth->visuals,
+      .remaining = depth->data.num_visuals,
+  };
+  return it;
+}
+
+static int x_depths_next(struct x_depth_iterator *it) {
+  if (it->remaining == 0)
+    return 0;
+  memcpy(&it->data, it->next, sizeof(it->data));
+  it->visuals = it->next + sizeof(it->data);
+  it->next =
+      it->visuals + it->data.num_visuals * sizeof(struct x_visual_type);
+  --it->remaining;
+  return 1;
+}
+
+static int x_screens_next(struct x_screen_iterator *it) {
+  if (it->remaining == 0)
+    return 0;
+  memcpy(&it->data, it->next, sizeof(it->data));
+  it->depths = it->next + sizeof(it->data);
+  ++it->index;
+  --it->remaining;
+  /* Find the start of the next screen by skipping over the depths */
+  struct x_depth_iterator depth = x_depths_begin(it);
+  it->next = it->depths;
+  while (x_depths_next(&depth))
+    it->next = depth.next;
+  return 1;
+}
+
+static int x_visuals_next(struct x_visual_iterator *it) {
+  if (it->remaining == 0)
+    return 0;
+  memcpy(&it->data, it->next, sizeof(it->data));
+  it->next += sizeof(it->data);
+  --it->remaining;
+  return 1;
+}
+
+/* Number of visuals of a screen by class and by bits per RGB value. Unknown
+ * classes are counted together after the known ones. */
+struct x_visual_stats {
+  size_t num_visuals;
+  size_t classes[X_VISUAL_CLASS_DIRECT_COLOR + 2];
+  size_t bits_per_rgb_values[UINT8_MAX + 1];
+};
+
+/* Gather the statistics of the visuals of a screen in a single pass over the
+ * records of every depth, which are contiguous in the setup data. Only the
+ * aggregated fields are read instead of decoding whole visuals, and since they
+ * are single bytes they do not depend on the byte order. */
+static void x_visual_stats_compute(struct x_visual_stats *stats,
+                                   const struct x_screen_iterator *screen) {
+  memset(stats, 0, sizeof(*stats));
+  struct x_depth_iterator depth = x_depths_begin(screen);
+  while (x_depths_next(&depth)) {
+    const unsigned char *record = (const unsigned char *)depth.visuals;
+    const unsigned char *end =
+        record + depth.data.num_visuals * sizeof(struct x_visual_type);
+    for (; record != end; record += sizeof(struct x_visual_type)) {
+      unsigned int visual_class =
+          record[offsetof(struct x_visual_type, visual_class)];
+      if (visual_class > X_VISUAL_CLASS_DIRECT_COLOR)
+        visual_class = X_VISUAL_CLASS_DIRECT_COLOR + 1;
+      ++stats->classes[visual_class];
+      ++stats->bits_per_rgb_values[record[offsetof(struct x_visual_type,
+                                                   bits_per_rgb_value)]];
+    }
+    stats->num_visuals += depth.data.num_visuals;
   }
-  free(x_connection.setup_data.pixmap_formats);
-  free(x_connection.setup_data.vendor_name);
 }
 
-static void x_connect_to_socket(int fd, size_t protocol_name_len,
+/* Queue the connection setup request, which must be the first thing sent to
+ * the server. Returns non-zero on failure. */
+static int x_send_setup_request(struct x_connection *c,
+                                size_t protocol_name_len,
                                 const char *protocol_name, size_t auth_data_len,
                                 const char *auth_data) {
-  x_connection.fd = fd;
-
   /* Build the connection request to send to the X server */
   struct x_setup_request setup_request = {
-      .byte_order = 'l', /* little endian */
+      .byte_order = X_HOST_BYTE_ORDER,
       .protocol_version_major = X_VERSION_MAJOR,
       .protocol_version_minor = X_VERSION_MINOR,
       .auth_protocol_name_len = protocol_name_len,
       .auth_data_len = auth_data_len,
   };
-  size_t protocol_len = X_PAD(protocol_name_len);
-  size_t data_len = X_PAD(auth_data_len);
-  size_t total_request_size = sizeof(setup_request) + protocol_len + data_len;
-
   /* Put all the required data in a single buffer instead of needlessly calling
    * write multiple times for the initial data and then for the authentication
    * info */
-  char *request_buffer = calloc(total_request_size, 1);
-  if (!request_buffer) {
-    x_disconnect();
-    die("Memory allocation failed");
-  }
+  size_t protocol_len = X_PAD(protocol_name_len);
+  size_t data_len = X_PAD(auth_data_len);
+  char *request_buffer = output_buffer_reserve(
+      &c->output, sizeof(setup_request) + protocol_len + data_len);
+  if (!request_buffer)
+    return 1;
   memcpy(request_buffer, &setup_request, sizeof(setup_request));
   memcpy(request_buffer + sizeof(setup_request), protocol_name,
          protocol_name_len);
   memcpy(request_buffer + sizeof(setup_request) + protocol_len, auth_data,
          auth_data_len);
+  return 0;
+}
 
-  /* Send the connection request to the server */
-  ssize_t num_written =
-      write_n(x_connection.fd, request_buffer, total_request_size);
-  free(request_buffer);
-  if (num_written != (ssize_t)total_request_size)
-    die("Failed to send connection request to X server");
-
-  /* Read the connection setup response */
+/* Parse the connection setup response once it was received entirely. Returns
+ * zero on success, a positive value if the response is not complete yet and a
+ * negative value on failure, in which case a description of the problem is
+ * written to error. */
+static int x_receive_setup_response(struct x_connection *c, char *error,
+                                    size_t error_size) {
+  struct input_buffer *input = &c->input;
   struct x_setup_response response = {0};
-  ssize_t num_read = read_n(x_connection.fd, &response, sizeof(response));
-  if (num_read != sizeof(response)) {
-    x_disconnect();
-    die("Failed to read connection setup response from X server");
-  }
+  size_t available = input->end - input->start;
+  if (available < sizeof(response))
+    return 1;
+  const char *response_data = input->data + input->start;
+  memcpy(&response, response_data, sizeof(response));
 
-  /* Read additional data */
+  /* Wait for the additional data */
   size_t additional_data_len = 4 * response.additional_data_len;
-  char *additional_data = calloc(additional_data_len, 1);
-  if (!additional_data)
-    die("Memory allocation failed");
-  num_read = read_n(x_connection.fd, additional_data, additional_data_len);
-  if (num_read != (ssize_t)additional_data_len) {
-    free(additional_data);
-    x_disconnect();
-    die("Failed to read additional connection information from X server");
+  if (available < sizeof(response) + additional_data_len) {
+    input_buffer_want(input, sizeof(response) + additional_data_len);
+    return 1;
   }
+  const char *additional_data = response_data + sizeof(response);
+  input->start += sizeof(response) + additional_data_len;
 
   if (response.status != X_CONNECTION_STATUS_SUCCESS) {
-    fprintf(stderr, "ERROR: %s\n", additional_data);
-    free(additional_data);
-    x_disconnect();
-    die("Connection to X server failed");
-  }
-
-  x_connection.setup_data.version_major = response.protocol_version_major;
-  x_connection.setup_data.version_minor = response.protocol_version_minor;
-
-  /* Read the setup data header and the vendor name string */
-  const char *curr_data = additional_data;
-  memcpy(&x_connection.setup_data.data, curr_data,
-         sizeof(x_connection.setup_data.data));
-  curr_data += sizeof(x_connection.setup_data.data);
-  x_connection.setup_data.vendor_name =
-      calloc(x_connection.setup_data.data.vendor_length + 1, 1);
-  if (!x_connection.setup_data.vendor_name) {
-    free(additional_data);
-    x_disconnect();
-    die("Memory allocation failed");
+    size_t reason_len = response.failure_reason_length;
+    if (reason_len > additional_data_len)
+      reason_len = additional_data_len;
+    snprintf(error, error_size, "Connection to X server failed: %.*s",
+             (int)reason_len, additional_data);
+    return -1;
   }
-  memcpy(x_connection.setup_data.vendor_name, curr_data,
-         x_connection.setup_data.data.vendor_length);
-  curr_data += x_connection.setup_data.data.vendor_length;
 
-  /* Read the pixmap format data */
-  x_connection.setup_data.pixmap_formats = calloc(
-      x_connection.setup_data.data.num_pixmap_formats, sizeof(struct x_format));
-  if (!x_connection.setup_data.pixmap_formats) {
-    free(additional_data);
-    x_disconnect();
-    die("Memory allocation failed");
-  }
-  for (size_t i = 0; i < x_connection.setup_data.data.num_pixmap_formats; ++i) {
-    memcpy(&x_connection.setup_data.pixmap_formats[i], curr_data,
-           sizeof(struct x_format));
-    curr_data += sizeof(struct x_format);
+  c->setup_data.version_major = response.protocol_version_major;
+  c->setup_data.version_minor = response.protocol_version_minor;
+
+  /* Read the setup data header */
+  struct x_setup_data *setup_data = &c->setup_data;
+  if (additional_data_len < sizeof(setup_data->data)) {
+    snprintf(error, error_size,
+             "Invalid connection information received from X server");
+    return -1;
   }
+  memcpy(&setup_data->data, additional_data, sizeof(setup_data->data));
 
-  /* Read the screen data */
-  x_connection.setup_data.roots =
-      calloc(x_connection.setup_data.data.num_roots, sizeof(struct x_screen));
-  if (!x_connection.setup_data.roots) {
-    free(additional_data);
-    x_disconnect();
-    die("Memory allocation failed");
+  if (x_validate_setup_data(additional_data, additional_data_len,
+                            &setup_data->data) != 0) {
+    snprintf(error, error_size,
+             "Invalid connection information received from X server");
+    return -1;
   }
-  for (size_t i = 0; i < x_connection.setup_data.data.num_roots; ++i) {
-    struct x_screen *screen = &x_connection.setup_data.roots[i];
-    memcpy(&screen->data, curr_data, sizeof(struct x_screen_data));
-    curr_data += sizeof(struct x_screen_data);
-    /* Read allowed depths data */
-    screen->allowed_depths =
-        calloc(screen->data.num_allowed_depths, sizeof(struct x_depth));
-    if (!screen->allowed_depths) {
-      free(additional_data);
-      x_disconnect();
-      die("Memory allocation failed");
-    }
-    for (size_t j = 0; j < screen->data.num_allowed_depths; ++j) {
-      struct x_depth *depth = &screen->allowed_depths[j];
-      memcpy(&depth->data, curr_data, sizeof(struct x_depth_data));
-      curr_data += sizeof(struct x_depth_data);
-      /* Read visuals data */
-      depth->visuals =
-          calloc(depth->data.num_visuals, sizeof(struct x_visual_type));
-      if (!depth->visuals) {
-        free(additional_data);
-        x_disconnect();
-        die("Memory allocation failed");
-      }
-      for (size_t k = 0; k < depth->data.num_visuals; ++k) {
-        memcpy(&depth->visuals[k], curr_data, sizeof(struct x_visual_type));
-        curr_data += sizeof(struct x_visual_type);
-      }
-    }
+
+  /* Keep a copy of the raw setup data since the input view only lives until
+   * more data is received. Records are decoded lazily from this copy. */
+  setup_data->raw = malloc(additional_data_len);
+  if (!setup_data->raw) {
+    snprintf(error, error_size, "Memory allocation failed");
+    return -1;
   }
-  free(additional_data);
+  memcpy(setup_data->raw, additional_data, additional_data_len);
+  setup_data->raw_len = additional_data_len;
+  setup_data->vendor_name = setup_data->raw + sizeof(setup_data->data);
+  setup_data->pixmap_formats =
+      setup_data->vendor_name + X_PAD((size_t)setup_data->data.vendor_length);
+  setup_data->roots = setup_data->pixmap_formats +
+                      setup_data->data.num_pixmap_formats *
+                          sizeof(struct x_format);
+  return 0;
 }
 
-static void parse_x_display_name(const char *full_name, char *hostname,
-                                 size_t *hostname_len, unsigned long *number,
-                                 unsigned long *screen) {
+/* The components of a display name */
+struct x_display_name {
+  char hostname[HOST_NAME_MAX];
+  size_t hostname_len;
+  int is_local; /* Through a UNIX domain socket */
+  unsigned long number;
+  char number_string[24]; /* As found in Xauthority files */
+  size_t number_len;
+  unsigned long screen;
+};
+
+/* Split a display name into its components. Returns non-zero if the name is
+ * invalid, in which case error describes the problem. */
+static int parse_x_display_name(const char *full_name,
+                                struct x_display_name *name,
+                                const char **error) {
   /**
    * An X display string is of the form
    *     hostname:D.S
@@ -450,497 +1192,874 @@ static void parse_x_display_name(const char *full_name, char *hostname,
    * A name of the form hostname/unix:D.S indicates that the connection to the X
    * server has to go through a UNIX socket located at /tmp/.X11-unix/X$D
    * instead of being a TCP connection.
-   * :D.S is equivalent to localhost/unix:D.S.
+   * :D.S and unix:D.S are equivalent to localhost/unix:D.S.
    */
-  const char *curr = full_name;
-  while (*curr && *curr++ != ':')
-    *hostname_len += 1;
-  snprintf(hostname, *hostname_len, "%s", full_name);
+  const char *colon = strrchr(full_name, ':');
+  if (!colon) {
+    *error = "Missing X display sequence number in display name";
+    return 1;
+  }
+  size_t hostname_len = colon - full_name;
+  if (hostname_len >= HOST_NAME_MAX) {
+    *error = "Invalid host name in display name";
+    return 1;
+  }
 
+  /* Check whether we are connecting through a UNIX domain socket. If so, it
+   * must be to the local host, whose name is only looked up if needed. */
+  name->is_local = hostname_len == 0 ||
+                   (hostname_len == 4 && memcmp(full_name, "unix", 4) == 0) ||
+                   (hostname_len > 5 && memcmp(colon - 5, "/unix", 5) == 0);
+  name->hostname_len = name->is_local ? 0 : hostname_len;
+  memcpy(name->hostname, full_name, name->hostname_len);
+  name->hostname[name->hostname_len] = '\0';
+
+  const char *number = colon + 1;
   char *end = 0;
   errno = 0;
-  *number = strtoul(curr, &end, 10);
-  if (errno != 0)
-    die("Invalid X display sequence number in display name");
-  if(*end == '\0') {
-    *screen = 0;
-  } else {
-    curr = end + 1; /* Skip the dot */
-    *screen = strtoul(curr, 0, 10);
-    if (errno != 0)
-      die("Invalid X screen number in display name");
+  name->number = strtoul(number, &end, 10);
+  if (errno != 0 || end == number || (*end != '\0' && *end != '.')) {
+    *error = "Invalid X display sequence number in display name";
+    return 1;
+  }
+  name->number_len = end - number;
+  if (name->number_len >= sizeof(name->number_string)) {
+    *error = "Invalid X display sequence number in display name";
+    return 1;
   }
+  memcpy(name->number_string, number, name->number_len);
+  name->number_string[name->number_len] = '\0';
+
+  name->screen = 0;
+  if (*end == '.') {
+    const char *screen = end + 1;
+    name->screen = strtoul(screen, &end, 10);
+    if (errno != 0 || end == screen || *end != '\0') {
+      *error = "Invalid X screen number in display name";
+      return 1;
+    }
+  }
+  return 0;
 }
 
-static int get_socket_for_display(const char *full_display_name) {
-  char hostname[HOST_NAME_MAX] = {0};
-  size_t hostname_len = 0;
-  unsigned long number = 0;
-  unsigned long screen = 0;
-  parse_x_display_name(full_display_name, hostname, &hostname_len, &number,
-                       &screen);
-
-  /* Check whether we are connecting through a UNIX domain socket. If so, it
-   * must be to the local host. */
-  int is_unix_connection = hostname_len == 0;
-  if (hostname_len > 5 && hostname[hostname_len - 5] == '/' &&
-      hostname[hostname_len - 4] == 'u' && hostname[hostname_len - 3] == 'n' &&
-      hostname[hostname_len - 2] == 'i' && hostname[hostname_len - 1] == 'x')
-    is_unix_connection = 1;
-
-  int fd = -1;
-  if (is_unix_connection) {
-    fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (fd == -1)
-      die("Failed to create UNIX domain socket");
+/* An address at which an X server can be reached */
+struct x_address {
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+};
 
+/* Find the addresses to try, in order, to connect to the X server of a
+ * display. On success, the addresses are stored in a newly allocated array
+ * which must be freed by the caller. Returns non-zero on failure, in which
+ * case error describes the problem. */
+static int x_get_display_addresses(const struct x_display_name *name,
+                                   struct timings *timings,
+                                   struct x_address **addresses,
+                                   size_t *num_addresses, const char **error) {
+  if (name->is_local) {
+    *addresses = calloc(2, sizeof(struct x_address));
+    if (!*addresses) {
+      *error = "Memory allocation failed";
+      return 1;
+    }
+    *num_addresses = 0;
     struct sockaddr_un server_addr = {.sun_family = AF_UNIX};
-    char path[sizeof(server_addr.sun_path)] = {0};
-    snprintf(path, sizeof(path), "/tmp/.X11-unix/X%lu", number);
-    memcpy(server_addr.sun_path, path, sizeof(path));
+    int path_len = snprintf(server_addr.sun_path, sizeof(server_addr.sun_path),
+                            "/tmp/.X11-unix/X%lu", name->number);
+#ifdef __linux__
+    /* Servers on Linux also listen on the same path in the abstract namespace,
+     * which does not involve a file system lookup. It is tried first, like
+     * Xlib and XCB do. */
+    struct sockaddr_un abstract_addr = {.sun_family = AF_UNIX};
+    memcpy(abstract_addr.sun_path + 1, server_addr.sun_path, path_len);
+    struct x_address *abstract_address = &(*addresses)[(*num_addresses)++];
+    memcpy(&abstract_address->addr, &abstract_addr, sizeof(abstract_addr));
+    abstract_address->addr_len =
+        offsetof(struct sockaddr_un, sun_path) + 1 + path_len;
+#else
+    (void)path_len;
+#endif
+    struct x_address *address = &(*addresses)[(*num_addresses)++];
+    memcpy(&address->addr, &server_addr, sizeof(server_addr));
+    address->addr_len = sizeof(server_addr);
+    return 0;
+  }
 
-    if (connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) ==
-        -1) {
-      int errno_save = errno;
-      close(fd);
-      errno = errno_save;
-      die("Failed to connect to X server");
+  unsigned int port = X_BASE_TCP_PORT + name->number;
+  struct addrinfo hints = {
+      .ai_family = AF_UNSPEC,
+      .ai_socktype = SOCK_STREAM,
+      .ai_flags = AI_NUMERICHOST | AI_NUMERICSERV,
+      .ai_protocol = 0,
+  };
+  struct addrinfo *info = 0;
+  char port_string[16];
+  snprintf(port_string, sizeof(port_string), "%u", port);
+  /* Numeric addresses are converted without going through the resolver */
+  if (getaddrinfo(name->hostname, port_string, &hints, &info) != 0) {
+    hints.ai_flags = AI_V4MAPPED | AI_ADDRCONFIG | AI_NUMERICSERV;
+    double resolve_start = monotonic_now_ms();
+    if (getaddrinfo(name->hostname, port_string, &hints, &info) != 0) {
+      *error = "Failed to resolve X server host name";
+      return 1;
     }
-  } else {
-    unsigned int port = X_BASE_TCP_PORT + number;
-    struct addrinfo hints = {
-        .ai_family = AF_UNSPEC,
-        .ai_socktype = SOCK_STREAM,
-        .ai_flags = AI_V4MAPPED | AI_ADDRCONFIG,
-        .ai_protocol = 0,
-    };
-    struct addrinfo *info = 0;
-    char port_string[16];
-    snprintf(port_string, sizeof(port_string), "%u", port);
-    if (getaddrinfo(hostname, port_string, &hints, &info) != 0)
-      die("Failed to resolve X server host name");
-
-    /* Connect either via IPv4 or IPv6 depending on what is available and
-     * configured */
-    struct addrinfo *current_info = info;
-    for (; current_info != 0; current_info = current_info->ai_next) {
-      fd = socket(current_info->ai_family, current_info->ai_socktype,
-                  current_info->ai_protocol);
-      if (fd == -1)
+    timings_add_phase(timings, "Host name resolution", resolve_start);
+  }
+
+  /* Connect either via IPv4 or IPv6 depending on what is available and
+   * configured. The addresses are interleaved by family, starting with the
+   * preferred family of the resolver, so that a broken family cannot delay
+   * the connection for more than one attempt (see RFC 8305, section 4). */
+  size_t count = 0;
+  for (struct addrinfo *curr = info; curr != 0; curr = curr->ai_next)
+    ++count;
+  *addresses = calloc(count ? count : 1, sizeof(struct x_address));
+  if (!*addresses) {
+    freeaddrinfo(info);
+    *error = "Memory allocation failed";
+    return 1;
+  }
+  *num_addresses = 0;
+  int first_family = info ? info->ai_family : AF_UNSPEC;
+  int want_first_family = 1;
+  for (;;) {
+    struct addrinfo *chosen = 0;
+    struct addrinfo *fallback = 0;
+    for (struct addrinfo *curr = info; curr != 0 && !chosen;
+         curr = curr->ai_next) {
+      if (curr->ai_addrlen == 0 ||
+          curr->ai_addrlen > sizeof(struct sockaddr_storage))
         continue;
-      if (connect(fd, current_info->ai_addr, current_info->ai_addrlen) != -1)
-        break;
-      /* Connection failed, close the socket and try the next one */
-      close(fd);
+      if ((curr->ai_family == first_family) == want_first_family)
+        chosen = curr;
+      else if (!fallback)
+        fallback = curr;
     }
-    int failed = current_info == 0;
-    freeaddrinfo(info);
-    if (failed)
-      die("Failed to connect to X server");
+    if (!chosen)
+      chosen = fallback;
+    if (!chosen)
+      break;
+    struct x_address *address = &(*addresses)[(*num_addresses)++];
+    memcpy(&address->addr, chosen->ai_addr, chosen->ai_addrlen);
+    address->addr_len = chosen->ai_addrlen;
+    chosen->ai_addrlen = 0; /* Mark the address as used */
+    want_first_family = !want_first_family;
   }
-  return fd;
+  freeaddrinfo(info);
+  return 0;
 }
 
-static void x_connect_to_display_with_auth_data(const char *full_display_name,
-                                                size_t protocol_name_len,
-                                                const char *protocol_name,
-                                                size_t auth_data_len,
-                                                const char *auth_data) {
-  int fd = get_socket_for_display(full_display_name);
-  x_connect_to_socket(fd, protocol_name_len, protocol_name, auth_data_len,
-                      auth_data);
-}
+/* An entry of an Xauthority file. All strings point directly into the file
+ * contents and are not null-terminated. */
+struct xauth_entry {
+  uint16_t family;
+  uint16_t address_len;
+  const char *address;
+  uint16_t number_len;
+  const char *number;
+  uint16_t name_len;
+  const char *name;
+  uint16_t data_len;
+  const char *data;
+};
 
-static int readu16be(FILE *file, uint16_t *result) {
-  uint8_t res[2];
-  if (fread(res, 1, 2, file) != 2)
+/* Xauthority files store 16-bit integers in big endian order */
+static int xauth_read_u16(const char **curr, const char *end,
+                          uint16_t *result) {
+  if (end - *curr < 2)
     return 0;
-  *result = res[0] * 256 + res[1];
+  const uint8_t *bytes = (const uint8_t *)*curr;
+  *result = bytes[0] * 256 + bytes[1];
+  *curr += 2;
   return 1;
 }
 
-static int read_counted_string(FILE *file, uint16_t *length, char **string) {
-  if (!readu16be(file, length) || length == 0)
+static int xauth_read_counted_string(const char **curr, const char *end,
+                                     uint16_t *length, const char **string) {
+  if (!xauth_read_u16(curr, end, length) || end - *curr < *length)
     return 0;
-  *string = calloc(*length + 1, 1);
-  if (!*string)
-    die("Memory allocation failed");
-  if (fread(*string, 1, *length, file) != *length) {
-    free(*string);
-    return 0;
-  }
+  *string = *curr;
+  *curr += *length;
   return 1;
 }
 
-static void x_connect_to_display(const char *full_display_name) {
-  char hostname[HOST_NAME_MAX] = {0};
-  size_t hostname_len = 0;
-  unsigned long number = 0;
-  unsigned long screen = 0;
-  parse_x_display_name(full_display_name, hostname, &hostname_len, &number,
-                       &screen);
-
-  /* If there is no hostname in the display name then get the name of the local
-   * host */
-  if (hostname_len == 0)
-    gethostname(hostname, HOST_NAME_MAX);
-
-  /* Now that we have a valid host name, we can try to find the appropriate
-   * authentication method to connect to the selected display. We read the
-   * Xauthority file to determine which protocol and authentication data should
-   * be used. */
-  char *xauthority_path = getenv("XAUTHORITY");
-  if (!xauthority_path) {
-    /* If the path to the Xauthority file is not given in the environment, try
-     * in the user's home directory */
-    xauthority_path = "~/.Xauthority";
-  }
+/* Parse the entry starting at *curr in place and advance *curr past it.
+ * Returns zero if the entry is truncated. */
+static int xauth_parse_entry(const char **curr, const char *end,
+                             struct xauth_entry *entry) {
+  return xauth_read_u16(curr, end, &entry->family) &&
+         xauth_read_counted_string(curr, end, &entry->address_len,
+                                   &entry->address) &&
+         xauth_read_counted_string(curr, end, &entry->number_len,
+                                   &entry->number) &&
+         xauth_read_counted_string(curr, end, &entry->name_len,
+                                   &entry->name) &&
+         xauth_read_counted_string(curr, end, &entry->data_len, &entry->data);
+}
 
-  FILE *xauthority = fopen(xauthority_path, "rb");
-  if (!xauthority)
-    die("Failed to open Xauthority file");
+/* Address families of Xauthority entries. Local entries have the host name as
+ * address and wild entries match any address. */
+#define XAUTH_FAMILY_LOCAL 256
+#define XAUTH_FAMILY_WILD 65535
+
+/* What to look for in an Xauthority file */
+struct xauth_target {
+  int is_local;
+  const char *address;
+  size_t address_len;
+  const char *number;
+  size_t number_len;
+};
 
-  struct stat file_stat;
-  fstat(fileno(xauthority), &file_stat);
-  size_t file_size = file_stat.st_size;
+/* Match entries the way Xlib does: wild entries are used for any address,
+ * connections through a UNIX domain socket only use local entries, and entries
+ * without a display number are used for any display */
+static int xauth_family_matches(uint16_t family,
+                                const struct xauth_target *target) {
+  return family == XAUTH_FAMILY_WILD || !target->is_local ||
+         family == XAUTH_FAMILY_LOCAL;
+}
 
-  /* Go through the entire file and search for an entry that corresponds to our
-   * target display */
-  size_t auth_protocol_name_len = 0;
-  char *auth_protocol_name = 0;
-  size_t auth_data_len = 0;
-  char *auth_data = 0;
-  while (ftell(xauthority) != (long)file_size) {
-    uint16_t family;
-    uint16_t xauth_hostname_len;
-    char *xauth_hostname;
-    uint16_t xauth_number_len;
-    char *xauth_number;
-    uint16_t xauth_protocol_name_len;
-    char *xauth_protocol_name;
-    uint16_t xauth_data_len;
-    char *xauth_data;
-    if (readu16be(xauthority, &family) &&
-        read_counted_string(xauthority, &xauth_hostname_len, &xauth_hostname) &&
-        read_counted_string(xauthority, &xauth_number_len, &xauth_number) &&
-        read_counted_string(xauthority, &xauth_protocol_name_len,
-                            &xauth_protocol_name) &&
-        read_counted_string(xauthority, &xauth_data_len, &xauth_data)) {
-      if (strtoul(xauth_number, 0, 10) == number &&
-          strcmp(hostname, xauth_hostname) == 0) {
-        auth_protocol_name_len = xauth_protocol_name_len;
-        auth_protocol_name = xauth_protocol_name;
-        auth_data_len = xauth_data_len;
-        auth_data = xauth_data;
-      } else {
-        free(xauth_protocol_name);
-        free(xauth_data);
-      }
-      free(xauth_hostname);
-      free(xauth_number);
-    }
+static int xauth_entry_matches(const struct xauth_entry *entry,
+                               const struct xauth_target *target) {
+  int address_matches =
+      entry->family == XAUTH_FAMILY_WILD ||
+      (xauth_family_matches(entry->family, target) &&
+       entry->address_len == target->address_len &&
+       memcmp(entry->address, target->address, target->address_len) == 0);
+  return address_matches &&
+         (entry->number_len == 0 ||
+          (entry->number_len == target->number_len &&
+           memcmp(entry->number, target->number, target->number_len) == 0));
+}
+
+/* The optional Xauthority index maps the address and display number of every
+ * entry of an Xauthority file to the offset of the entry in the file, so that
+ * repeated lookups can go straight to the right entry instead of scanning the
+ * whole file. It is stored in the user cache directory and is only used while
+ * the device, inode, size and modification time of the Xauthority file match
+ * the ones recorded in its header. Otherwise it is rebuilt. */
+#define XAUTH_INDEX_MAGIC "XIDX"
+#define XAUTH_INDEX_VERSION 2
+
+struct xauth_index_header {
+  char magic[4];
+  uint32_t version;
+  uint64_t device;
+  uint64_t inode;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint32_t num_records;
+  uint32_t pad;
+};
+
+/* Records are sorted by key hash, then by offset. Entries sharing a key are
+ * all recorded, since the hash is only used to find candidates which are then
+ * checked against the Xauthority file itself. Wild entries are keyed with an
+ * empty address. */
+struct xauth_index_record {
+  uint32_t key_hash;
+  uint16_t family;
+  uint16_t pad;
+  uint32_t offset;
+};
+
+/* FNV-1a */
+static uint32_t hash_bytes(uint32_t hash, const void *data, size_t len) {
+  const uint8_t *bytes = data;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
   }
-  fclose(xauthority);
+  return hash;
+}
+
+static uint32_t xauth_key_hash(const char *address, size_t address_len,
+                               const char *number, size_t number_len) {
+  uint32_t hash = hash_bytes(2166136261u, address, address_len);
+  hash = hash_bytes(hash, "\0", 1);
+  return hash_bytes(hash, number, number_len);
+}
+
+static void xauth_index_fill_header(struct xauth_index_header *header,
+                                    const struct stat *file_stat,
+                                    uint32_t num_records) {
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, XAUTH_INDEX_MAGIC, sizeof(header->magic));
+  header->version = XAUTH_INDEX_VERSION;
+  header->device = file_stat->st_dev;
+  header->inode = file_stat->st_ino;
+  header->size = file_stat->st_size;
+  header->mtime_sec = file_stat->st_mtim.tv_sec;
+  header->mtime_nsec = file_stat->st_mtim.tv_nsec;
+  header->num_records = num_records;
+}
 
-  if (!auth_data) {
-    free(auth_protocol_name);
-    die("No X authentication data for the specified display");
+/* Compute the path of a file in the user cache directory. Returns non-zero if
+ * no cache directory is available. */
+static int cache_file_path(const char *name, char *path, size_t path_len,
+                           int create_directory) {
+  char cache_directory[PATH_MAX];
+  const char *xdg_cache_home = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (xdg_cache_home && xdg_cache_home[0] == '/')
+    snprintf(cache_directory, sizeof(cache_directory), "%s/xinfo",
+             xdg_cache_home);
+  else if (home && home[0] == '/')
+    snprintf(cache_directory, sizeof(cache_directory), "%s/.cache/xinfo",
+             home);
+  else
+    return 1;
+  if (create_directory) {
+    /* Create the parent directory too in case it is missing */
+    char *last_slash = strrchr(cache_directory, '/');
+    *last_slash = '\0';
+    mkdir(cache_directory, 0700);
+    *last_slash = '/';
+    mkdir(cache_directory, 0700);
   }
+  int len = snprintf(path, path_len, "%s/%s", cache_directory, name);
+  return len < 0 || (size_t)len >= path_len;
+}
 
-  x_connect_to_display_with_auth_data(full_display_name, auth_protocol_name_len,
-                                      auth_protocol_name, auth_data_len,
-                                      auth_data);
-  free(auth_protocol_name);
-  free(auth_data);
+/* Compute the path of the index of the given Xauthority file. Returns non-zero
+ * if no cache directory is available. */
+static int xauth_index_path(const char *xauthority_path, char *path,
+                            size_t path_len, int create_directory) {
+  /* Indexes are validated against the identity of the Xauthority file, so a
+   * name collision only results in the index being rebuilt */
+  uint32_t hash =
+      hash_bytes(2166136261u, xauthority_path, strlen(xauthority_path));
+  char name[32];
+  snprintf(name, sizeof(name), "xauthority-%08x.idx", (unsigned int)hash);
+  return cache_file_path(name, path, path_len, create_directory);
 }
 
-static const char *bool_to_string(int value) { return value ? "yes" : "no"; }
+/* Find the first candidate with the given key hash which matches the target
+ * among the sorted records of an index. Returns the offset of the entry in the
+ * Xauthority file, or the size of the file if there is none. */
+static size_t xauth_index_find_offset(const char *records, size_t num_records,
+                                      uint32_t key_hash, const char *data,
+                                      size_t size,
+                                      const struct xauth_target *target) {
+  size_t low = 0;
+  size_t high = num_records;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    struct xauth_index_record record;
+    memcpy(&record, records + middle * sizeof(record), sizeof(record));
+    if (record.key_hash < key_hash)
+      low = middle + 1;
+    else
+      high = middle;
+  }
 
-static void x_connect(void) {
-  /* The DISPLAY environment variable contains the name of the display on which
-   * the application was started */
-  char *display_name = getenv("DISPLAY");
-  if (!display_name) {
-    fprintf(stderr, "WARNING: No DISPLAY environment variable found, trying "
-                    "default X display name ':0'\n");
-    display_name = ":0";
+  /* Check the candidates against the Xauthority file, in file order */
+  for (size_t i = low; i < num_records; ++i) {
+    struct xauth_index_record record;
+    memcpy(&record, records + i * sizeof(record), sizeof(record));
+    if (record.key_hash != key_hash || record.offset >= size)
+      break;
+    /* Entries of other families are skipped without reading them */
+    if (!xauth_family_matches(record.family, target))
+      continue;
+    const char *curr = data + record.offset;
+    struct xauth_entry entry;
+    if (xauth_parse_entry(&curr, data + size, &entry) &&
+        xauth_entry_matches(&entry, target))
+      return record.offset;
   }
-  x_connect_to_display(display_name);
+  return size;
 }
 
-static unsigned int x_get_extension_opcode(const char *name) {
-  size_t name_len = strlen(name);
-  struct x_query_extension_request request = {
-      .opcode = X_OPCODE_QUERY_EXTENSION,
-      .request_len = 2 + (X_PAD(name_len) / 4),
-      .name_len = name_len,
-  };
-  unsigned int opcode = 0;
-  size_t request_len = sizeof(request) + X_PAD(name_len);
-  char *request_buffer = calloc(request_len, 1);
-  if (!request_buffer)
+/* Look up the first entry matching the target with the index. Returns a
+ * positive value if it is found, zero if the index is up to date but has no
+ * matching entry, and a negative value if the index is missing or stale for
+ * the current contents of the Xauthority file. */
+static int xauth_index_find_entry(const char *xauthority_path,
+                                  const struct stat *file_stat,
+                                  const char *data, size_t size,
+                                  const struct xauth_target *target,
+                                  struct xauth_entry *entry) {
+  char path[PATH_MAX];
+  if (xauth_index_path(xauthority_path, path, sizeof(path), 0) != 0)
+    return -1;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return -1;
+  struct stat index_stat;
+  if (fstat(fd, &index_stat) == -1 ||
+      (size_t)index_stat.st_size < sizeof(struct xauth_index_header)) {
+    close(fd);
+    return -1;
+  }
+  size_t index_size = index_stat.st_size;
+  char *index = mmap(0, index_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (index == MAP_FAILED)
+    return -1;
+
+  int found = -1;
+  struct xauth_index_header header;
+  struct xauth_index_header expected_header;
+  memcpy(&header, index, sizeof(header));
+  xauth_index_fill_header(&expected_header, file_stat, header.num_records);
+  if (memcmp(&header, &expected_header, sizeof(header)) != 0 ||
+      index_size != sizeof(header) + header.num_records *
+                                         sizeof(struct xauth_index_record))
     goto end;
-  struct x_query_extension_reply reply = {0};
+  found = 0;
+
+  /* A matching entry has either the address of the target or none if it is
+   * wild, and either its display number or none. The first one in the file
+   * wins, like when scanning it. */
+  const char *records = index + sizeof(header);
+  size_t offset = size;
+  for (int i = 0; i < 4; ++i) {
+    size_t address_len = i < 2 ? target->address_len : 0;
+    size_t number_len = i % 2 == 0 ? target->number_len : 0;
+    uint32_t key_hash = xauth_key_hash(target->address, address_len,
+                                       target->number, number_len);
+    size_t candidate = xauth_index_find_offset(
+        records, header.num_records, key_hash, data, size, target);
+    if (candidate < offset)
+      offset = candidate;
+  }
+  if (offset < size) {
+    const char *curr = data + offset;
+    found = xauth_parse_entry(&curr, data + size, entry);
+  }
+
+end:
+  munmap(index, index_size);
+  return found;
+}
 
-  memcpy(request_buffer, &request, sizeof(request));
-  memcpy(request_buffer + sizeof(request), name, name_len);
+static int xauth_index_record_comparator(const void *lhs, const void *rhs) {
+  const struct xauth_index_record *first = lhs;
+  const struct xauth_index_record *second = rhs;
+  if (first->key_hash != second->key_hash)
+    return first->key_hash < second->key_hash ? -1 : 1;
+  return first->offset < second->offset ? -1 : first->offset > second->offset;
+}
 
-  ssize_t num_written = write_n(x_connection.fd, request_buffer, request_len);
-  if (num_written != (long)request_len)
+/* Write the index of the given Xauthority file contents. Failures are silently
+ * ignored since the index is only an optimization. */
+static void xauth_index_write(const char *xauthority_path,
+                              const struct stat *file_stat, const char *data,
+                              size_t size) {
+  if (size > UINT32_MAX)
+    return;
+  size_t num_records = 0;
+  size_t capacity = 64;
+  struct xauth_index_record *records =
+      malloc(capacity * sizeof(struct xauth_index_record));
+  if (!records)
+    return;
+  const char *curr = data;
+  const char *end = data + size;
+  struct xauth_entry entry;
+  while (curr != end) {
+    uint32_t offset = curr - data;
+    if (!xauth_parse_entry(&curr, end, &entry))
+      break;
+    if (num_records == capacity) {
+      capacity *= 2;
+      struct xauth_index_record *new_records =
+          realloc(records, capacity * sizeof(struct xauth_index_record));
+      if (!new_records)
+        goto end;
+      records = new_records;
+    }
+    size_t address_len =
+        entry.family == XAUTH_FAMILY_WILD ? 0 : entry.address_len;
+    struct xauth_index_record record = {
+        .key_hash = xauth_key_hash(entry.address, address_len, entry.number,
+                                   entry.number_len),
+        .family = entry.family,
+        .offset = offset,
+    };
+    records[num_records++] = record;
+  }
+  qsort(records, num_records, sizeof(struct xauth_index_record),
+        xauth_index_record_comparator);
+
+  /* Write to a temporary file first so that concurrent runs never see a
+   * partially written index */
+  char path[PATH_MAX];
+  char temporary_path[PATH_MAX + 32];
+  if (xauth_index_path(xauthority_path, path, sizeof(path), 1) != 0)
     goto end;
-  ssize_t num_read = read_n(x_connection.fd, &reply, sizeof(reply));
-  if (num_read != sizeof(reply) || reply.status != X_REPLY)
+  snprintf(temporary_path, sizeof(temporary_path), "%s.%ld.tmp", path,
+           (long)getpid());
+  /* Only one thread writes a given file, the others skip it */
+  int fd = open(temporary_path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (fd == -1)
     goto end;
+  struct xauth_index_header header;
+  xauth_index_fill_header(&header, file_stat, num_records);
+  size_t records_size = num_records * sizeof(struct xauth_index_record);
+  int failed = write_n(fd, &header, sizeof(header)) != sizeof(header) ||
+               write_n(fd, records, records_size) != (ssize_t)records_size;
+  failed = close(fd) != 0 || failed;
+  if (failed || rename(temporary_path, path) != 0)
+    unlink(temporary_path);
 
-  if (reply.present)
-    opcode = reply.major_opcode;
 end:
-  free(request_buffer);
-  return opcode;
+  free(records);
 }
 
-struct x_big_requests_enable_request {
+/* Find the authentication protocol name and data to use for the given display
+ * in the Xauthority file. On success, both are copied contiguously into a
+ * single buffer which must be freed by the caller, or *auth_info is null if
+ * there is no Xauthority file or no matching entry, in which case the
+ * connection is attempted without authentication like Xlib does. Returns
+ * non-zero if the file cannot be read, in which case error describes the
+ * problem. */
+static int xauth_get_auth_info(const struct x_display_name *name,
+                               int use_index, char **auth_info,
+                               size_t *protocol_name_len, size_t *data_len,
+                               const char **error) {
+  *auth_info = 0;
+  *protocol_name_len = 0;
+  *data_len = 0;
+  char default_xauthority_path[PATH_MAX];
+  const char *xauthority_path = getenv("XAUTHORITY");
+  if (!xauthority_path || !xauthority_path[0]) {
+    /* If the path to the Xauthority file is not given in the environment, try
+     * in the user's home directory */
+    const char *home = getenv("HOME");
+    if (!home || !home[0])
+      return 0;
+    snprintf(default_xauthority_path, sizeof(default_xauthority_path),
+             "%s/.Xauthority", home);
+    xauthority_path = default_xauthority_path;
+  }
+
+  int xauthority_fd = open(xauthority_path, O_RDONLY);
+  if (xauthority_fd == -1) {
+    if (errno == ENOENT || errno == ENOTDIR)
+      return 0;
+    *error = "Failed to open Xauthority file";
+    return 1;
+  }
+  struct stat file_stat;
+  if (fstat(xauthority_fd, &file_stat) == -1) {
+    close(xauthority_fd);
+    *error = "Failed to open Xauthority file";
+    return 1;
+  }
+  size_t file_size = file_stat.st_size;
+  if (file_size == 0) {
+    close(xauthority_fd);
+    return 0;
+  }
+  char *xauthority =
+      mmap(0, file_size, PROT_READ, MAP_PRIVATE, xauthority_fd, 0);
+  close(xauthority_fd);
+  if (xauthority == MAP_FAILED) {
+    *error = "Failed to read Xauthority file";
+    return 1;
+  }
+
+  /* Local entries are recorded with the name of the local host, which is only
+   * needed now that there are entries to match */
+  char hostname[HOST_NAME_MAX] = {0};
+  struct xauth_target target = {
+      .is_local = name->is_local,
+      .address = name->hostname,
+      .address_len = name->hostname_len,
+      .number = name->number_string,
+      .number_len = name->number_len,
+  };
+  if (name->is_local) {
+    gethostname(hostname, sizeof(hostname) - 1);
+    target.address = hostname;
+    target.address_len = strlen(hostname);
+  }
+
+  /* Parse the entries in place and stop at the first one that corresponds to
+   * our target display, like Xlib does. When the index is enabled and up to
+   * date, the scan is skipped entirely, whether it has an entry or not. */
+  struct xauth_entry entry;
+  int found = use_index ? xauth_index_find_entry(xauthority_path, &file_stat,
+                                                 xauthority, file_size, &target,
+                                                 &entry)
+                        : -1;
+  if (found < 0) {
+    found = 0;
+    const char *curr = xauthority;
+    const char *end = xauthority + file_size;
+    while (curr != end && xauth_parse_entry(&curr, end, &entry)) {
+      if (xauth_entry_matches(&entry, &target)) {
+        found = 1;
+        break;
+      }
+    }
+    if (use_index)
+      xauth_index_write(xauthority_path, &file_stat, xauthority, file_size);
+  }
+
+  /* Only copy the authentication protocol name and data of the entry */
+  int failed = 0;
+  if (found) {
+    *auth_info = malloc(entry.name_len + entry.data_len + 1);
+    if (*auth_info) {
+      *protocol_name_len = entry.name_len;
+      *data_len = entry.data_len;
+      memcpy(*auth_info, entry.name, entry.name_len);
+      memcpy(*auth_info + entry.name_len, entry.data, entry.data_len);
+    } else {
+      *error = "Memory allocation failed";
+      failed = 1;
+    }
+  }
+  munmap(xauthority, file_size);
+  return failed;
+}
+
+/* Events that can be selected on a window, in the order of their bits */
+static const struct x_event_mask_info {
+  uint32_t mask;
+  const char *label; /* For text output */
+  const char *key;   /* For structured output */
+} x_event_masks[] = {
+    {X_EVENT_MASK_KEY_PRESS, "Key press", "key_press"},
+    {X_EVENT_MASK_KEY_RELEASE, "Key release", "key_release"},
+    {X_EVENT_MASK_BUTTON_PRESS, "Button press", "button_press"},
+    {X_EVENT_MASK_BUTTON_RELEASE, "Button release", "button_release"},
+    {X_EVENT_MASK_ENTER_WINDOW, "Enter window", "enter_window"},
+    {X_EVENT_MASK_LEAVE_WINDOW, "Leave window", "leave_window"},
+    {X_EVENT_MASK_POINTER_MOTION, "Pointer motion", "pointer_motion"},
+    {X_EVENT_MASK_POINTER_MOTION_HINT, "Pointer motion hint",
+     "pointer_motion_hint"},
+    {X_EVENT_MASK_BUTTON1_MOTION, "Button 1 motion", "button_1_motion"},
+    {X_EVENT_MASK_BUTTON2_MOTION, "Button 2 motion", "button_2_motion"},
+    {X_EVENT_MASK_BUTTON3_MOTION, "Button 3 motion", "button_3_motion"},
+    {X_EVENT_MASK_BUTTON4_MOTION, "Button 4 motion", "button_4_motion"},
+    {X_EVENT_MASK_BUTTON5_MOTION, "Button 5 motion", "button_5_motion"},
+    {X_EVENT_MASK_BUTTON_MOTION, "Button motion", "button_motion"},
+    {X_EVENT_MASK_KEYMAP_STATE, "Keymap state", "keymap_state"},
+    {X_EVENT_MASK_EXPOSURE, "Exposure", "exposure"},
+    {X_EVENT_MASK_VISIBILITY_CHANGE, "Visibility change", "visibility_change"},
+    {X_EVENT_MASK_STRUCTURE_NOTIFY, "Structure notify", "structure_notify"},
+    {X_EVENT_MASK_RESIZE_REDIRECT, "Resize redirect", "resize_redirect"},
+    {X_EVENT_MASK_SUBSTRUCTURE_NOTIFY, "Substructure notify",
+     "substructure_notify"},
+    {X_EVENT_MASK_SUBSTRUCTURE_REDIRECT, "Substructure redirect",
+     "substructure_redirect"},
+    {X_EVENT_MASK_FOCUS_CHANGE, "Focus change", "focus_change"},
+    {X_EVENT_MASK_PROPERTY_CHANGE, "Property change", "property_change"},
+    {X_EVENT_MASK_COLORMAP_CHANGE, "Colormap change", "colormap_change"},
+    {X_EVENT_MASK_OWNER_GRAB_BUTTON, "Owner grab button", "owner_grab_button"},
+};
+
+static const char *bool_to_string(int value) { return value ? "yes" : "no"; }
+
+static const char *visual_class_to_string(unsigned int visual_class) {
+  switch (visual_class) {
+  case X_VISUAL_CLASS_STATIC_GRAY:
+    return "StaticGray";
+  case X_VISUAL_CLASS_GRAY_SCALE:
+    return "GrayScale";
+  case X_VISUAL_CLASS_STATIC_COLOR:
+    return "StaticColor";
+  case X_VISUAL_CLASS_PSEUDO_COLOR:
+    return "PseudoColor";
+  case X_VISUAL_CLASS_TRUE_COLOR:
+    return "TrueColor";
+  case X_VISUAL_CLASS_DIRECT_COLOR:
+    return "DirectColor";
+  default:
+    return "unknown";
+  }
+}
+
+struct x_randr_get_screen_resources_current_request {
   uint8_t opcode;
   uint8_t extension_opcode;
   uint16_t request_len;
+  uint32_t window;
 };
 
-struct x_big_requests_enable_reply {
+/* Followed by the CRTCs, the outputs, the modes and the mode names */
+struct x_randr_get_screen_resources_current_reply {
   uint8_t status;
   uint8_t pad1;
   uint16_t sequence_number;
-  uint32_t additional_data_len;
-  uint32_t max_request_len;
-  uint8_t pad[18];
+  uint32_t data_len;
+  uint32_t timestamp;
+  uint32_t config_timestamp;
+  uint16_t num_crtcs;
+  uint16_t num_outputs;
+  uint16_t num_modes;
+  uint16_t names_len;
+  uint8_t pad2[8];
+};
+
+struct x_randr_mode_info {
+  uint32_t id;
+  uint16_t width;
+  uint16_t height;
+  uint32_t dot_clock;
+  uint16_t hsync_start;
+  uint16_t hsync_end;
+  uint16_t htotal;
+  uint16_t hskew;
+  uint16_t vsync_start;
+  uint16_t vsync_end;
+  uint16_t vtotal;
+  uint16_t name_len;
+  uint32_t mode_flags;
 };
 
-struct x_xtest_query_version_request {
+#define X_RANDR_MODE_FLAG_INTERLACE 0x00000010u
+#define X_RANDR_MODE_FLAG_DOUBLE_SCAN 0x00000020u
+
+/* Also used for RRGetOutputInfo */
+struct x_randr_get_crtc_info_request {
   uint8_t opcode;
   uint8_t extension_opcode;
   uint16_t request_len;
-  uint8_t version_major;
-  uint8_t pad;
-  uint16_t version_minor;
+  uint32_t crtc;
+  uint32_t config_timestamp;
 };
 
-struct x_xtest_query_version_reply {
+#define X_RANDR_SET_CONFIG_SUCCESS 0
+
+struct x_randr_get_crtc_info_reply {
+  uint8_t reply_type;
   uint8_t status;
-  uint8_t version_major;
   uint16_t sequence_number;
-  uint32_t additional_data_len;
-  uint16_t version_minor;
-  uint8_t pad[22];
+  uint32_t data_len;
+  uint32_t timestamp;
+  int16_t x;
+  int16_t y;
+  uint16_t width;
+  uint16_t height;
+  uint32_t mode;
+  uint16_t rotation;
+  uint16_t rotations;
+  uint16_t num_outputs;
+  uint16_t num_possible_outputs;
+};
+
+#define X_RANDR_CONNECTED 0
+#define X_RANDR_DISCONNECTED 1
+
+/* Followed by the CRTCs, the modes and the clones of the output, then by its
+ * name */
+struct x_randr_get_output_info_reply {
+  uint8_t reply_type;
+  uint8_t status;
+  uint16_t sequence_number;
+  uint32_t data_len;
+  uint32_t timestamp;
+  uint32_t crtc;
+  uint32_t mm_width;
+  uint32_t mm_height;
+  uint8_t connection;
+  uint8_t subpixel_order;
+  uint16_t num_crtcs;
+  uint16_t num_modes;
+  uint16_t num_preferred;
+  uint16_t num_clones;
+  uint16_t name_len;
 };
 
-struct x_generic_query_version8_request {
+struct x_xinerama_query_screens_request {
   uint8_t opcode;
   uint8_t extension_opcode;
   uint16_t request_len;
-  uint8_t version_major;
-  uint8_t version_minor;
-  uint16_t pad;
 };
 
-struct x_generic_query_version8_reply {
+/* Followed by the screens */
+struct x_xinerama_query_screens_reply {
   uint8_t status;
   uint8_t pad1;
   uint16_t sequence_number;
-  uint32_t additional_data_len;
-  uint8_t version_major;
-  uint8_t version_minor;
-  uint8_t pad[22];
+  uint32_t data_len;
+  uint32_t num_screens;
+  uint8_t pad2[20];
+};
+
+struct x_xinerama_screen_info {
+  int16_t x;
+  int16_t y;
+  uint16_t width;
+  uint16_t height;
 };
 
-struct x_generic_query_version16_request {
+/* Also used for XResQueryVersion */
+struct x_xres_query_clients_request {
   uint8_t opcode;
   uint8_t extension_opcode;
   uint16_t request_len;
-  uint16_t version_major;
-  uint16_t version_minor;
 };
 
-struct x_generic_query_version16_reply {
+/* Followed by the clients */
+struct x_xres_query_clients_reply {
   uint8_t status;
   uint8_t pad1;
   uint16_t sequence_number;
-  uint32_t additional_data_len;
-  uint16_t version_major;
-  uint16_t version_minor;
-  uint8_t pad[20];
+  uint32_t data_len;
+  uint32_t num_clients;
+  uint8_t pad2[20];
+};
+
+struct x_xres_client {
+  uint32_t resource_base;
+  uint32_t resource_mask;
 };
 
-struct x_generic_query_version32_request {
+/* Also used for XResQueryClientPixmapBytes */
+struct x_xres_query_client_resources_request {
   uint8_t opcode;
   uint8_t extension_opcode;
   uint16_t request_len;
-  uint32_t version_major;
-  uint32_t version_minor;
+  uint32_t xid;
 };
 
-struct x_generic_query_version32_reply {
+/* Followed by the number of resources of every type */
+struct x_xres_query_client_resources_reply {
   uint8_t status;
   uint8_t pad1;
   uint16_t sequence_number;
-  uint32_t additional_data_len;
-  uint32_t version_major;
-  uint32_t version_minor;
-  uint8_t pad[16];
+  uint32_t data_len;
+  uint32_t num_types;
+  uint8_t pad2[20];
 };
 
-struct x_generic_query_version16_noparam_request {
-  uint8_t opcode;
-  uint8_t extension_opcode;
-  uint16_t request_len;
+struct x_xres_type {
+  uint32_t resource_type;
+  uint32_t count;
 };
 
-struct x_generic_query_version16_noparam_reply {
+struct x_xres_query_client_pixmap_bytes_reply {
   uint8_t status;
   uint8_t pad1;
   uint16_t sequence_number;
-  uint32_t additional_data_len;
-  uint16_t version_major;
-  uint16_t version_minor;
-  uint8_t pad[20];
+  uint32_t data_len;
+  uint32_t bytes;
+  uint32_t bytes_overflow; /* High 32 bits */
+  uint8_t pad2[16];
 };
 
-struct x_generic_query_version32_noparam_request {
+struct x_big_requests_enable_request {
   uint8_t opcode;
   uint8_t extension_opcode;
   uint16_t request_len;
 };
 
-struct x_generic_query_version32_noparam_reply {
+struct x_big_requests_enable_reply {
   uint8_t status;
   uint8_t pad1;
   uint16_t sequence_number;
   uint32_t additional_data_len;
-  uint32_t version_major;
-  uint32_t version_minor;
-  uint8_t pad[16];
-};
-
-static int generic_query_version8(unsigned int opcode,
-                                  unsigned int extension_opcode,
-                                  unsigned int *version_major,
-                                  unsigned int *version_minor) {
-  struct x_generic_query_version8_request request = {
-      .opcode = opcode,
-      .extension_opcode = extension_opcode,
-      .request_len = sizeof(struct x_generic_query_version8_request) / 4,
-      .version_major = (uint8_t)-1,
-      .version_minor = (uint8_t)-1,
-  };
-  struct x_generic_query_version8_reply reply = {0};
-
-  ssize_t num_written = write_n(x_connection.fd, &request, sizeof(request));
-  if (num_written != sizeof(request))
-    return 1;
-  ssize_t num_read = read_n(x_connection.fd, &reply, sizeof(reply));
-  if (num_read != sizeof(reply) || reply.status != X_REPLY)
-    return 1;
-  *version_major = reply.version_major;
-  *version_minor = reply.version_minor;
-
-  return 0;
-}
-
-static int generic_query_version16(unsigned int opcode,
-                                   unsigned int extension_opcode,
-                                   unsigned int *version_major,
-                                   unsigned int *version_minor) {
-  struct x_generic_query_version16_request request = {
-      .opcode = opcode,
-      .extension_opcode = extension_opcode,
-      .request_len = sizeof(struct x_generic_query_version16_request) / 4,
-      .version_major = (uint16_t)-1,
-      .version_minor = (uint16_t)-1,
-  };
-  struct x_generic_query_version16_reply reply = {0};
-
-  ssize_t num_written = write_n(x_connection.fd, &request, sizeof(request));
-  if (num_written != sizeof(request))
-    return 1;
-  ssize_t num_read = read_n(x_connection.fd, &reply, sizeof(reply));
-  if (num_read != sizeof(reply) || reply.status != X_REPLY)
-    return 1;
-  *version_major = reply.version_major;
-  *version_minor = reply.version_minor;
-
-  return 0;
-}
-
-static int generic_query_version32(unsigned int opcode,
-                                   unsigned int extension_opcode,
-                                   unsigned int *version_major,
-                                   unsigned int *version_minor) {
-  struct x_generic_query_version32_request request = {
-      .opcode = opcode,
-      .extension_opcode = extension_opcode,
-      .request_len = sizeof(struct x_generic_query_version32_request) / 4,
-      .version_major = (uint32_t)-1,
-      .version_minor = (uint32_t)-1,
-  };
-  struct x_generic_query_version32_reply reply = {0};
-
-  ssize_t num_written = write_n(x_connection.fd, &request, sizeof(request));
-  if (num_written != sizeof(request))
-    return 1;
-  ssize_t num_read = read_n(x_connection.fd, &reply, sizeof(reply));
-  if (num_read != sizeof(reply) || reply.status != X_REPLY)
-    return 1;
-  *version_major = reply.version_major;
-  *version_minor = reply.version_minor;
-
-  return 0;
-}
-
-static int generic_query_version16_noparam(unsigned int opcode,
-                                           unsigned int extension_opcode,
-                                           unsigned int *major,
-                                           unsigned int *minor) {
-  struct x_generic_query_version16_noparam_request request = {
-      .opcode = opcode,
-      .extension_opcode = extension_opcode,
-      .request_len =
-          sizeof(struct x_generic_query_version16_noparam_request) / 4,
-  };
-  struct x_generic_query_version16_noparam_reply reply = {0};
-
-  ssize_t num_written = write_n(x_connection.fd, &request, sizeof(request));
-  if (num_written != sizeof(request))
-    return 1;
-  ssize_t num_read = read_n(x_connection.fd, &reply, sizeof(reply));
-  if (num_read != sizeof(reply) || reply.status != X_REPLY)
-    return 1;
-
-  *major = reply.version_major;
-  *minor = reply.version_minor;
-  return 0;
-}
-
-static int generic_query_version32_noparam(unsigned int opcode,
-                                           unsigned int extension_opcode,
-                                           unsigned int *major,
-                                           unsigned int *minor) {
-  struct x_generic_query_version32_noparam_request request = {
-      .opcode = opcode,
-      .extension_opcode = extension_opcode,
-      .request_len =
-          sizeof(struct x_generic_query_version32_noparam_request) / 4,
-  };
-  struct x_generic_query_version32_noparam_reply reply = {0};
-
-  ssize_t num_written = write_n(x_connection.fd, &request, sizeof(request));
-  if (num_written != sizeof(request))
-    return 1;
-  ssize_t num_read = read_n(x_connection.fd, &reply, sizeof(reply));
-  if (num_read != sizeof(reply) || reply.status != X_REPLY)
-    return 1;
-
-  *major = reply.version_major;
-  *minor = reply.version_minor;
-  return 0;
-}
+  uint32_t max_request_len;
+  uint8_t pad[18];
+};
 
 #define X_EXTENSION_NAME_APPLE_DRI "Apple-DRI"
 #define X_EXTENSION_NAME_APPLE_WM "Apple-WM"
@@ -997,617 +2116,4785 @@ static int generic_query_version32_noparam(unsigned int opcode,
 #define X_OPCODE_BIG_REQUESTS_ENABLE 0
 #define X_OPCODE_GLX_QUERY_VERSION 7
 #define X_OPCODE_MIT_SCREEN_SAVER_QUERY_VERSION 0
+#define X_OPCODE_RANDR_GET_OUTPUT_INFO 9
+#define X_OPCODE_RANDR_GET_CRTC_INFO 20
+#define X_OPCODE_RANDR_GET_SCREEN_RESOURCES_CURRENT 25
 #define X_OPCODE_SELINUX_QUERY_VERSION 0
 #define X_OPCODE_XINPUT_EXTENSION_QUERY_VERSION 47
+#define X_OPCODE_XINERAMA_QUERY_SCREENS 5
+#define X_OPCODE_X_RESOURCE_QUERY_CLIENTS 1
+#define X_OPCODE_X_RESOURCE_QUERY_CLIENT_RESOURCES 2
+#define X_OPCODE_X_RESOURCE_QUERY_CLIENT_PIXMAP_BYTES 3
 #define X_OPCODE_XTEST_QUERY_VERSION 0
 
-/* Most extensions use zero as the opcode for the version query request. Provide
- * generic wrappers instead of duplicating functions */
-static int x_generic_query_version8_zero(unsigned int opcode,
-                                         unsigned int *major,
-                                         unsigned int *minor) {
-  return generic_query_version8(opcode, 0, major, minor) != 0;
-}
-static int x_generic_query_version16_zero(unsigned int opcode,
-                                          unsigned int *major,
-                                          unsigned int *minor) {
-  return generic_query_version16(opcode, 0, major, minor) != 0;
-}
-static int x_generic_query_version32_zero(unsigned int opcode,
-                                          unsigned int *major,
-                                          unsigned int *minor) {
-  return generic_query_version32(opcode, 0, major, minor) != 0;
-}
-static int x_generic_query_version16_noparam_zero(unsigned int opcode,
-                                                  unsigned int *major,
-                                                  unsigned int *minor) {
-  return generic_query_version16_noparam(opcode, 0, major, minor) != 0;
-}
-static int x_generic_query_version32_noparam_zero(unsigned int opcode,
-                                                  unsigned int *major,
-                                                  unsigned int *minor) {
-  return generic_query_version32_noparam(opcode, 0, major, minor) != 0;
-}
-
-static int x_big_request_query_version(unsigned int opcode, unsigned int *major,
-                                       unsigned int *minor) {
-  (void)opcode;
-  *major = 2;
-  *minor = 0;
-  return 0;
-}
-
-static int x_glx_query_version(unsigned int opcode, unsigned int *major,
-                               unsigned int *minor) {
-  return generic_query_version32(opcode, X_OPCODE_GLX_QUERY_VERSION, major,
-                                 minor) != 0;
-}
+/* A field of a request or a reply, as an offset and a width in bytes. Fields
+ * of width zero are absent. */
+struct x_field {
+  uint8_t offset;
+  uint8_t width;
+};
 
-static int x_xinput_extension_query_version(unsigned int opcode,
-                                            unsigned int *major,
-                                            unsigned int *minor) {
-  return generic_query_version16(opcode,
-                                 X_OPCODE_XINPUT_EXTENSION_QUERY_VERSION, major,
-                                 minor) != 0;
-}
+#define X_VERSION_QUERIED 0 /* Through a version query request */
+#define X_VERSION_KNOWN 1   /* Without asking the server */
+#define X_VERSION_UNKNOWN 2
+
+/* Description of the version query request of an extension and of its reply.
+ * Requests are made of the major opcode of the extension, the minor opcode of
+ * the request and its length, followed by the client version fields, which
+ * are always set to their highest possible value. Extension version queries
+ * are split into an encoding and a decoding step so that the requests for all
+ * extensions can be sent in a single batch before any reply is read. */
+struct x_version_codec {
+  uint8_t source;
+  uint8_t minor_opcode;
+  struct x_field request_major;
+  struct x_field request_minor;
+  struct x_field reply_major;
+  struct x_field reply_minor;
+  uint8_t known_major; /* Only for X_VERSION_KNOWN */
+  uint8_t known_minor;
+};
 
-static int x_mit_screen_saver_query_version(unsigned int opcode,
-                                            unsigned int *major,
-                                            unsigned int *minor) {
-  struct x_generic_query_version8_request request = {
-      .opcode = opcode,
-      .extension_opcode = X_OPCODE_MIT_SCREEN_SAVER_QUERY_VERSION,
-      .request_len = sizeof(struct x_generic_query_version8_request) / 4,
-      .version_major = (uint8_t)-1,
-      .version_minor = (uint8_t)-1,
-  };
-  struct x_generic_query_version16_reply reply = {0};
+/* Most extensions follow the same layout, with the client version right after
+ * the request header and the server version right after the reply header,
+ * both made of two fields of the given width */
+#define X_VERSION_QUERY(minor_opcode_, request_width, reply_width)             \
+  {                                                                            \
+    .source = X_VERSION_QUERIED, .minor_opcode = (minor_opcode_),             \
+    .request_major = {4, (request_width)},                                     \
+    .request_minor = {4 + (request_width), (request_width)},                   \
+    .reply_major = {8, (reply_width)},                                         \
+    .reply_minor = {8 + (reply_width), (reply_width)},                         \
+  }
 
-  ssize_t num_written = write_n(x_connection.fd, &request, sizeof(request));
-  if (num_written != sizeof(request))
-    return 1;
-  ssize_t num_read = read_n(x_connection.fd, &reply, sizeof(reply));
-  if (num_read != sizeof(reply) || reply.status != X_REPLY)
-    return 1;
+#define X_VERSION_QUERY_MAX_LEN 12
 
-  *major = reply.version_major;
-  *minor = reply.version_minor;
-  return 0;
+/* Write the version query request of an extension into the given buffer.
+ * Returns its size in bytes, or 0 if no request needs to be sent. */
+static size_t x_encode_version_query(const struct x_version_codec *codec,
+                                     unsigned int opcode, char *buffer) {
+  if (codec->source != X_VERSION_QUERIED)
+    return 0;
+  memset(buffer, 0, X_VERSION_QUERY_MAX_LEN);
+  buffer[0] = opcode;
+  buffer[1] = codec->minor_opcode;
+  /* The highest value of an unsigned field has all its bits set, whatever its
+   * width and the byte order */
+  memset(buffer + codec->request_major.offset, 0xff,
+         codec->request_major.width);
+  memset(buffer + codec->request_minor.offset, 0xff,
+         codec->request_minor.width);
+  size_t len = codec->request_minor.offset + codec->request_minor.width;
+  if (len < 4u + codec->request_major.width)
+    len = 4u + codec->request_major.width;
+  uint16_t request_len = X_PAD(len) / 4;
+  memcpy(buffer + 2, &request_len, sizeof(request_len));
+  return X_PAD(len);
 }
 
-static int x_selinux_query_version(unsigned int opcode, unsigned int *major,
-                                   unsigned int *minor) {
-  struct x_generic_query_version8_request request = {
-      .opcode = opcode,
-      .extension_opcode = X_OPCODE_SELINUX_QUERY_VERSION,
-      .request_len = sizeof(struct x_generic_query_version8_request) / 4,
-      .version_major = (uint8_t)-1,
-      .version_minor = (uint8_t)-1,
-  };
-  struct x_generic_query_version16_reply reply = {0};
-
-  ssize_t num_written = write_n(x_connection.fd, &request, sizeof(request));
-  if (num_written != sizeof(request))
-    return 1;
-  ssize_t num_read = read_n(x_connection.fd, &reply, sizeof(reply));
-  if (num_read != sizeof(reply) || reply.status != X_REPLY)
-    return 1;
-
-  *major = reply.version_major;
-  *minor = reply.version_minor;
-  return 0;
+static unsigned int x_field_decode(const char *data, struct x_field field) {
+  uint8_t value8;
+  uint16_t value16;
+  uint32_t value32;
+  switch (field.width) {
+  case 1:
+    memcpy(&value8, data + field.offset, sizeof(value8));
+    return value8;
+  case 2:
+    memcpy(&value16, data + field.offset, sizeof(value16));
+    return value16;
+  case 4:
+    memcpy(&value32, data + field.offset, sizeof(value32));
+    return value32;
+  default:
+    return 0;
+  }
 }
 
-static int x_xtest_query_version(unsigned int opcode, unsigned int *major,
-                                 unsigned int *minor) {
-  struct x_xtest_query_version_request request = {
-      .opcode = opcode,
-      .extension_opcode = X_OPCODE_XTEST_QUERY_VERSION,
-      .request_len = sizeof(struct x_xtest_query_version_request) / 4,
-      .version_major = (uint8_t)-1,
-      .version_minor = (uint16_t)-1,
-  };
-  struct x_xtest_query_version_reply reply = {0};
-
-  ssize_t num_written = write_n(x_connection.fd, &request, sizeof(request));
-  if (num_written != sizeof(request))
-    return 1;
-  ssize_t num_read = read_n(x_connection.fd, &reply, sizeof(reply));
-  if (num_read != sizeof(reply) || reply.status != X_REPLY)
+/* Extract the version of an extension from a 32-byte reply, which is null if
+ * no request was sent. Returns non-zero on failure. */
+static int x_decode_version_reply(const struct x_version_codec *codec,
+                                  const char *reply, unsigned int *major,
+                                  unsigned int *minor) {
+  switch (codec->source) {
+  case X_VERSION_QUERIED:
+    *major = x_field_decode(reply, codec->reply_major);
+    *minor = x_field_decode(reply, codec->reply_minor);
+    return 0;
+  case X_VERSION_KNOWN:
+    *major = codec->known_major;
+    *minor = codec->known_minor;
+    return 0;
+  default:
+    *major = 0;
+    *minor = 0;
     return 1;
-
-  *major = reply.version_major;
-  *minor = reply.version_minor;
-  return 0;
-}
-
-static int x_invalid_query_version(unsigned int opcode, unsigned int *major,
-                                   unsigned int *minor) {
-  (void)opcode;
-  *major = 0;
-  *minor = 0;
-  return 1;
+  }
 }
 
 struct x_extension_info {
   const char *name;
-  int (*version_query_func)(unsigned int opcode, unsigned int *major,
-                            unsigned int *minor);
+  struct x_version_codec version;
 };
 
-static struct x_extension_info x_extensions[] = {
-    {.name = X_EXTENSION_NAME_APPLE_DRI,
-     .version_query_func = x_generic_query_version16_noparam_zero},
-    {.name = X_EXTENSION_NAME_APPLE_WM,
-     .version_query_func = x_generic_query_version16_noparam_zero},
+/* Most extensions use zero as the opcode for the version query request */
+#define X_EXTENSION_VERSION8 .version = X_VERSION_QUERY(0, 1, 1)
+#define X_EXTENSION_VERSION16 .version = X_VERSION_QUERY(0, 2, 2)
+#define X_EXTENSION_VERSION32 .version = X_VERSION_QUERY(0, 4, 4)
+#define X_EXTENSION_VERSION16_NOPARAM .version = X_VERSION_QUERY(0, 0, 2)
+#define X_EXTENSION_VERSION32_NOPARAM .version = X_VERSION_QUERY(0, 0, 4)
+#define X_EXTENSION_VERSION_GLX                                                \
+  .version = X_VERSION_QUERY(X_OPCODE_GLX_QUERY_VERSION, 4, 4)
+
+/* Known extensions. This table must be kept sorted by name in strcmp order,
+ * which is the order ListExtensions results are sorted in, so that lookups can
+ * use a binary search */
+static const struct x_extension_info x_extensions[] = {
+    {.name = X_EXTENSION_NAME_APPLE_DRI, X_EXTENSION_VERSION16_NOPARAM},
+    {.name = X_EXTENSION_NAME_APPLE_WM, X_EXTENSION_VERSION16_NOPARAM},
     {.name = X_EXTENSION_NAME_BIG_REQUESTS,
-     .version_query_func = x_big_request_query_version},
-    {.name = X_EXTENSION_NAME_COMPOSITE,
-     .version_query_func = x_generic_query_version32_zero},
-    {.name = X_EXTENSION_NAME_DAMAGE,
-     .version_query_func = x_generic_query_version32_zero},
-    {.name = X_EXTENSION_NAME_DOUBLE_BUFFER,
-     .version_query_func = x_generic_query_version8_zero},
-    {.name = X_EXTENSION_NAME_DPMS,
-     .version_query_func = x_generic_query_version16_zero},
-    {.name = X_EXTENSION_NAME_DMX,
-     .version_query_func = x_generic_query_version32_noparam_zero},
-    {.name = X_EXTENSION_NAME_DRI2,
-     .version_query_func = x_generic_query_version32_zero},
-    {.name = X_EXTENSION_NAME_DRI3,
-     .version_query_func = x_generic_query_version32_zero},
+     .version = {.source = X_VERSION_KNOWN, .known_major = 2}},
+    {.name = X_EXTENSION_NAME_COMPOSITE, X_EXTENSION_VERSION32},
+    {.name = X_EXTENSION_NAME_DAMAGE, X_EXTENSION_VERSION32},
+    {.name = X_EXTENSION_NAME_DMX, X_EXTENSION_VERSION32_NOPARAM},
+    {.name = X_EXTENSION_NAME_DOUBLE_BUFFER, X_EXTENSION_VERSION8},
+    {.name = X_EXTENSION_NAME_DPMS, X_EXTENSION_VERSION16},
+    {.name = X_EXTENSION_NAME_DRI2, X_EXTENSION_VERSION32},
+    {.name = X_EXTENSION_NAME_DRI3, X_EXTENSION_VERSION32},
     {.name = X_EXTENSION_NAME_EXTENDED_VISUAL_INFORMATION,
-     .version_query_func = x_generic_query_version16_noparam_zero},
-    {.name = X_EXTENSION_NAME_FONT_CACHE,
-     .version_query_func = x_generic_query_version16_noparam_zero},
-    {.name = X_EXTENSION_NAME_GLX, .version_query_func = x_glx_query_version},
-    {.name = X_EXTENSION_NAME_GENERIC_EVENT_EXTENSION,
-     .version_query_func = x_generic_query_version16_zero},
-    {.name = X_EXTENSION_NAME_LBX,
-     .version_query_func = x_generic_query_version16_noparam_zero},
-    {.name = X_EXTENSION_NAME_LGE,
-     .version_query_func = x_generic_query_version32_noparam_zero},
+     X_EXTENSION_VERSION16_NOPARAM},
+    {.name = X_EXTENSION_NAME_FONT_CACHE, X_EXTENSION_VERSION16_NOPARAM},
+    {.name = X_EXTENSION_NAME_GLX, X_EXTENSION_VERSION_GLX},
+    {.name = X_EXTENSION_NAME_GENERIC_EVENT_EXTENSION, X_EXTENSION_VERSION16},
+    {.name = X_EXTENSION_NAME_LBX, X_EXTENSION_VERSION16_NOPARAM},
+    {.name = X_EXTENSION_NAME_LGE, X_EXTENSION_VERSION32_NOPARAM},
+    /* 8-bit client versions and 16-bit server versions */
     {.name = X_EXTENSION_NAME_MIT_SCREEN_SAVER,
-     .version_query_func = x_mit_screen_saver_query_version},
-    {.name = X_EXTENSION_NAME_MIT_SHM,
-     .version_query_func = x_generic_query_version16_noparam_zero},
-    {.name = X_EXTENSION_NAME_NV_CONTROL,
-     .version_query_func = x_generic_query_version16_noparam_zero},
+     .version = X_VERSION_QUERY(X_OPCODE_MIT_SCREEN_SAVER_QUERY_VERSION, 1, 2)},
+    {.name = X_EXTENSION_NAME_MIT_SHM, X_EXTENSION_VERSION16_NOPARAM},
+    {.name = X_EXTENSION_NAME_NV_CONTROL, X_EXTENSION_VERSION16_NOPARAM},
     {.name = X_EXTENSION_NAME_NV_GLX, /* alias for GLX */
-     .version_query_func = x_invalid_query_version},
-    {.name = X_EXTENSION_NAME_PRESENT,
-     .version_query_func = x_generic_query_version32_zero},
-    {.name = X_EXTENSION_NAME_RANDR,
-     .version_query_func = x_generic_query_version32_zero},
-    {.name = X_EXTENSION_NAME_RECORD,
-     .version_query_func = x_generic_query_version16_zero},
-    {.name = X_EXTENSION_NAME_RENDER,
-     .version_query_func = x_generic_query_version32_zero},
-    {.name = X_EXTENSION_NAME_SECURITY,
-     .version_query_func = x_generic_query_version16_zero},
+     .version = {.source = X_VERSION_UNKNOWN}},
+    {.name = X_EXTENSION_NAME_PRESENT, X_EXTENSION_VERSION32},
+    {.name = X_EXTENSION_NAME_RANDR, X_EXTENSION_VERSION32},
+    {.name = X_EXTENSION_NAME_RECORD, X_EXTENSION_VERSION16},
+    {.name = X_EXTENSION_NAME_RENDER, X_EXTENSION_VERSION32},
+    {.name = X_EXTENSION_NAME_SECURITY, X_EXTENSION_VERSION16},
+    /* 8-bit client versions and 16-bit server versions */
     {.name = X_EXTENSION_NAME_SELINUX,
-     .version_query_func = x_selinux_query_version},
+     .version = X_VERSION_QUERY(X_OPCODE_SELINUX_QUERY_VERSION, 1, 2)},
     {.name = X_EXTENSION_NAME_SGI_GLX, /* alias for GLX */
-     .version_query_func = x_glx_query_version},
-    {.name = X_EXTENSION_NAME_SHAPE,
-     .version_query_func = x_generic_query_version16_noparam_zero},
-    {.name = X_EXTENSION_NAME_SYNC,
-     .version_query_func = x_generic_query_version8_zero},
-    {.name = X_EXTENSION_NAME_TOG_CUP,
-     .version_query_func = x_generic_query_version16_zero},
-    {.name = X_EXTENSION_NAME_WINDOWS_WM,
-     .version_query_func = x_generic_query_version16_noparam_zero},
-    {.name = X_EXTENSION_NAME_X_RESOURCE,
-     .version_query_func = x_generic_query_version8_zero},
-    {.name = X_EXTENSION_NAME_XC_APPGROUP,
-     .version_query_func = x_generic_query_version16_zero},
-    {.name = X_EXTENSION_NAME_XC_MISC,
-     .version_query_func = x_generic_query_version16_zero},
+     X_EXTENSION_VERSION_GLX},
+    {.name = X_EXTENSION_NAME_SHAPE, X_EXTENSION_VERSION16_NOPARAM},
+    {.name = X_EXTENSION_NAME_SYNC, X_EXTENSION_VERSION8},
+    {.name = X_EXTENSION_NAME_TOG_CUP, X_EXTENSION_VERSION16},
+    {.name = X_EXTENSION_NAME_WINDOWS_WM, X_EXTENSION_VERSION16_NOPARAM},
+    {.name = X_EXTENSION_NAME_X_RESOURCE, X_EXTENSION_VERSION8},
+    {.name = X_EXTENSION_NAME_XC_APPGROUP, X_EXTENSION_VERSION16},
+    {.name = X_EXTENSION_NAME_XC_MISC, X_EXTENSION_VERSION16},
     /* alias for XFree86-VidModeExtension */
     {.name = X_EXTENSION_NAME_XC_VID_MODE_EXTENSION,
-     .version_query_func = x_generic_query_version16_noparam_zero},
-    {.name = X_EXTENSION_NAME_XCALIBRATE,
-     .version_query_func = x_generic_query_version32_zero},
-    {.name = X_EXTENSION_NAME_XFIXES,
-     .version_query_func = x_generic_query_version32_zero},
-    {.name = X_EXTENSION_NAME_XFREE86_BIGFONT,
-     .version_query_func = x_generic_query_version16_noparam_zero},
-    {.name = X_EXTENSION_NAME_XFREE86_DGA,
-     .version_query_func = x_generic_query_version16_noparam_zero},
-    {.name = X_EXTENSION_NAME_XFREE86_DRI,
-     .version_query_func = x_generic_query_version16_noparam_zero},
-    {.name = X_EXTENSION_NAME_XFREE86_MISC,
-     .version_query_func = x_generic_query_version16_noparam_zero},
-    {.name = X_EXTENSION_NAME_XFREE86_RUSH,
-     .version_query_func = x_generic_query_version16_noparam_zero},
+     X_EXTENSION_VERSION16_NOPARAM},
+    {.name = X_EXTENSION_NAME_XCALIBRATE, X_EXTENSION_VERSION32},
+    {.name = X_EXTENSION_NAME_XFIXES, X_EXTENSION_VERSION32},
+    {.name = X_EXTENSION_NAME_XFREE86_BIGFONT, X_EXTENSION_VERSION16_NOPARAM},
+    {.name = X_EXTENSION_NAME_XFREE86_DGA, X_EXTENSION_VERSION16_NOPARAM},
+    {.name = X_EXTENSION_NAME_XFREE86_DRI, X_EXTENSION_VERSION16_NOPARAM},
+    {.name = X_EXTENSION_NAME_XFREE86_MISC, X_EXTENSION_VERSION16_NOPARAM},
+    {.name = X_EXTENSION_NAME_XFREE86_RUSH, X_EXTENSION_VERSION16_NOPARAM},
     {.name = X_EXTENSION_NAME_XFREE86_VID_MODE_EXTENSION,
-     .version_query_func = x_generic_query_version16_noparam_zero},
-    {.name = X_EXTENSION_NAME_XINERAMA,
-     .version_query_func = x_generic_query_version8_zero},
+     X_EXTENSION_VERSION16_NOPARAM},
+    {.name = X_EXTENSION_NAME_XINERAMA, X_EXTENSION_VERSION8},
     {.name = X_EXTENSION_NAME_XINPUT_EXTENSION,
-     .version_query_func = x_xinput_extension_query_version},
-    {.name = X_EXTENSION_NAME_XKEYBOARD,
-     .version_query_func = x_generic_query_version16_zero},
-    {.name = X_EXTENSION_NAME_XPRINT,
-     .version_query_func = x_generic_query_version16_noparam_zero},
+     .version = X_VERSION_QUERY(X_OPCODE_XINPUT_EXTENSION_QUERY_VERSION, 2, 2)},
+    {.name = X_EXTENSION_NAME_XKEYBOARD, X_EXTENSION_VERSION16},
+    /* The major version of the server comes in place of the unused byte of
+     * the reply header */
     {.name = X_EXTENSION_NAME_XTEST,
-     .version_query_func = x_xtest_query_version},
-    {.name = X_EXTENSION_NAME_XVIDEO,
-     .version_query_func = x_generic_query_version16_noparam_zero},
+     .version = {.source = X_VERSION_QUERIED,
+                 .minor_opcode = X_OPCODE_XTEST_QUERY_VERSION,
+                 .request_major = {4, 1},
+                 .request_minor = {6, 2},
+                 .reply_major = {1, 1},
+                 .reply_minor = {8, 2}}},
+    {.name = X_EXTENSION_NAME_XVIDEO, X_EXTENSION_VERSION16_NOPARAM},
     {.name = X_EXTENSION_NAME_XVIDEO_MOTION_COMPENSATION,
-     .version_query_func = x_generic_query_version32_noparam_zero}};
+     X_EXTENSION_VERSION32_NOPARAM},
+    {.name = X_EXTENSION_NAME_XPRINT, X_EXTENSION_VERSION16_NOPARAM}};
 
-static int x_get_extension_version(const char *name, unsigned int opcode,
-                                   unsigned int *major, unsigned *minor) {
+static int extension_info_comparator(const void *key, const void *element) {
+  const char *name = key;
+  const struct x_extension_info *info = element;
+  return strcmp(name, info->name);
+}
+
+static const struct x_extension_info *x_find_extension_info(const char *name) {
   static const size_t num_extensions =
       sizeof(x_extensions) / sizeof(struct x_extension_info);
-  for (size_t i = 0; i < num_extensions; ++i) {
-    if (strcmp(x_extensions[i].name, name) == 0)
-      return x_extensions[i].version_query_func(opcode, major, minor);
-  }
-  return 1;
+  return bsearch(name, x_extensions, num_extensions,
+                 sizeof(struct x_extension_info), extension_info_comparator);
 }
 
-#define LEFT_PAD 0
-#define FIELD_WIDTH 45
+/* An extension looked up on the server. Every section gets what it needs to
+ * know about an extension from here, so that nothing is asked twice. */
+struct x_extension {
+  /* Either given on the command line, a constant, or stored right after the
+   * extensions in the same allocation when listed by the server or cached */
+  const char *name;
+  /* Name under which the opcode and version of the extension are looked up,
+   * which may differ from the advertised name */
+  const char *query_name;
+  const struct x_extension_info *info; /* Null for unknown extensions */
+  int listed;          /* Part of the extensions section */
+  unsigned int opcode; /* Zero if the extension is not present */
+  unsigned int first_event;
+  unsigned int first_error;
+  unsigned int version_major;
+  unsigned int version_minor;
+  int version_failed;
+};
 
-#define STRINGIFY_IMPL(x) #x
-#define STRINGIFY(x) STRINGIFY_IMPL(x)
-#define FILL "........................................"
-#define SPACE "                                        "
-#define PRINT_FIELD(name, format, ...)                                         \
-  printf("%." STRINGIFY(LEFT_PAD) "s%." STRINGIFY(FIELD_WIDTH) "s " format     \
-                                                               "\n",           \
-         SPACE, name FILL, __VA_ARGS__)
+#define X_MONITOR_SOURCE_NONE 0
+#define X_MONITOR_SOURCE_RANDR 1    /* Version 1.3 or later */
+#define X_MONITOR_SOURCE_XINERAMA 2 /* Only used without RANDR */
+
+/* A CRTC of a RANDR screen, or a XINERAMA screen */
+struct x_crtc {
+  size_t screen;
+  uint32_t id;
+  uint32_t config_timestamp;
+  int failed;
+  int16_t x;
+  int16_t y;
+  uint16_t width;
+  uint16_t height;
+  uint32_t mode; /* None if the CRTC is disabled */
+};
 
-static void print_x_connection_data(void) {
-  const char *image_byte_order =
-      x_connection.setup_data.data.image_byte_order ==
-              X_BYTE_ORDER_LITTLE_ENDIAN
-          ? "little endian"
-          : "big endian";
-  const char *bitmap_format_bit_order =
-      x_connection.setup_data.data.bitmap_format_bit_order ==
-              X_BITMAP_FORMAT_BIT_ORDER_LEAST_SIGNIFICANT
-          ? "least significant"
-          : "most significant";
-  unsigned int release_major =
-      x_connection.setup_data.data.release_number / 10000000;
-  unsigned int release_minor =
-      (x_connection.setup_data.data.release_number / 100000) % 100;
-  unsigned int release_patch =
-      (x_connection.setup_data.data.release_number / 1000) % 100;
-  unsigned int release_build =
-      x_connection.setup_data.data.release_number % 1000;
-
-  size_t max_request_len = 4 * x_connection.setup_data.data.maximum_request_len;
-  {
-    /* If BIG-REQUESTS is available, then the maximum request length may be
-     * higher than the one provided by the connection setup information */
-    unsigned int big_requests_opcode =
-        x_get_extension_opcode(X_EXTENSION_NAME_BIG_REQUESTS);
-    struct x_big_requests_enable_request request = {
-        .opcode = big_requests_opcode,
-        .extension_opcode = X_OPCODE_BIG_REQUESTS_ENABLE,
-        .request_len = sizeof(struct x_big_requests_enable_request) / 4,
-    };
-    struct x_big_requests_enable_reply reply = {0};
-    ssize_t num_written = write_n(x_connection.fd, &request, sizeof(request));
-    if (num_written == sizeof(request)) {
-      ssize_t num_read = read_n(x_connection.fd, &reply, sizeof(reply));
-      if (num_read == sizeof(reply))
-        max_request_len = 4 * (size_t)reply.max_request_len;
-    }
-  }
+struct x_output {
+  size_t screen;
+  uint32_t id;
+  uint32_t config_timestamp;
+  int failed;
+  char *name;
+  uint32_t crtc; /* None if the output is off */
+  uint32_t mm_width;
+  uint32_t mm_height;
+  uint8_t connection;
+};
 
-  PRINT_FIELD("Vendor", "%s", x_connection.setup_data.vendor_name);
-  PRINT_FIELD("Version", "%u.%u", x_connection.setup_data.version_major,
-              x_connection.setup_data.version_minor);
-  if (release_build != 0)
-    PRINT_FIELD("Release number", "%u.%u.%u.%u", release_major, release_minor,
-                release_patch, release_build);
-  else
-    PRINT_FIELD("Release number", "%u.%u.%u", release_major, release_minor,
-                release_patch);
-  putc('\n', stdout);
-  PRINT_FIELD("Resource ID base", "0x%08x",
-              x_connection.setup_data.data.resource_id_base);
-  PRINT_FIELD("Resource ID mask", "0x%08x",
-              x_connection.setup_data.data.resource_id_mask);
-  PRINT_FIELD("Motion buffer size", "%u",
-              x_connection.setup_data.data.motion_buffer_size);
-  PRINT_FIELD("Maximum request length", "%zu bytes", max_request_len);
-  PRINT_FIELD("Image byte order", "%s", image_byte_order);
-  PRINT_FIELD("Bitmap format bit order", "%s first", bitmap_format_bit_order);
-  PRINT_FIELD("Bitmap format scanline unit", "%u",
-              x_connection.setup_data.data.bitmap_format_scanline_unit);
-  PRINT_FIELD("Bitmap format scanline pad", "%u",
-              x_connection.setup_data.data.bitmap_format_scanline_pad);
-  PRINT_FIELD("Max keycode", "%u", x_connection.setup_data.data.max_keycode);
-  PRINT_FIELD("Min keycode", "%u", x_connection.setup_data.data.min_keycode);
-  PRINT_FIELD("Number of pixmap formats", "%u",
-              x_connection.setup_data.data.num_pixmap_formats);
-  PRINT_FIELD("Number of screens", "%u",
-              x_connection.setup_data.data.num_roots);
-
-  printf("\nPixmap formats:\n");
-  for (size_t i = 0; i < x_connection.setup_data.data.num_pixmap_formats; ++i) {
-    const struct x_format *format = &x_connection.setup_data.pixmap_formats[i];
-    printf("  * depth = %2u, bits per pixel = %2u, scanline pad = %u\n",
-           format->depth, format->bits_per_pixel, format->scanline_pad);
-  }
-
-  printf("\nScreens:\n");
-  for (size_t i = 0; i < x_connection.setup_data.data.num_roots; ++i) {
-    const struct x_screen *screen = &x_connection.setup_data.roots[i];
-    printf("  Screen #%zu\n", i);
-#undef LEFT_PAD
-#undef FIELD_WIDTH
+/* What is needed of a RANDR mode to compute its refresh rate */
+struct x_mode {
+  uint32_t id;
+  uint32_t dot_clock;
+  uint16_t htotal;
+  uint16_t vtotal;
+  uint32_t flags;
+};
+
+/* Name of an atom, looked up once for all the screens */
+struct x_atom {
+  uint32_t atom;
+  int requested;
+  char *name; /* Null if unknown */
+};
+
+/* Property of a root window. Values longer than X_PROPERTY_MAX_LEN are
+ * truncated. */
+struct x_property {
+  size_t screen;
+  uint32_t atom;
+  int received; /* Once the first chunk is in */
+  int failed;
+  uint32_t type;
+  uint8_t format;
+  size_t total_len; /* In bytes */
+  char *value;
+  size_t value_len;
+};
+
+/* Resources held by a client of the server */
+struct x_client_usage {
+  uint32_t resource_base;
+  int failed;
+  uint64_t pixmap_bytes;
+  uint64_t num_resources;
+};
+
+/* Round-trip times are counted in a log-linear histogram of microseconds, like
+ * HdrHistogram does: times are exact below 128 us, and every power of two above
+ * is split into 64 buckets, which bounds the error by 1/64 */
+#define X_PING_SUB_BUCKET_BITS 6
+#define X_PING_SUB_BUCKETS (1u << X_PING_SUB_BUCKET_BITS)
+#define X_PING_NUM_BUCKETS                                                     \
+  ((32 - X_PING_SUB_BUCKET_BITS + 1) * X_PING_SUB_BUCKETS) /* Up to 2^32 us */
+
+static size_t x_ping_bucket(uint32_t us) {
+  if (us < 2 * X_PING_SUB_BUCKETS)
+    return us;
+  unsigned int shift = 0;
+  while ((us >> shift) >= 2 * X_PING_SUB_BUCKETS)
+    ++shift;
+  return shift * X_PING_SUB_BUCKETS + (us >> shift);
+}
+
+/* Highest time counted in a bucket, in microseconds */
+static uint64_t x_ping_bucket_highest(size_t bucket) {
+  if (bucket < 2 * X_PING_SUB_BUCKETS)
+    return bucket;
+  unsigned int shift = bucket / X_PING_SUB_BUCKETS - 1;
+  uint64_t top = bucket % X_PING_SUB_BUCKETS + X_PING_SUB_BUCKETS;
+  return ((top + 1) << shift) - 1;
+}
+
+/* Round-trip times of the ping section */
+struct x_ping_stats {
+  size_t num_sent;
+  size_t num_received;
+  size_t num_errors;
+  double start_ms;
+  double end_ms;
+  double min_ms;
+  double max_ms;
+  double total_ms;
+  uint32_t *buckets; /* X_PING_NUM_BUCKETS of them */
+};
+
+static void x_ping_stats_add(struct x_ping_stats *stats, double rtt_ms) {
+  double us = rtt_ms * 1000;
+  ++stats->buckets[x_ping_bucket(us >= UINT32_MAX ? UINT32_MAX
+                                 : us > 0         ? (uint32_t)us
+                                                  : 0)];
+  if (stats->num_received == 0 || rtt_ms < stats->min_ms)
+    stats->min_ms = rtt_ms;
+  if (rtt_ms > stats->max_ms)
+    stats->max_ms = rtt_ms;
+  stats->total_ms += rtt_ms;
+  ++stats->num_received;
+}
+
+/* Highest time of the fraction of the round-trips that were the fastest, in
+ * milliseconds, within the precision of the histogram */
+static double x_ping_stats_percentile(const struct x_ping_stats *stats,
+                                      double fraction) {
+  size_t rank = (size_t)(fraction * stats->num_received + 0.5);
+  if (rank == 0)
+    rank = 1;
+  size_t count = 0;
+  for (size_t i = 0; i < X_PING_NUM_BUCKETS; ++i) {
+    count += stats->buckets[i];
+    if (count >= rank) {
+      double highest_ms = x_ping_bucket_highest(i) / 1000.0;
+      return highest_ms < stats->max_ms ? highest_ms : stats->max_ms;
+    }
+  }
+  return stats->max_ms;
+}
+
+/* Everything learned about a server on top of the connection setup data */
+struct x_server_info {
+  size_t max_request_len;
+  int font_path_failed;
+  char *font_path; /* Raw list of strings from the GetFontPath reply */
+  size_t font_path_len;
+  uint16_t num_font_paths;
+  int extensions_failed;
+  struct x_extension *extensions; /* Sorted by name, without duplicates */
+  size_t num_extensions;
+  /* Current size of the root window of every screen, which may differ from
+   * the one in the setup data once refreshed */
+  struct x_root_geometry {
+    uint16_t width;
+    uint16_t height;
+  } *root_geometries;
+  size_t num_root_geometries;
+  /* Monitors of all the screens, from RANDR if possible, or else from
+   * XINERAMA */
+  int monitor_source;
+  int monitors_requested;
+  int monitors_failed;
+  struct x_crtc *crtcs;
+  size_t num_crtcs;
+  struct x_output *outputs;
+  size_t num_outputs;
+  struct x_mode *modes;
+  size_t num_modes;
+  /* Properties of all the root windows, fetched over several steps */
+  int properties_step;
+  int properties_failed;
+  struct x_property *root_properties;
+  size_t num_root_properties;
+  struct x_atom *atoms; /* Sorted, but for the ones added by the current step */
+  size_t num_atoms;
+  /* Usage of the clients of the server according to X-Resource. It is
+   * requested a window of clients at a time, and replies are aggregated as
+   * they come in: only the clients using the most pixmap bytes are kept, in a
+   * min-heap until all of them are known, then sorted from the largest. */
+  int clients_step;
+  int clients_failed;
+  int clients_available;
+  char *client_list; /* From the QueryClients reply, until all are requested */
+  size_t num_clients;
+  size_t next_client;           /* Next one whose usage is requested */
+  size_t num_clients_in_flight; /* Whose pixmap bytes are still expected */
+  size_t num_vanished_clients; /* Disconnected while being queried */
+  uint64_t total_pixmap_bytes;
+  uint64_t total_resources;
+  struct x_client_usage current_client; /* Whose pixmap bytes are expected */
+  struct x_client_usage *top_clients;
+  size_t num_top_clients;
+  struct x_ping_stats ping;
+};
+
+static void x_server_info_free(struct x_server_info *info) {
+  free(info->extensions);
+  info->extensions = 0;
+  info->num_extensions = 0;
+  free(info->font_path);
+  info->font_path = 0;
+  free(info->root_geometries);
+  info->root_geometries = 0;
+  info->num_root_geometries = 0;
+  free(info->crtcs);
+  info->crtcs = 0;
+  info->num_crtcs = 0;
+  for (size_t i = 0; i < info->num_outputs; ++i)
+    free(info->outputs[i].name);
+  free(info->outputs);
+  info->outputs = 0;
+  info->num_outputs = 0;
+  free(info->modes);
+  info->modes = 0;
+  info->num_modes = 0;
+  info->monitor_source = X_MONITOR_SOURCE_NONE;
+  info->monitors_requested = 0;
+  info->monitors_failed = 0;
+  for (size_t i = 0; i < info->num_root_properties; ++i)
+    free(info->root_properties[i].value);
+  free(info->root_properties);
+  info->root_properties = 0;
+  info->num_root_properties = 0;
+  for (size_t i = 0; i < info->num_atoms; ++i)
+    free(info->atoms[i].name);
+  free(info->atoms);
+  info->atoms = 0;
+  info->num_atoms = 0;
+  info->properties_step = 0;
+  info->properties_failed = 0;
+  free(info->client_list);
+  info->client_list = 0;
+  free(info->top_clients);
+  info->top_clients = 0;
+  info->num_top_clients = 0;
+  info->num_clients = 0;
+  info->next_client = 0;
+  info->num_clients_in_flight = 0;
+  info->num_vanished_clients = 0;
+  info->total_pixmap_bytes = 0;
+  info->total_resources = 0;
+  info->clients_step = 0;
+  info->clients_failed = 0;
+  info->clients_available = 0;
+  free(info->ping.buckets);
+  memset(&info->ping, 0, sizeof(info->ping));
+}
+
+static int extension_name_comparator(const void *key, const void *element) {
+  const struct x_extension *extension = element;
+  return strcmp(key, extension->name);
+}
+
+/* Returns null if the extension was not looked up */
+static const struct x_extension *
+x_server_info_find_extension(const struct x_server_info *info,
+                             const char *name) {
+  if (!info->extensions)
+    return 0;
+  return bsearch(name, info->extensions, info->num_extensions,
+                 sizeof(struct x_extension), extension_name_comparator);
+}
+
+static int atom_comparator(const void *lhs, const void *rhs) {
+  const struct x_atom *lhs_atom = lhs;
+  const struct x_atom *rhs_atom = rhs;
+  return (lhs_atom->atom > rhs_atom->atom) - (lhs_atom->atom < rhs_atom->atom);
+}
+
+/* Returns null if the name of the atom is unknown */
+static const char *x_server_info_atom_name(const struct x_server_info *info,
+                                           uint32_t atom) {
+  if (atom < X_NUM_PREDEFINED_ATOMS)
+    return x_predefined_atoms[atom];
+  if (!info->atoms)
+    return 0;
+  struct x_atom key = {.atom = atom};
+  const struct x_atom *found = bsearch(&key, info->atoms, info->num_atoms,
+                                       sizeof(struct x_atom), atom_comparator);
+  return found ? found->name : 0;
+}
+
+/* Probing a display is a sequence of stages. Every stage sends a batch of
+ * requests that only depend on the results of the previous stages, so that a
+ * whole stage costs a single round-trip to the server. Every request is queued
+ * together with the function handling its answer, and answers are matched to
+ * requests through their sequence number. Probes never block, which allows
+ * driving many of them from a single event loop. */
+enum x_probe_state {
+  X_PROBE_CONNECTING,
+  X_PROBE_SETUP,
+  X_PROBE_RUNNING,
+  X_PROBE_IDLE, /* Waiting for the next refresh, when watching */
+  X_PROBE_DONE,
+  X_PROBE_FAILED,
+};
+
+struct x_probe;
+
+/* Handle the reply or the error received for a request. arg is the value
+ * given when queuing the request. */
+typedef void (*x_reply_handler)(struct x_probe *probe, size_t arg,
+                                const char *reply, size_t reply_len);
+
+struct x_pending_reply {
+  x_reply_handler handle;
+  size_t arg;
+};
+
+/* Sections of the report. Probes only send the requests needed by the
+ * selected sections. */
+#define X_SECTION_SERVER (1u << 0)
+#define X_SECTION_FORMATS (1u << 1)
+#define X_SECTION_SCREENS (1u << 2)
+#define X_SECTION_FONT_PATHS (1u << 3)
+#define X_SECTION_EXTENSIONS (1u << 4)
+#define X_SECTION_MONITORS (1u << 5)
+#define X_SECTION_PROPERTIES (1u << 6) /* Only when asked for */
+#define X_SECTION_CLIENTS (1u << 7)    /* Only when asked for */
+#define X_SECTION_PING (1u << 8)       /* Only when asked for */
+#define X_SECTION_DEFAULT                                                      \
+  (X_SECTION_SERVER | X_SECTION_FORMATS | X_SECTION_SCREENS |                  \
+   X_SECTION_MONITORS | X_SECTION_FONT_PATHS | X_SECTION_EXTENSIONS)
+
+/* Settings shared by all the probes */
+struct x_probe_options {
+  unsigned int sections;
+  /* Extensions to look up instead of listing all the supported ones */
+  const char **extension_names;
+  size_t num_extension_names;
+  int use_xauth_index;
+  int use_cache;
+  /* Interval between refreshes of the volatile data, or zero to probe only
+   * once. Connections are kept open in between. */
+  unsigned int watch_interval_ms;
+  unsigned int connect_timeout_ms; /* Zero to wait forever */
+  unsigned int read_timeout_ms;    /* Zero to wait forever */
+  size_t num_top_clients; /* Clients reported by the clients section */
+  /* Round-trips measured by the ping section, at most one every interval, with
+   * at most depth of them in flight at any time */
+  size_t num_pings;
+  unsigned int ping_interval_ms; /* Zero to send them back to back */
+  size_t ping_depth;
+};
+
+struct x_probe {
+  const struct x_probe_options *options;
+  const char *display_name;
+  enum x_probe_state state;
+  char error[256]; /* Set when the probe failed */
+  struct x_connection connection;
+  struct x_server_info info;
+  /* Set once the static server facts are in the cache, either because they
+   * were found there or because they were just stored */
+  int cached;
+
+  /* Connection establishment. Connection attempts to the candidate addresses
+   * are staggered and raced against each other. */
+  struct x_address *addresses;
+  int *attempt_fds; /* Socket of the attempt for every address, or -1 */
+  size_t num_addresses;
+  size_t next_address;
+  double next_attempt_ms;
+  char *auth_info;
+  size_t auth_protocol_name_len;
+  size_t auth_data_len;
+  double phase_start_ms;
+  const char *phase_name; /* Of the current stage, for timings */
+
+  /* Deadlines, or zero if there is none */
+  double connect_deadline_ms;
+  double read_deadline_ms;
+  double next_refresh_ms; /* When idle */
+
+  /* Requests of the current stage still waiting for an answer */
+  size_t stage;
+  struct x_pending_reply *pending;
+  size_t num_pending;
+  size_t pending_capacity;
+  size_t num_answered;
+  uint16_t first_sequence_number;
+
+  /* Pings in flight once the stages are over. Their send times are kept in a
+   * ring indexed by sequence number, whose size is a power of two no smaller
+   * than the ping depth so that it divides the sequence number space. */
+  int pinging;
+  double *ping_sent_ms;
+  size_t ping_ring_size;
+  size_t num_pings_in_flight;
+  double next_ping_ms; /* Zero if a ping can be sent right away */
+};
+
+static void x_probe_init(struct x_probe *probe,
+                         const struct x_probe_options *options,
+                         const char *display_name, int enable_timings) {
+  memset(probe, 0, sizeof(*probe));
+  probe->options = options;
+  probe->display_name = display_name;
+  probe->connection.fd = -1;
+  probe->connection.timings.enabled = enable_timings;
+}
+
+static void x_probe_close_attempts(struct x_probe *probe) {
+  for (size_t i = 0; probe->attempt_fds && i < probe->num_addresses; ++i) {
+    if (probe->attempt_fds[i] != -1)
+      close(probe->attempt_fds[i]);
+    probe->attempt_fds[i] = -1;
+  }
+}
+
+static void x_probe_free(struct x_probe *probe) {
+  x_probe_close_attempts(probe);
+  free(probe->attempt_fds);
+  probe->attempt_fds = 0;
+  x_disconnect(&probe->connection);
+  x_server_info_free(&probe->info);
+  free(probe->addresses);
+  probe->addresses = 0;
+  free(probe->auth_info);
+  probe->auth_info = 0;
+  free(probe->pending);
+  probe->pending = 0;
+  free(probe->ping_sent_ms);
+  probe->ping_sent_ms = 0;
+}
+
+static void x_probe_fail(struct x_probe *probe, const char *message) {
+  if (message != probe->error)
+    snprintf(probe->error, sizeof(probe->error), "%s", message);
+  probe->state = X_PROBE_FAILED;
+  probe->connection.timings.end_ms = monotonic_now_ms();
+  x_probe_close_attempts(probe);
+  x_close(&probe->connection);
+}
+
+/* Restart the clock of the read deadline, called whenever the probe starts
+ * waiting for the server or receives something from it */
+static void x_probe_reset_read_deadline(struct x_probe *probe) {
+  unsigned int timeout_ms = probe->options->read_timeout_ms;
+  probe->read_deadline_ms = timeout_ms ? monotonic_now_ms() + timeout_ms : 0;
+}
+
+static void x_probe_flush(struct x_probe *probe) {
+  if (x_flush(&probe->connection) != 0)
+    x_probe_fail(probe, "Failed to send requests to X server");
+}
+
+/* Queue a request whose reply or error is handled by handle. Requests may
+ * also be queued by the handlers of the current stage, in which case the
+ * answered ones are dropped to make room. Returns non-zero on failure. */
+static int x_probe_send_request(struct x_probe *probe, x_reply_handler handle,
+                                size_t arg, const void *request,
+                                size_t request_len, const void *data,
+                                size_t data_len) {
+  if (probe->num_pending == probe->pending_capacity &&
+      probe->num_answered > 0) {
+    /* Replies come in the order of the requests, so the answered ones are
+     * the first */
+    probe->num_pending -= probe->num_answered;
+    memmove(probe->pending, probe->pending + probe->num_answered,
+            probe->num_pending * sizeof(struct x_pending_reply));
+    probe->first_sequence_number += probe->num_answered;
+    probe->num_answered = 0;
+  }
+  if (probe->num_pending == probe->pending_capacity) {
+    size_t capacity =
+        probe->pending_capacity ? 2 * probe->pending_capacity : 64;
+    struct x_pending_reply *pending =
+        realloc(probe->pending, capacity * sizeof(struct x_pending_reply));
+    if (!pending)
+      return 1;
+    probe->pending = pending;
+    probe->pending_capacity = capacity;
+  }
+  if (x_send_request(&probe->connection, request, request_len, data,
+                     data_len) != 0)
+    return 1;
+  struct x_pending_reply pending = {.handle = handle, .arg = arg};
+  probe->pending[probe->num_pending++] = pending;
+  return 0;
+}
+
+static int x_probe_query_extension(struct x_probe *probe, const char *name,
+                                   x_reply_handler handle, size_t arg) {
+  size_t name_len = strlen(name);
+  struct x_query_extension_request request = {
+      .opcode = X_OPCODE_QUERY_EXTENSION,
+      .request_len = 2 + (X_PAD(name_len) / 4),
+      .name_len = name_len,
+  };
+  return x_probe_send_request(probe, handle, arg, &request, sizeof(request),
+                              name, name_len);
+}
+
+static void x_probe_handle_big_requests_enable(struct x_probe *probe,
+                                               size_t arg, const char *reply,
+                                               size_t reply_len) {
+  (void)arg;
+  (void)reply_len;
+  struct x_big_requests_enable_reply data;
+  memcpy(&data, reply, sizeof(data));
+  if (data.status == X_REPLY)
+    probe->info.max_request_len = 4 * (size_t)data.max_request_len;
+}
+
+static void x_probe_handle_font_path(struct x_probe *probe, size_t arg,
+                                     const char *reply, size_t reply_len) {
+  (void)arg;
+  struct x_get_font_path_reply data;
+  memcpy(&data, reply, sizeof(data));
+  /* If we fail, don't try to understand why and just give up on this part */
+  probe->info.font_path_failed = 1;
+  free(probe->info.font_path);
+  probe->info.font_path = 0;
+  probe->info.font_path_len = 0;
+  probe->info.num_font_paths = 0;
+  if (data.status != X_REPLY)
+    return;
+  /* Keep the list of strings as is, it is only decoded when printed */
+  size_t len = reply_len - sizeof(data);
+  probe->info.font_path = malloc(len ? len : 1);
+  if (!probe->info.font_path)
+    return;
+  memcpy(probe->info.font_path, reply + sizeof(data), len);
+  probe->info.font_path_len = len;
+  probe->info.num_font_paths = data.num_strings;
+  probe->info.font_path_failed = 0;
+}
+
+/* The name must outlive the extension */
+static void x_extension_init(struct x_extension *extension, const char *name) {
+  extension->name = name;
+  extension->query_name = extension->name;
+  /* The Nvidia implementation doesn't seem to provide a documented version
+   * querying request. Delegate to GLX instead */
+  if (strcmp(extension->name, X_EXTENSION_NAME_NV_GLX) == 0)
+    extension->query_name = X_EXTENSION_NAME_GLX;
+  extension->info = x_find_extension_info(extension->query_name);
+  extension->version_failed = 1;
+}
+
+static void x_probe_handle_root_geometry(struct x_probe *probe, size_t arg,
+                                         const char *reply,
+                                         size_t reply_len) {
+  (void)reply_len;
+  struct x_get_geometry_reply data;
+  memcpy(&data, reply, sizeof(data));
+  /* Keep the previous size if this fails */
+  if (data.status != X_REPLY)
+    return;
+  probe->info.root_geometries[arg].width = data.width;
+  probe->info.root_geometries[arg].height = data.height;
+}
+
+/* To sort extensions alphabetically */
+static int extension_comparator(const void *lhs, const void *rhs) {
+  const struct x_extension *first = lhs;
+  const struct x_extension *second = rhs;
+  return strcmp(first->name, second->name);
+}
+
+static void x_probe_handle_extension_list(struct x_probe *probe, size_t arg,
+                                          const char *reply,
+                                          size_t reply_len) {
+  (void)arg;
+  struct x_server_info *info = &probe->info;
+  struct x_list_extensions_reply data;
+  memcpy(&data, reply, sizeof(data));
+  /* If we fail, don't try to understand why and just give up on this part */
+  info->extensions_failed = 1;
+  if (data.status != X_REPLY)
+    return;
+
+  /* The names are copied as a whole right after the extensions, then every
+   * name is moved over the length which precedes it to make room for its
+   * terminating null character, so that a single allocation holds all */
+  size_t extensions_size =
+      (data.num_names ? data.num_names : 1) * sizeof(struct x_extension);
+  size_t names_len = reply_len - sizeof(data);
+  info->extensions = calloc(1, extensions_size + names_len + 1);
+  if (!info->extensions)
+    return;
+  char *curr_name = (char *)info->extensions + extensions_size;
+  memcpy(curr_name, reply + sizeof(data), names_len);
+  const char *names_end = curr_name + names_len;
+  for (size_t i = 0; i < data.num_names; ++i) {
+    if (curr_name >= names_end)
+      goto extensions_error;
+    uint8_t name_len = (uint8_t)*curr_name;
+    if (name_len >= names_end - curr_name)
+      goto extensions_error;
+    memmove(curr_name, curr_name + 1, name_len);
+    curr_name[name_len] = '\0';
+    struct x_extension *extension = &info->extensions[i];
+    x_extension_init(extension, curr_name);
+    extension->listed = 1;
+    ++info->num_extensions;
+    curr_name += name_len + 1;
+  }
+  qsort(info->extensions, info->num_extensions, sizeof(struct x_extension),
+        extension_comparator);
+  info->extensions_failed = 0;
+  return;
+
+extensions_error:
+  /* Only the extensions are given up on, the other sections keep their state */
+  free(info->extensions);
+  info->extensions = 0;
+  info->num_extensions = 0;
+  info->extensions_failed = 1;
+}
+
+static void x_probe_handle_extension_opcode(struct x_probe *probe, size_t arg,
+                                            const char *reply,
+                                            size_t reply_len) {
+  (void)reply_len;
+  struct x_extension *extension = &probe->info.extensions[arg];
+  struct x_query_extension_reply data;
+  memcpy(&data, reply, sizeof(data));
+  if (data.status == X_REPLY && data.present) {
+    extension->opcode = data.major_opcode;
+    extension->first_event = data.first_event;
+    extension->first_error = data.first_error;
+    if (extension->info)
+      timings_set_extension_name(&probe->connection.timings,
+                                 extension->opcode, extension->info->name);
+  }
+}
+
+static void x_probe_handle_extension_version(struct x_probe *probe, size_t arg,
+                                             const char *reply,
+                                             size_t reply_len) {
+  (void)reply_len;
+  struct x_extension *extension = &probe->info.extensions[arg];
+  /* Errors take the place of the replies for extensions that do not
+   * understand the request */
+  if ((uint8_t)reply[0] != X_REPLY)
+    return;
+  extension->version_failed =
+      x_decode_version_reply(&extension->info->version, reply,
+                             &extension->version_major,
+                             &extension->version_minor);
+}
+
+/* The optional server cache keeps the facts which do not change during the
+ * life of a server: the maximum request length and the supported extensions
+ * with their opcodes and versions. A repeated run then only needs the
+ * connection handshake to report them. There is one cache file per display,
+ * which is only used while the identity of the server matches the one
+ * recorded in it. The identity is made of the display name and of the parts
+ * of the setup data which are the same for all the clients of a server: the
+ * resource ID base is different for every client, and the screen sizes and
+ * root event masks change over time. */
+#define X_CACHE_MAGIC "XSRV"
+#define X_CACHE_VERSION 2
+#define X_CACHE_MAX_SIZE (1 << 20)
+
+struct x_cache_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t identity_len;
+  uint32_t num_extensions;
+  uint64_t max_request_len;
+};
+
+/* Followed by the name of the extension */
+struct x_cache_extension {
+  uint32_t opcode;
+  uint32_t version_major;
+  uint32_t version_minor;
+  uint8_t version_failed;
+  uint8_t name_len;
+  uint8_t first_event;
+  uint8_t first_error;
+};
+
+/* Serialize the identity of the server of a probe. Returns null on failure,
+ * or a buffer which must be freed by the caller. */
+static char *x_cache_identity(const struct x_probe *probe, size_t *len) {
+  const struct x_setup_data *setup_data = &probe->connection.setup_data;
+  size_t display_name_len = strlen(probe->display_name);
+  uint32_t fields[] = {
+      setup_data->version_major,
+      setup_data->version_minor,
+      setup_data->data.release_number,
+      setup_data->data.resource_id_mask,
+      setup_data->data.maximum_request_len,
+      setup_data->data.num_roots,
+  };
+  *len = display_name_len + 1 + setup_data->data.vendor_length +
+         sizeof(fields) + setup_data->data.num_roots * 4 * sizeof(uint32_t);
+  char *identity = malloc(*len);
+  if (!identity)
+    return 0;
+  char *curr = identity;
+  memcpy(curr, probe->display_name, display_name_len + 1);
+  curr += display_name_len + 1;
+  memcpy(curr, setup_data->vendor_name, setup_data->data.vendor_length);
+  curr += setup_data->data.vendor_length;
+  memcpy(curr, fields, sizeof(fields));
+  curr += sizeof(fields);
+  struct x_screen_iterator screen = x_screens_begin(setup_data);
+  while (x_screens_next(&screen)) {
+    uint32_t screen_fields[] = {
+        screen.data.root,
+        screen.data.default_colormap,
+        screen.data.root_visual_id,
+        screen.data.root_depth,
+    };
+    memcpy(curr, screen_fields, sizeof(screen_fields));
+    curr += sizeof(screen_fields);
+  }
+  *len = curr - identity;
+  return identity;
+}
+
+static int x_cache_path(const struct x_probe *probe, char *path,
+                        size_t path_len, int create_directory) {
+  uint32_t hash = hash_bytes(2166136261u, probe->display_name,
+                             strlen(probe->display_name));
+  char name[32];
+  snprintf(name, sizeof(name), "server-%08x.cache", (unsigned int)hash);
+  return cache_file_path(name, path, path_len, create_directory);
+}
+
+/* Fill the server information of a probe from the cache. Returns non-zero if
+ * the cache is missing, stale or invalid. */
+static int x_cache_load(struct x_probe *probe) {
+  char path[PATH_MAX];
+  if (x_cache_path(probe, path, sizeof(path), 0) != 0)
+    return 1;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return 1;
+  struct stat cache_stat;
+  if (fstat(fd, &cache_stat) == -1 ||
+      (size_t)cache_stat.st_size < sizeof(struct x_cache_header) ||
+      cache_stat.st_size > X_CACHE_MAX_SIZE) {
+    close(fd);
+    return 1;
+  }
+  size_t size = cache_stat.st_size;
+  char *cache = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (cache == MAP_FAILED)
+    return 1;
+
+  int failed = 1;
+  struct x_server_info *info = &probe->info;
+  size_t identity_len = 0;
+  char *identity = x_cache_identity(probe, &identity_len);
+  struct x_cache_header header;
+  memcpy(&header, cache, sizeof(header));
+  const char *curr = cache + sizeof(header);
+  const char *end = cache + size;
+  if (!identity || memcmp(header.magic, X_CACHE_MAGIC, 4) != 0 ||
+      header.version != X_CACHE_VERSION ||
+      header.identity_len != identity_len ||
+      identity_len > (size_t)(end - curr) ||
+      memcmp(curr, identity, identity_len) != 0 ||
+      header.num_extensions > 256)
+    goto end;
+  curr += identity_len;
+
+  /* The names are stored right after the extensions like when they are
+   * listed by the server. Every name is preceded by a record larger than its
+   * terminating null character, so the rest of the cache has room for all. */
+  size_t extensions_size = (header.num_extensions ? header.num_extensions : 1) *
+                           sizeof(struct x_extension);
+  info->extensions = calloc(1, extensions_size + (end - curr));
+  if (!info->extensions)
+    goto end;
+  char *curr_name = (char *)info->extensions + extensions_size;
+  for (size_t i = 0; i < header.num_extensions; ++i) {
+    struct x_cache_extension record;
+    if ((size_t)(end - curr) < sizeof(record))
+      goto end;
+    memcpy(&record, curr, sizeof(record));
+    curr += sizeof(record);
+    if (record.name_len > end - curr)
+      goto end;
+    memcpy(curr_name, curr, record.name_len);
+    curr_name[record.name_len] = '\0';
+    struct x_extension *extension = &info->extensions[i];
+    x_extension_init(extension, curr_name);
+    ++info->num_extensions;
+    curr += record.name_len;
+    curr_name += record.name_len + 1;
+    extension->listed = 1;
+    extension->opcode = record.opcode;
+    extension->first_event = record.first_event;
+    extension->first_error = record.first_error;
+    extension->version_major = record.version_major;
+    extension->version_minor = record.version_minor;
+    extension->version_failed = record.version_failed;
+    if (extension->info && extension->opcode)
+      timings_set_extension_name(&probe->connection.timings,
+                                 extension->opcode, extension->info->name);
+  }
+  if (curr != end)
+    goto end;
+  info->max_request_len = header.max_request_len;
+  failed = 0;
+
+end:
+  if (failed)
+    x_server_info_free(info);
+  free(identity);
+  munmap(cache, size);
+  return failed;
+}
+
+/* Record the server information of a probe in the cache. Failures are
+ * silently ignored since the cache is only an optimization. */
+static void x_cache_store(const struct x_probe *probe) {
+  const struct x_server_info *info = &probe->info;
+  size_t identity_len = 0;
+  char *identity = x_cache_identity(probe, &identity_len);
+  if (!identity)
+    return;
+
+  /* Write to a temporary file first so that concurrent runs never see a
+   * partially written cache */
+  char path[PATH_MAX];
+  char temporary_path[PATH_MAX + 32];
+  if (x_cache_path(probe, path, sizeof(path), 1) != 0)
+    goto end;
+  snprintf(temporary_path, sizeof(temporary_path), "%s.%ld.tmp", path,
+           (long)getpid());
+  /* Only one thread writes a given file, the others skip it */
+  int fd = open(temporary_path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (fd == -1)
+    goto end;
+  struct x_cache_header header = {
+      .version = X_CACHE_VERSION,
+      .identity_len = identity_len,
+      .num_extensions = info->num_extensions,
+      .max_request_len = info->max_request_len,
+  };
+  memcpy(header.magic, X_CACHE_MAGIC, sizeof(header.magic));
+  int failed = write_n(fd, &header, sizeof(header)) != sizeof(header) ||
+               write_n(fd, identity, identity_len) != (ssize_t)identity_len;
+  for (size_t i = 0; i < info->num_extensions && !failed; ++i) {
+    const struct x_extension *extension = &info->extensions[i];
+    size_t name_len = strlen(extension->name);
+    struct x_cache_extension record = {
+        .opcode = extension->opcode,
+        .version_major = extension->version_major,
+        .version_minor = extension->version_minor,
+        .version_failed = extension->version_failed != 0,
+        .name_len = name_len,
+        .first_event = extension->first_event,
+        .first_error = extension->first_error,
+    };
+    failed = name_len > UINT8_MAX ||
+             write_n(fd, &record, sizeof(record)) != sizeof(record) ||
+             write_n(fd, extension->name, name_len) != (ssize_t)name_len;
+  }
+  failed = close(fd) != 0 || failed;
+  if (failed || rename(temporary_path, path) != 0)
+    unlink(temporary_path);
+
+end:
+  free(identity);
+}
+
+/* Whether the extensions section lists all the extensions supported by the
+ * server, whose opcodes can then only be looked up once the list is known */
+static int x_probe_lists_extensions(const struct x_probe *probe) {
+  const struct x_probe_options *options = probe->options;
+  return (options->sections & X_SECTION_EXTENSIONS) &&
+         options->num_extension_names == 0 && !probe->cached;
+}
+
+/* Add an extension to the registry of a probe, whose capacity must be large
+ * enough */
+static void x_probe_add_extension(struct x_probe *probe, const char *name,
+                                  int listed) {
+  struct x_server_info *info = &probe->info;
+  struct x_extension *extension = &info->extensions[info->num_extensions];
+  x_extension_init(extension, name);
+  extension->listed = listed;
+  ++info->num_extensions;
+}
+
+/* Set up the registry with the extensions that are known by name: the ones
+ * named on the command line and the ones the other sections depend on. Their
+ * opcodes can be looked up straight away instead of listing the supported
+ * extensions first. Returns non-zero on failure. */
+static int x_probe_submit_extension_registry(struct x_probe *probe) {
+  const struct x_probe_options *options = probe->options;
+  struct x_server_info *info = &probe->info;
+  size_t num_names = 0;
+  if (options->sections & X_SECTION_EXTENSIONS)
+    num_names += options->num_extension_names;
+  int needs_big_requests = (options->sections & X_SECTION_SERVER) != 0;
+  int needs_monitors = (options->sections & X_SECTION_MONITORS) != 0;
+  int needs_x_resource = (options->sections & X_SECTION_CLIENTS) != 0;
+  if (num_names == 0 && !needs_big_requests && !needs_monitors &&
+      !needs_x_resource)
+    return 0;
+  info->extensions = calloc(num_names + 4, sizeof(struct x_extension));
+  if (!info->extensions)
+    return 1;
+  for (size_t i = 0; i < num_names; ++i)
+    x_probe_add_extension(probe, options->extension_names[i], 1);
+  if (needs_big_requests)
+    x_probe_add_extension(probe, X_EXTENSION_NAME_BIG_REQUESTS, 0);
+  if (needs_monitors) {
+    x_probe_add_extension(probe, X_EXTENSION_NAME_RANDR, 0);
+    x_probe_add_extension(probe, X_EXTENSION_NAME_XINERAMA, 0);
+  }
+  if (needs_x_resource)
+    x_probe_add_extension(probe, X_EXTENSION_NAME_X_RESOURCE, 0);
+  qsort(info->extensions, info->num_extensions, sizeof(struct x_extension),
+        extension_comparator);
+  /* Names needed several times are only looked up once */
+  size_t num_unique = 0;
+  for (size_t i = 0; i < info->num_extensions; ++i) {
+    struct x_extension *extension = &info->extensions[i];
+    if (num_unique > 0 &&
+        strcmp(extension->name, info->extensions[num_unique - 1].name) == 0) {
+      info->extensions[num_unique - 1].listed |= extension->listed;
+      continue;
+    }
+    info->extensions[num_unique++] = *extension;
+  }
+  info->num_extensions = num_unique;
+  for (size_t i = 0; i < info->num_extensions; ++i) {
+    if (x_probe_query_extension(probe, info->extensions[i].query_name,
+                                x_probe_handle_extension_opcode, i) != 0)
+      return 1;
+  }
+  return 0;
+}
+
+static void x_probe_fail_monitors(struct x_probe *probe) {
+  struct x_server_info *info = &probe->info;
+  info->monitors_failed = 1;
+  info->num_crtcs = 0;
+  for (size_t i = 0; i < info->num_outputs; ++i)
+    free(info->outputs[i].name);
+  info->num_outputs = 0;
+  info->num_modes = 0;
+}
+
+/* Make room for n more elements at the end of an array. Returns non-zero on
+ * failure. */
+static int grow_array(void **array, size_t len, size_t n, size_t size) {
+  if (n == 0)
+    return 0;
+  void *grown = realloc(*array, (len + n) * size);
+  if (!grown)
+    return 1;
+  *array = grown;
+  memset((char *)grown + len * size, 0, n * size);
+  return 0;
+}
+
+static void x_probe_handle_screen_resources(struct x_probe *probe, size_t arg,
+                                            const char *reply,
+                                            size_t reply_len) {
+  struct x_server_info *info = &probe->info;
+  struct x_randr_get_screen_resources_current_reply data;
+  memcpy(&data, reply, sizeof(data));
+  if (info->monitors_failed)
+    return;
+  size_t num_crtcs = data.num_crtcs;
+  size_t num_outputs = data.num_outputs;
+  size_t num_modes = data.num_modes;
+  if (data.status != X_REPLY ||
+      reply_len < sizeof(data) + 4 * (num_crtcs + num_outputs) +
+                      num_modes * sizeof(struct x_randr_mode_info) ||
+      grow_array((void **)&info->crtcs, info->num_crtcs, num_crtcs,
+                 sizeof(struct x_crtc)) != 0 ||
+      grow_array((void **)&info->outputs, info->num_outputs, num_outputs,
+                 sizeof(struct x_output)) != 0 ||
+      grow_array((void **)&info->modes, info->num_modes, num_modes,
+                 sizeof(struct x_mode)) != 0) {
+    x_probe_fail_monitors(probe);
+    return;
+  }
+  const char *curr = reply + sizeof(data);
+  for (size_t i = 0; i < num_crtcs; ++i, curr += 4) {
+    struct x_crtc *crtc = &info->crtcs[info->num_crtcs++];
+    crtc->screen = arg;
+    memcpy(&crtc->id, curr, 4);
+    crtc->config_timestamp = data.config_timestamp;
+    crtc->failed = 1;
+  }
+  for (size_t i = 0; i < num_outputs; ++i, curr += 4) {
+    struct x_output *output = &info->outputs[info->num_outputs++];
+    output->screen = arg;
+    memcpy(&output->id, curr, 4);
+    output->config_timestamp = data.config_timestamp;
+    output->failed = 1;
+  }
+  for (size_t i = 0; i < num_modes; ++i) {
+    struct x_randr_mode_info mode_info;
+    memcpy(&mode_info, curr, sizeof(mode_info));
+    curr += sizeof(mode_info);
+    struct x_mode *mode = &info->modes[info->num_modes++];
+    mode->id = mode_info.id;
+    mode->dot_clock = mode_info.dot_clock;
+    mode->htotal = mode_info.htotal;
+    mode->vtotal = mode_info.vtotal;
+    mode->flags = mode_info.mode_flags;
+  }
+}
+
+static void x_probe_handle_xinerama_screens(struct x_probe *probe, size_t arg,
+                                            const char *reply,
+                                            size_t reply_len) {
+  (void)arg;
+  struct x_server_info *info = &probe->info;
+  struct x_xinerama_query_screens_reply data;
+  memcpy(&data, reply, sizeof(data));
+  size_t num_screens = data.num_screens;
+  if (data.status != X_REPLY ||
+      (reply_len - sizeof(data)) / sizeof(struct x_xinerama_screen_info) <
+          num_screens ||
+      grow_array((void **)&info->crtcs, 0, num_screens,
+                 sizeof(struct x_crtc)) != 0) {
+    x_probe_fail_monitors(probe);
+    return;
+  }
+  const char *curr = reply + sizeof(data);
+  for (size_t i = 0; i < num_screens; ++i) {
+    struct x_xinerama_screen_info screen_info;
+    memcpy(&screen_info, curr, sizeof(screen_info));
+    curr += sizeof(screen_info);
+    struct x_crtc *crtc = &info->crtcs[info->num_crtcs++];
+    crtc->id = i;
+    crtc->x = screen_info.x;
+    crtc->y = screen_info.y;
+    crtc->width = screen_info.width;
+    crtc->height = screen_info.height;
+  }
+}
+
+static void x_probe_handle_crtc_info(struct x_probe *probe, size_t arg,
+                                     const char *reply, size_t reply_len) {
+  (void)reply_len;
+  struct x_crtc *crtc = &probe->info.crtcs[arg];
+  struct x_randr_get_crtc_info_reply data;
+  memcpy(&data, reply, sizeof(data));
+  if (data.reply_type != X_REPLY || data.status != X_RANDR_SET_CONFIG_SUCCESS)
+    return;
+  crtc->x = data.x;
+  crtc->y = data.y;
+  crtc->width = data.width;
+  crtc->height = data.height;
+  crtc->mode = data.mode;
+  crtc->failed = 0;
+}
+
+static void x_probe_handle_output_info(struct x_probe *probe, size_t arg,
+                                       const char *reply, size_t reply_len) {
+  struct x_output *output = &probe->info.outputs[arg];
+  struct x_randr_get_output_info_reply data;
+  /* Errors are shorter than the fixed part of the reply */
+  if (reply_len < sizeof(data) || (uint8_t)reply[0] != X_REPLY)
+    return;
+  memcpy(&data, reply, sizeof(data));
+  if (data.status != X_RANDR_SET_CONFIG_SUCCESS)
+    return;
+  size_t name_offset =
+      sizeof(data) +
+      4 * ((size_t)data.num_crtcs + data.num_modes + data.num_clones);
+  if (reply_len < name_offset + data.name_len)
+    return;
+  output->name = calloc(data.name_len + 1, 1);
+  if (!output->name)
+    return;
+  memcpy(output->name, reply + name_offset, data.name_len);
+  output->crtc = data.crtc;
+  output->mm_width = data.mm_width;
+  output->mm_height = data.mm_height;
+  output->connection = data.connection;
+  output->failed = 0;
+}
+
+/* Look up the monitors: the CRTCs, outputs and modes of every screen with
+ * RANDR 1.3 or later, or else the XINERAMA screens. This needs the version of
+ * RANDR, which is known right away when cached. Returns non-zero on
+ * failure. */
+static int x_probe_submit_monitor_resources(struct x_probe *probe) {
+  struct x_server_info *info = &probe->info;
+  if (!(probe->options->sections & X_SECTION_MONITORS) ||
+      info->monitors_requested)
+    return 0;
+  info->monitors_requested = 1;
+  const struct x_extension *randr =
+      x_server_info_find_extension(info, X_EXTENSION_NAME_RANDR);
+  if (randr && randr->opcode && !randr->version_failed &&
+      (randr->version_major > 1 ||
+       (randr->version_major == 1 && randr->version_minor >= 3))) {
+    info->monitor_source = X_MONITOR_SOURCE_RANDR;
+    struct x_screen_iterator screen =
+        x_screens_begin(&probe->connection.setup_data);
+    while (x_screens_next(&screen)) {
+      struct x_randr_get_screen_resources_current_request request = {
+          .opcode = randr->opcode,
+          .extension_opcode = X_OPCODE_RANDR_GET_SCREEN_RESOURCES_CURRENT,
+          .request_len =
+              sizeof(struct x_randr_get_screen_resources_current_request) / 4,
+          .window = screen.data.root,
+      };
+      if (x_probe_send_request(probe, x_probe_handle_screen_resources,
+                               screen.index, &request, sizeof(request), 0,
+                               0) != 0)
+        return 1;
+    }
+    return 0;
+  }
+  const struct x_extension *xinerama =
+      x_server_info_find_extension(info, X_EXTENSION_NAME_XINERAMA);
+  if (!xinerama || !xinerama->opcode)
+    return 0;
+  info->monitor_source = X_MONITOR_SOURCE_XINERAMA;
+  struct x_xinerama_query_screens_request request = {
+      .opcode = xinerama->opcode,
+      .extension_opcode = X_OPCODE_XINERAMA_QUERY_SCREENS,
+      .request_len = sizeof(struct x_xinerama_query_screens_request) / 4,
+  };
+  return x_probe_send_request(probe, x_probe_handle_xinerama_screens, 0,
+                              &request, sizeof(request), 0, 0);
+}
+
+/* Fourth stage: look up the monitors, unless already done */
+static int x_probe_submit_monitors(struct x_probe *probe) {
+  return x_probe_submit_monitor_resources(probe);
+}
+
+/* Fifth stage: query every RANDR CRTC and output at once */
+static int x_probe_submit_monitor_details(struct x_probe *probe) {
+  struct x_server_info *info = &probe->info;
+  if (info->monitor_source != X_MONITOR_SOURCE_RANDR || info->monitors_failed)
+    return 0;
+  unsigned int opcode =
+      x_server_info_find_extension(info, X_EXTENSION_NAME_RANDR)->opcode;
+  for (size_t i = 0; i < info->num_crtcs; ++i) {
+    struct x_randr_get_crtc_info_request request = {
+        .opcode = opcode,
+        .extension_opcode = X_OPCODE_RANDR_GET_CRTC_INFO,
+        .request_len = sizeof(struct x_randr_get_crtc_info_request) / 4,
+        .crtc = info->crtcs[i].id,
+        .config_timestamp = info->crtcs[i].config_timestamp,
+    };
+    if (x_probe_send_request(probe, x_probe_handle_crtc_info, i, &request,
+                             sizeof(request), 0, 0) != 0)
+      return 1;
+  }
+  for (size_t i = 0; i < info->num_outputs; ++i) {
+    struct x_randr_get_crtc_info_request request = {
+        .opcode = opcode,
+        .extension_opcode = X_OPCODE_RANDR_GET_OUTPUT_INFO,
+        .request_len = sizeof(struct x_randr_get_crtc_info_request) / 4,
+        .crtc = info->outputs[i].id,
+        .config_timestamp = info->outputs[i].config_timestamp,
+    };
+    if (x_probe_send_request(probe, x_probe_handle_output_info, i, &request,
+                             sizeof(request), 0, 0) != 0)
+      return 1;
+  }
+  return 0;
+}
+
+#define X_PROPERTY_MAX_LEN (1024 * 1024)
+#define X_PROPERTY_MAX_CHUNK_LEN (64 * 1024) /* Of a single GetProperty */
+
+static void x_probe_handle_root_property_list(struct x_probe *probe,
+                                              size_t arg, const char *reply,
+                                              size_t reply_len) {
+  struct x_server_info *info = &probe->info;
+  struct x_list_properties_reply data;
+  memcpy(&data, reply, sizeof(data));
+  if (info->properties_failed)
+    return;
+  if (data.status != X_REPLY ||
+      (reply_len - sizeof(data)) / 4 < data.num_atoms ||
+      grow_array((void **)&info->root_properties, info->num_root_properties,
+                 data.num_atoms, sizeof(struct x_property)) != 0) {
+    info->properties_failed = 1;
+    return;
+  }
+  for (size_t i = 0; i < data.num_atoms; ++i) {
+    struct x_property *property =
+        &info->root_properties[info->num_root_properties++];
+    property->screen = arg;
+    memcpy(&property->atom, reply + sizeof(data) + 4 * i, 4);
+  }
+}
+
+static void x_probe_handle_root_property(struct x_probe *probe, size_t arg,
+                                         const char *reply, size_t reply_len) {
+  struct x_property *property = &probe->info.root_properties[arg];
+  struct x_get_property_reply data;
+  memcpy(&data, reply, sizeof(data));
+  size_t chunk_len = (size_t)data.value_len * (data.format / 8);
+  if (property->failed || data.status != X_REPLY ||
+      reply_len - sizeof(data) < chunk_len) {
+    property->failed = 1;
+    return;
+  }
+  if (!property->received) {
+    property->received = 1;
+    property->type = data.type;
+    property->format = data.format;
+    property->total_len = chunk_len + data.bytes_after;
+    property->value_len = property->total_len < X_PROPERTY_MAX_LEN
+                              ? property->total_len
+                              : X_PROPERTY_MAX_LEN;
+    property->value = malloc(property->value_len ? property->value_len : 1);
+    if (!property->value) {
+      property->failed = 1;
+      return;
+    }
+  } else if (property->type != data.type ||
+             property->format != data.format ||
+             chunk_len > property->total_len ||
+             property->total_len - chunk_len < data.bytes_after) {
+    /* Changed between two chunks */
+    property->failed = 1;
+    return;
+  }
+  /* Chunks are told apart by the number of bytes left after them */
+  size_t offset = property->total_len - chunk_len - data.bytes_after;
+  if (offset < property->value_len) {
+    size_t len = property->value_len - offset;
+    memcpy(property->value + offset, reply + sizeof(data),
+           chunk_len < len ? chunk_len : len);
+  }
+}
+
+static void x_probe_handle_atom_name(struct x_probe *probe, size_t arg,
+                                     const char *reply, size_t reply_len) {
+  struct x_atom *atom = &probe->info.atoms[arg];
+  struct x_get_atom_name_reply data;
+  memcpy(&data, reply, sizeof(data));
+  if (data.status != X_REPLY || reply_len - sizeof(data) < data.name_len)
+    return;
+  atom->name = malloc(data.name_len + 1);
+  if (!atom->name)
+    return;
+  memcpy(atom->name, reply + sizeof(data), data.name_len);
+  atom->name[data.name_len] = '\0';
+}
+
+/* Make room for n more atoms to be added by x_probe_want_atom. Returns
+ * non-zero on failure. */
+static int x_probe_reserve_atoms(struct x_probe *probe, size_t n) {
+  return grow_array((void **)&probe->info.atoms, probe->info.num_atoms, n,
+                    sizeof(struct x_atom));
+}
+
+static void x_probe_want_atom(struct x_probe *probe, uint32_t atom) {
+  if (atom >= X_NUM_PREDEFINED_ATOMS)
+    probe->info.atoms[probe->info.num_atoms++].atom = atom;
+}
+
+/* Sort the atoms wanted so far and look up the names of the new ones, all of
+ * them at once. Returns non-zero on failure. */
+static int x_probe_request_atom_names(struct x_probe *probe) {
+  struct x_server_info *info = &probe->info;
+  if (info->num_atoms == 0)
+    return 0;
+  qsort(info->atoms, info->num_atoms, sizeof(struct x_atom), atom_comparator);
+  size_t num_atoms = 1;
+  for (size_t i = 1; i < info->num_atoms; ++i) {
+    struct x_atom *last = &info->atoms[num_atoms - 1];
+    if (info->atoms[i].atom != last->atom) {
+      info->atoms[num_atoms++] = info->atoms[i];
+      continue;
+    }
+    /* Only atoms wanted by an earlier step are already named */
+    last->requested |= info->atoms[i].requested;
+    if (!last->name)
+      last->name = info->atoms[i].name;
+  }
+  info->num_atoms = num_atoms;
+  for (size_t i = 0; i < info->num_atoms; ++i) {
+    struct x_atom *atom = &info->atoms[i];
+    if (atom->requested)
+      continue;
+    atom->requested = 1;
+    struct x_get_atom_name_request request = {
+        .opcode = X_OPCODE_GET_ATOM_NAME,
+        .request_len = sizeof(struct x_get_atom_name_request) / 4,
+        .atom = atom->atom,
+    };
+    if (x_probe_send_request(probe, x_probe_handle_atom_name, i, &request,
+                             sizeof(request), 0, 0) != 0)
+      return 1;
+  }
+  return 0;
+}
+
+/* Properties are paged through so that no single reply grows past what a
+ * request could hold */
+static size_t x_probe_property_chunk_len(const struct x_probe *probe) {
+  size_t len = probe->info.max_request_len;
+  if (len == 0 || len > X_PROPERTY_MAX_CHUNK_LEN)
+    len = X_PROPERTY_MAX_CHUNK_LEN;
+  return len & ~(size_t)3;
+}
+
+static int x_probe_request_root_property(struct x_probe *probe, size_t index,
+                                         size_t offset) {
+  const struct x_property *property = &probe->info.root_properties[index];
+  struct x_screen_iterator screen =
+      x_screens_begin(&probe->connection.setup_data);
+  while (x_screens_next(&screen) && screen.index != property->screen)
+    ;
+  struct x_get_property_request request = {
+      .opcode = X_OPCODE_GET_PROPERTY,
+      .request_len = sizeof(struct x_get_property_request) / 4,
+      .window = screen.data.root,
+      .property = property->atom,
+      .type = X_ANY_PROPERTY_TYPE,
+      .long_offset = offset / 4,
+      .long_length = x_probe_property_chunk_len(probe) / 4,
+  };
+  return x_probe_send_request(probe, x_probe_handle_root_property, index,
+                              &request, sizeof(request), 0, 0);
+}
+
+/* First step: list the properties of every root window */
+static int x_probe_list_root_properties(struct x_probe *probe) {
+  struct x_screen_iterator screen =
+      x_screens_begin(&probe->connection.setup_data);
+  while (x_screens_next(&screen)) {
+    struct x_list_properties_request request = {
+        .opcode = X_OPCODE_LIST_PROPERTIES,
+        .request_len = sizeof(struct x_list_properties_request) / 4,
+        .window = screen.data.root,
+    };
+    if (x_probe_send_request(probe, x_probe_handle_root_property_list,
+                             screen.index, &request, sizeof(request), 0,
+                             0) != 0)
+      return 1;
+  }
+  return 0;
+}
+
+/* Second step: look up the names of all the properties and the first chunk of
+ * their values */
+static int x_probe_fetch_root_properties(struct x_probe *probe) {
+  struct x_server_info *info = &probe->info;
+  if (x_probe_reserve_atoms(probe, info->num_root_properties) != 0)
+    return 1;
+  for (size_t i = 0; i < info->num_root_properties; ++i) {
+    x_probe_want_atom(probe, info->root_properties[i].atom);
+    if (x_probe_request_root_property(probe, i, 0) != 0)
+      return 1;
+  }
+  return x_probe_request_atom_names(probe);
+}
+
+/* Third step: fetch the rest of the values longer than a chunk, all the
+ * offsets being known from the size reported with the first chunk */
+static int x_probe_fetch_root_property_chunks(struct x_probe *probe) {
+  struct x_server_info *info = &probe->info;
+  size_t chunk_len = x_probe_property_chunk_len(probe);
+  for (size_t i = 0; i < info->num_root_properties; ++i) {
+    const struct x_property *property = &info->root_properties[i];
+    if (property->failed)
+      continue;
+    for (size_t offset = chunk_len; offset < property->value_len;
+         offset += chunk_len) {
+      if (x_probe_request_root_property(probe, i, offset) != 0)
+        return 1;
+    }
+  }
+  return 0;
+}
+
+/* Last step: look up the names of the types of the properties and of the
+ * atoms they hold */
+static int x_probe_name_root_property_atoms(struct x_probe *probe) {
+  struct x_server_info *info = &probe->info;
+  size_t num_wanted = 0;
+  for (size_t i = 0; i < info->num_root_properties; ++i) {
+    const struct x_property *property = &info->root_properties[i];
+    num_wanted += 1;
+    if (property->type == X_ATOM_ATOM && property->format == 32)
+      num_wanted += property->value_len / 4;
+  }
+  if (x_probe_reserve_atoms(probe, num_wanted) != 0)
+    return 1;
+  for (size_t i = 0; i < info->num_root_properties; ++i) {
+    const struct x_property *property = &info->root_properties[i];
+    if (property->failed)
+      continue;
+    x_probe_want_atom(probe, property->type);
+    if (property->type != X_ATOM_ATOM || property->format != 32)
+      continue;
+    for (size_t j = 0; j + 4 <= property->value_len; j += 4) {
+      uint32_t atom;
+      memcpy(&atom, property->value + j, 4);
+      x_probe_want_atom(probe, atom);
+    }
+  }
+  return x_probe_request_atom_names(probe);
+}
+
+static int (*const x_probe_root_property_steps[])(struct x_probe *probe) = {
+    x_probe_list_root_properties,
+    x_probe_fetch_root_properties,
+    x_probe_fetch_root_property_chunks,
+    x_probe_name_root_property_atoms,
+};
+
+#define X_PROBE_NUM_ROOT_PROPERTY_STEPS                                        \
+  (sizeof(x_probe_root_property_steps) /                                       \
+   sizeof(x_probe_root_property_steps[0]))
+
+/* Root window properties do not depend on anything else the probe looks up,
+ * so they are fetched alongside the other stages, one step per stage, with
+ * the steps sending nothing skipped. Returns non-zero on failure. */
+static int x_probe_submit_root_properties(struct x_probe *probe) {
+  struct x_server_info *info = &probe->info;
+  if (!(probe->options->sections & X_SECTION_PROPERTIES))
+    return 0;
+  while ((size_t)info->properties_step < X_PROBE_NUM_ROOT_PROPERTY_STEPS &&
+         !info->properties_failed) {
+    size_t num_pending = probe->num_pending;
+    if (x_probe_root_property_steps[info->properties_step++](probe) != 0)
+      return 1;
+    if (probe->num_pending > num_pending)
+      return 0;
+  }
+  return 0;
+}
+
+/* Whether the major opcodes of the extensions are known by the time the
+ * current stage is submitted */
+static int x_probe_knows_extension_opcodes(const struct x_probe *probe) {
+  if (probe->cached)
+    return 1;
+  return probe->stage >= (x_probe_lists_extensions(probe) ? 2u : 1u);
+}
+
+static void x_probe_handle_clients(struct x_probe *probe, size_t arg,
+                                   const char *reply, size_t reply_len) {
+  (void)arg;
+  struct x_server_info *info = &probe->info;
+  struct x_xres_query_clients_reply data;
+  memcpy(&data, reply, sizeof(data));
+  size_t num_clients = data.num_clients;
+  size_t list_len = num_clients * sizeof(struct x_xres_client);
+  if (data.status != X_REPLY || reply_len - sizeof(data) < list_len ||
+      !(info->client_list = malloc(list_len ? list_len : 1))) {
+    info->clients_failed = 1;
+    return;
+  }
+  memcpy(info->client_list, reply + sizeof(data), list_len);
+  info->num_clients = num_clients;
+  info->next_client = 0;
+}
+
+/* The resources of a client are always requested right before its pixmap
+ * bytes, so its replies come in one after the other */
+static void x_probe_handle_client_resources(struct x_probe *probe, size_t arg,
+                                            const char *reply,
+                                            size_t reply_len) {
+  struct x_client_usage *client = &probe->info.current_client;
+  struct x_xres_query_client_resources_reply data;
+  memcpy(&data, reply, sizeof(data));
+  client->resource_base = arg;
+  client->num_resources = 0;
+  client->failed =
+      data.status != X_REPLY ||
+      (reply_len - sizeof(data)) / sizeof(struct x_xres_type) < data.num_types;
+  if (client->failed)
+    return;
+  for (size_t i = 0; i < data.num_types; ++i) {
+    struct x_xres_type type;
+    memcpy(&type, reply + sizeof(data) + i * sizeof(type), sizeof(type));
+    client->num_resources += type.count;
+  }
+}
+
+static int client_usage_less(const struct x_client_usage *lhs,
+                             const struct x_client_usage *rhs) {
+  if (lhs->pixmap_bytes != rhs->pixmap_bytes)
+    return lhs->pixmap_bytes < rhs->pixmap_bytes;
+  return lhs->num_resources < rhs->num_resources;
+}
+
+/* Keep the client if it is one of the largest seen so far */
+static void x_probe_rank_client(struct x_probe *probe,
+                                const struct x_client_usage *client) {
+  struct x_server_info *info = &probe->info;
+  struct x_client_usage *heap = info->top_clients;
+  size_t num = info->num_top_clients;
+  size_t i;
+  if (num < probe->options->num_top_clients) {
+    /* Sift up from the end */
+    for (i = info->num_top_clients++; i > 0; i = (i - 1) / 2) {
+      if (!client_usage_less(client, &heap[(i - 1) / 2]))
+        break;
+      heap[i] = heap[(i - 1) / 2];
+    }
+  } else if (num > 0 && client_usage_less(&heap[0], client)) {
+    /* Replace the smallest and sift down */
+    for (i = 0; 2 * i + 1 < num;) {
+      size_t child = 2 * i + 1;
+      if (child + 1 < num && client_usage_less(&heap[child + 1], &heap[child]))
+        ++child;
+      if (!client_usage_less(&heap[child], client))
+        break;
+      heap[i] = heap[child];
+      i = child;
+    }
+  } else {
+    return;
+  }
+  heap[i] = *client;
+}
+
+static int x_probe_query_client_usage_window(struct x_probe *probe);
+
+static void x_probe_handle_client_pixmap_bytes(struct x_probe *probe,
+                                               size_t arg, const char *reply,
+                                               size_t reply_len) {
+  (void)reply_len;
+  struct x_server_info *info = &probe->info;
+  struct x_client_usage *client = &info->current_client;
+  struct x_xres_query_client_pixmap_bytes_reply data;
+  memcpy(&data, reply, sizeof(data));
+  if (data.status != X_REPLY || client->failed ||
+      client->resource_base != arg) {
+    ++info->num_vanished_clients;
+  } else {
+    client->pixmap_bytes = (uint64_t)data.bytes_overflow << 32 | data.bytes;
+    info->total_pixmap_bytes += client->pixmap_bytes;
+    info->total_resources += client->num_resources;
+    x_probe_rank_client(probe, client);
+  }
+  /* The next window is part of the same stage */
+  if (--info->num_clients_in_flight == 0 &&
+      info->next_client < info->num_clients) {
+    if (x_probe_query_client_usage_window(probe) != 0)
+      x_probe_fail(probe, "Memory allocation failed");
+    else
+      x_probe_flush(probe);
+  }
+}
+
+/* First step: list the clients of the server */
+static int x_probe_query_clients(struct x_probe *probe) {
+  const struct x_extension *extension =
+      x_server_info_find_extension(&probe->info, X_EXTENSION_NAME_X_RESOURCE);
+  if (!extension || !extension->opcode)
+    return 0;
+  probe->info.clients_available = 1;
+  struct x_xres_query_clients_request request = {
+      .opcode = extension->opcode,
+      .extension_opcode = X_OPCODE_X_RESOURCE_QUERY_CLIENTS,
+      .request_len = sizeof(struct x_xres_query_clients_request) / 4,
+  };
+  return x_probe_send_request(probe, x_probe_handle_clients, 0, &request,
+                              sizeof(request), 0, 0);
+}
+
+/* Clients whose resources and pixmap bytes are requested at a time, which
+ * bounds the requests queued and in flight whatever the number of clients */
+#define X_CLIENT_USAGE_WINDOW 256
+
+/* Query the resources and the pixmap bytes of the next window of clients.
+ * Returns non-zero on failure. */
+static int x_probe_query_client_usage_window(struct x_probe *probe) {
+  struct x_server_info *info = &probe->info;
+  unsigned int opcode =
+      x_server_info_find_extension(info, X_EXTENSION_NAME_X_RESOURCE)->opcode;
+  size_t end = info->num_clients - info->next_client > X_CLIENT_USAGE_WINDOW
+                   ? info->next_client + X_CLIENT_USAGE_WINDOW
+                   : info->num_clients;
+  for (; info->next_client < end; ++info->next_client) {
+    struct x_xres_client client;
+    memcpy(&client, info->client_list + info->next_client * sizeof(client),
+           sizeof(client));
+    struct x_xres_query_client_resources_request request = {
+        .opcode = opcode,
+        .extension_opcode = X_OPCODE_X_RESOURCE_QUERY_CLIENT_RESOURCES,
+        .request_len =
+            sizeof(struct x_xres_query_client_resources_request) / 4,
+        .xid = client.resource_base,
+    };
+    if (x_probe_send_request(probe, x_probe_handle_client_resources,
+                             request.xid, &request, sizeof(request), 0,
+                             0) != 0)
+      return 1;
+    request.extension_opcode = X_OPCODE_X_RESOURCE_QUERY_CLIENT_PIXMAP_BYTES;
+    if (x_probe_send_request(probe, x_probe_handle_client_pixmap_bytes,
+                             request.xid, &request, sizeof(request), 0,
+                             0) != 0)
+      return 1;
+    ++info->num_clients_in_flight;
+  }
+  if (info->next_client == info->num_clients) {
+    free(info->client_list);
+    info->client_list = 0;
+  }
+  return 0;
+}
+
+/* Second step: query the usage of the clients, one window after the other,
+ * the handlers of a window sending the next one */
+static int x_probe_query_client_usage(struct x_probe *probe) {
+  struct x_server_info *info = &probe->info;
+  if (!info->clients_available)
+    return 0;
+  size_t num_top_clients = probe->options->num_top_clients;
+  info->top_clients = malloc(num_top_clients * sizeof(struct x_client_usage));
+  if (!info->top_clients)
+    return 1;
+  return x_probe_query_client_usage_window(probe);
+}
+
+static int client_usage_comparator(const void *lhs, const void *rhs) {
+  /* From the largest */
+  return client_usage_less(lhs, rhs) - client_usage_less(rhs, lhs);
+}
+
+/* Last step: sort the clients that were kept */
+static int x_probe_sort_client_usage(struct x_probe *probe) {
+  struct x_server_info *info = &probe->info;
+  if (info->num_top_clients > 0)
+    qsort(info->top_clients, info->num_top_clients,
+          sizeof(struct x_client_usage), client_usage_comparator);
+  return 0;
+}
+
+static int (*const x_probe_client_usage_steps[])(struct x_probe *probe) = {
+    x_probe_query_clients,
+    x_probe_query_client_usage,
+    x_probe_sort_client_usage,
+};
+
+#define X_PROBE_NUM_CLIENT_USAGE_STEPS                                         \
+  (sizeof(x_probe_client_usage_steps) / sizeof(x_probe_client_usage_steps[0]))
+
+/* Like the root properties, client usage rides along with the other stages
+ * once the opcode of X-Resource is known. Returns non-zero on failure. */
+static int x_probe_submit_client_usage(struct x_probe *probe) {
+  struct x_server_info *info = &probe->info;
+  if (!(probe->options->sections & X_SECTION_CLIENTS) ||
+      !x_probe_knows_extension_opcodes(probe))
+    return 0;
+  while ((size_t)info->clients_step < X_PROBE_NUM_CLIENT_USAGE_STEPS &&
+         !info->clients_failed) {
+    size_t num_pending = probe->num_pending;
+    if (x_probe_client_usage_steps[info->clients_step++](probe) != 0)
+      return 1;
+    if (probe->num_pending > num_pending)
+      return 0;
+  }
+  return 0;
+}
+
+/* First stage: everything that only depends on the setup information */
+static int x_probe_submit_server_queries(struct x_probe *probe) {
+  unsigned int sections = probe->options->sections;
+  struct x_get_font_path_request font_path_request = {
+      .opcode = X_OPCODE_GET_FONT_PATH,
+      .request_len = sizeof(struct x_get_font_path_request) / 4,
+  };
+  struct x_list_extensions_request list_extensions_request = {
+      .opcode = X_OPCODE_LIST_EXTENSIONS,
+      .request_len = sizeof(struct x_list_extensions_request) / 4,
+  };
+  /* If BIG-REQUESTS is available, then the maximum request length may be
+   * higher than the one provided by the connection setup information */
+  if (!probe->cached)
+    probe->info.max_request_len =
+        4 * (size_t)probe->connection.setup_data.data.maximum_request_len;
+  /* When watching, the font search paths are part of the refresh stage */
+  if ((sections & X_SECTION_FONT_PATHS) && !probe->options->watch_interval_ms &&
+      x_probe_send_request(probe, x_probe_handle_font_path, 0,
+                           &font_path_request, sizeof(font_path_request), 0,
+                           0) != 0)
+    return 1;
+  /* All the extensions needed later on are already known */
+  if (probe->cached)
+    return x_probe_submit_monitor_resources(probe);
+  if (!x_probe_lists_extensions(probe))
+    return x_probe_submit_extension_registry(probe);
+  return x_probe_send_request(probe, x_probe_handle_extension_list, 0,
+                              &list_extensions_request,
+                              sizeof(list_extensions_request), 0, 0);
+}
+
+/* Enable BIG-REQUESTS if the server section needs it and it is present */
+static int x_probe_enable_big_requests(struct x_probe *probe) {
+  if (!(probe->options->sections & X_SECTION_SERVER))
+    return 0;
+  const struct x_extension *extension =
+      x_server_info_find_extension(&probe->info, X_EXTENSION_NAME_BIG_REQUESTS);
+  if (!extension || !extension->opcode)
+    return 0;
+  struct x_big_requests_enable_request request = {
+      .opcode = extension->opcode,
+      .extension_opcode = X_OPCODE_BIG_REQUESTS_ENABLE,
+      .request_len = sizeof(struct x_big_requests_enable_request) / 4,
+  };
+  return x_probe_send_request(probe, x_probe_handle_big_requests_enable, 0,
+                              &request, sizeof(request), 0, 0);
+}
+
+/* Query the versions of all the known extensions that are present */
+static int x_probe_query_extension_versions(struct x_probe *probe) {
+  for (size_t i = 0; i < probe->info.num_extensions; ++i) {
+    struct x_extension *extension = &probe->info.extensions[i];
+    if (!extension->opcode || !extension->info)
+      continue;
+    char request[X_VERSION_QUERY_MAX_LEN];
+    size_t len = x_encode_version_query(&extension->info->version,
+                                        extension->opcode, request);
+    if (len == 0) {
+      extension->version_failed =
+          x_decode_version_reply(&extension->info->version, 0,
+                                 &extension->version_major,
+                                 &extension->version_minor);
+      continue;
+    }
+    if (x_probe_send_request(probe, x_probe_handle_extension_version, i,
+                             request, len, 0, 0) != 0)
+      return 1;
+  }
+  return 0;
+}
+
+/* Second stage: look up the major opcodes of all the listed extensions, or
+ * make use of the ones already looked up by name */
+static int x_probe_submit_extension_opcodes(struct x_probe *probe) {
+  if (probe->cached)
+    return 0;
+  if (!x_probe_lists_extensions(probe)) {
+    if (x_probe_enable_big_requests(probe) != 0)
+      return 1;
+    return x_probe_query_extension_versions(probe);
+  }
+  for (size_t i = 0; i < probe->info.num_extensions; ++i) {
+    if (x_probe_query_extension(probe, probe->info.extensions[i].query_name,
+                                x_probe_handle_extension_opcode, i) != 0)
+      return 1;
+  }
+  return 0;
+}
+
+/* Third stage: enable BIG-REQUESTS and query the versions of the extensions
+ * listed by the server */
+static int x_probe_submit_extension_versions(struct x_probe *probe) {
+  if (!x_probe_lists_extensions(probe))
+    return 0; /* Already done in the second stage, or cached */
+  if (x_probe_enable_big_requests(probe) != 0)
+    return 1;
+  return x_probe_query_extension_versions(probe);
+}
+
+/* Refresh stage, only run when watching: query what may change during the
+ * life of a connection. It ends the first pass over a new connection, and is
+ * then run again on its own at every refresh. */
+static int x_probe_submit_refresh(struct x_probe *probe) {
+  unsigned int sections = probe->options->sections;
+  struct x_server_info *info = &probe->info;
+  if (sections & X_SECTION_SCREENS) {
+    const struct x_setup_data *setup_data = &probe->connection.setup_data;
+    int first_refresh = !info->root_geometries;
+    if (first_refresh) {
+      size_t num_roots = setup_data->data.num_roots;
+      info->root_geometries =
+          calloc(num_roots ? num_roots : 1, sizeof(struct x_root_geometry));
+      if (!info->root_geometries)
+        return 1;
+    }
+    struct x_screen_iterator screen = x_screens_begin(setup_data);
+    while (x_screens_next(&screen)) {
+      struct x_get_geometry_request request = {
+          .opcode = X_OPCODE_GET_GEOMETRY,
+          .request_len = sizeof(struct x_get_geometry_request) / 4,
+          .drawable = screen.data.root,
+      };
+      if (first_refresh) {
+        info->root_geometries[screen.index].width = screen.data.width_in_pixels;
+        info->root_geometries[screen.index].height =
+            screen.data.height_in_pixels;
+      }
+      if (x_probe_send_request(probe, x_probe_handle_root_geometry,
+                               screen.index, &request, sizeof(request), 0,
+                               0) != 0)
+        return 1;
+      info->num_root_geometries = screen.index + 1;
+    }
+  }
+  struct x_get_font_path_request font_path_request = {
+      .opcode = X_OPCODE_GET_FONT_PATH,
+      .request_len = sizeof(struct x_get_font_path_request) / 4,
+  };
+  if ((sections & X_SECTION_FONT_PATHS) &&
+      x_probe_send_request(probe, x_probe_handle_font_path, 0,
+                           &font_path_request, sizeof(font_path_request), 0,
+                           0) != 0)
+    return 1;
+  return 0;
+}
+
+static const struct x_probe_stage {
+  const char *name; /* For timings */
+  int (*submit)(struct x_probe *probe);
+} x_probe_stages[] = {
+    {"Server queries", x_probe_submit_server_queries},
+    {"Extension opcodes", x_probe_submit_extension_opcodes},
+    {"Extension versions", x_probe_submit_extension_versions},
+    {"Monitor resources", x_probe_submit_monitors},
+    {"Monitor details", x_probe_submit_monitor_details},
+    {"Refresh", x_probe_submit_refresh},
+};
+
+/* Requests independent of the stages, whose steps are submitted along with
+ * them, one step per stage */
+static const struct x_probe_stage x_probe_side_stages[] = {
+    {"Root properties", x_probe_submit_root_properties},
+    {"Client usage", x_probe_submit_client_usage},
+};
+
+#define X_PROBE_NUM_STAGES                                                     \
+  (sizeof(x_probe_stages) / sizeof(struct x_probe_stage))
+#define X_PROBE_REFRESH_STAGE (X_PROBE_NUM_STAGES - 1)
+
+static void x_probe_start_pings(struct x_probe *probe);
+static void x_probe_finish(struct x_probe *probe);
+
+/* Submit the requests of the first stage, starting from the given one, that
+ * has anything to send to the server */
+static void x_probe_run_stages(struct x_probe *probe, size_t first_stage) {
+  struct x_connection *c = &probe->connection;
+  size_t end_stage = probe->options->watch_interval_ms ? X_PROBE_NUM_STAGES
+                                                      : X_PROBE_REFRESH_STAGE;
+  for (size_t stage = first_stage; stage < end_stage; ++stage) {
+    probe->stage = stage;
+    probe->num_pending = 0;
+    probe->num_answered = 0;
+    probe->first_sequence_number = c->sequence_number + 1;
+    probe->phase_start_ms = monotonic_now_ms();
+    if (x_probe_stages[stage].submit(probe) != 0) {
+      x_probe_fail(probe, "Memory allocation failed");
+      return;
+    }
+    probe->phase_name = x_probe_stages[stage].name;
+    for (size_t i = 0; stage < X_PROBE_REFRESH_STAGE &&
+                       i < sizeof(x_probe_side_stages) /
+                               sizeof(x_probe_side_stages[0]);
+         ++i) {
+      size_t num_pending = probe->num_pending;
+      if (x_probe_side_stages[i].submit(probe) != 0) {
+        x_probe_fail(probe, "Memory allocation failed");
+        return;
+      }
+      /* Stages only made of side requests are named after the first ones */
+      if (num_pending == 0 && probe->num_pending > 0 &&
+          probe->phase_name == x_probe_stages[stage].name)
+        probe->phase_name = x_probe_side_stages[i].name;
+    }
+    if (probe->num_pending > 0) {
+      x_probe_reset_read_deadline(probe);
+      x_probe_flush(probe);
+      return;
+    }
+  }
+  if (probe->options->sections & X_SECTION_PING)
+    x_probe_start_pings(probe);
+  else
+    x_probe_finish(probe);
+}
+
+static void x_probe_finish(struct x_probe *probe) {
+  struct x_connection *c = &probe->connection;
+  const struct x_probe_options *options = probe->options;
+  if (options->use_cache && !probe->cached &&
+      (options->sections & X_SECTION_SERVER) &&
+      (options->sections & X_SECTION_EXTENSIONS) &&
+      options->num_extension_names == 0 && !probe->info.extensions_failed) {
+    x_cache_store(probe);
+    probe->cached = 1;
+  }
+  probe->state = X_PROBE_DONE;
+  probe->read_deadline_ms = 0;
+  c->timings.end_ms = monotonic_now_ms();
+  if (!probe->options->watch_interval_ms)
+    x_close(c);
+}
+
+/* Queue a GetInputFocus request, whose reply carries no data. Pings are not
+ * part of the request timings, the ping section being a single phase. Returns
+ * non-zero on failure. */
+static int x_probe_send_ping(struct x_probe *probe, double now) {
+  struct x_connection *c = &probe->connection;
+  struct x_get_input_focus_request request = {
+      .opcode = X_OPCODE_GET_INPUT_FOCUS,
+      .request_len = sizeof(struct x_get_input_focus_request) / 4,
+  };
+  char *buffer = output_buffer_reserve(&c->output, sizeof(request));
+  if (!buffer)
+    return 1;
+  memcpy(buffer, &request, sizeof(request));
+  ++c->sequence_number;
+  probe->ping_sent_ms[c->sequence_number & (probe->ping_ring_size - 1)] = now;
+  ++probe->num_pings_in_flight;
+  ++probe->info.ping.num_sent;
+  return 0;
+}
+
+/* Send the pings that are due and allowed in flight */
+static void x_probe_send_pings(struct x_probe *probe) {
+  const struct x_probe_options *options = probe->options;
+  double now = monotonic_now_ms();
+  int sent = 0;
+  while (probe->info.ping.num_sent < options->num_pings &&
+         probe->num_pings_in_flight < options->ping_depth &&
+         now >= probe->next_ping_ms) {
+    if (x_probe_send_ping(probe, now) != 0) {
+      x_probe_fail(probe, "Memory allocation failed");
+      return;
+    }
+    sent = 1;
+    if (options->ping_interval_ms)
+      probe->next_ping_ms = now + options->ping_interval_ms;
+  }
+  if (sent) {
+    x_probe_reset_read_deadline(probe);
+    x_probe_flush(probe);
+  }
+}
+
+/* Ping section: measure round-trip times on the established connection once
+ * everything else is known, then finish */
+static void x_probe_start_pings(struct x_probe *probe) {
+  size_t ring_size = 1;
+  while (ring_size < probe->options->ping_depth)
+    ring_size *= 2;
+  if (!probe->ping_sent_ms) {
+    probe->ping_sent_ms = malloc(ring_size * sizeof(double));
+    if (!probe->ping_sent_ms) {
+      x_probe_fail(probe, "Memory allocation failed");
+      return;
+    }
+    probe->ping_ring_size = ring_size;
+  }
+  struct x_ping_stats *stats = &probe->info.ping;
+  uint32_t *buckets = stats->buckets;
+  if (!buckets && !(buckets = malloc(X_PING_NUM_BUCKETS * sizeof(uint32_t)))) {
+    x_probe_fail(probe, "Memory allocation failed");
+    return;
+  }
+  memset(buckets, 0, X_PING_NUM_BUCKETS * sizeof(uint32_t));
+  memset(stats, 0, sizeof(*stats));
+  stats->buckets = buckets;
+  probe->pinging = 1;
+  probe->num_pings_in_flight = 0;
+  probe->next_ping_ms = 0;
+  probe->phase_start_ms = monotonic_now_ms();
+  stats->start_ms = probe->phase_start_ms;
+  x_probe_send_pings(probe);
+}
+
+/* Replies come in the order of the requests, so the oldest ping in flight is
+ * the one answered */
+static void x_probe_handle_ping(struct x_probe *probe, uint16_t sequence_number,
+                                const char *reply) {
+  struct x_connection *c = &probe->connection;
+  uint16_t newer = c->sequence_number - sequence_number;
+  if (newer + 1u != probe->num_pings_in_flight) {
+    x_probe_fail(probe, "Unexpected message received from X server");
+    return;
+  }
+  double now = monotonic_now_ms();
+  struct x_ping_stats *stats = &probe->info.ping;
+  size_t slot = sequence_number & (probe->ping_ring_size - 1);
+  x_ping_stats_add(stats, now - probe->ping_sent_ms[slot]);
+  if ((uint8_t)reply[0] != X_REPLY)
+    ++stats->num_errors;
+  if (--probe->num_pings_in_flight == 0)
+    probe->read_deadline_ms = 0; /* Until the next ping */
+  if (stats->num_received < probe->options->num_pings) {
+    x_probe_send_pings(probe);
+    return;
+  }
+  stats->end_ms = now;
+  probe->pinging = 0;
+  timings_add_phase(&c->timings, "Ping", probe->phase_start_ms);
+  x_probe_finish(probe);
+}
+
+static void x_probe_connected(struct x_probe *probe, int fd) {
+  struct x_connection *c = &probe->connection;
+  x_probe_close_attempts(probe);
+  c->fd = fd;
+  timings_add_phase(&c->timings, "Connection to server",
+                    probe->phase_start_ms);
+  probe->phase_start_ms = monotonic_now_ms();
+  /* Without authentication data, both the protocol name and data are empty */
+  const char *auth_info = probe->auth_info ? probe->auth_info : "";
+  int failed = x_send_setup_request(c, probe->auth_protocol_name_len, auth_info,
+                                    probe->auth_data_len,
+                                    auth_info + probe->auth_protocol_name_len);
+  free(probe->auth_info);
+  probe->auth_info = 0;
+  if (failed) {
+    x_probe_fail(probe, "Memory allocation failed");
+    return;
+  }
+  probe->state = X_PROBE_SETUP;
+  x_probe_reset_read_deadline(probe);
+  x_probe_flush(probe);
+}
+
+/* Time to wait before racing the next address against the attempts in
+ * progress, see RFC 8305 */
+#define X_CONNECTION_ATTEMPT_DELAY_MS 250
+/* Time to wait before trying again to connect to a local server whose listen
+ * queue is full */
+#define X_CONNECT_RETRY_DELAY_MS 10
+
+/* Start the connection attempts that are due. A new attempt is started when
+ * the previous one failed or did not succeed within the connection attempt
+ * delay, while the previous attempts keep going. The first attempt to succeed
+ * wins. */
+static void x_probe_attempt_connections(struct x_probe *probe) {
+  double now = monotonic_now_ms();
+  while (now >= probe->next_attempt_ms &&
+         probe->next_address < probe->num_addresses) {
+    size_t index = probe->next_address++;
+    const struct x_address *address = &probe->addresses[index];
+    int fd = socket(address->addr.ss_family, SOCK_STREAM, 0);
+    if (fd == -1)
+      continue;
+    int flags = fcntl(fd, F_GETFL);
+    int result = -1;
+    int connect_errno = 0;
+    if (flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1) {
+      result = connect(fd, (const struct sockaddr *)&address->addr,
+                       address->addr_len);
+      connect_errno = errno;
+    }
+    if (result == 0) {
+      x_probe_connected(probe, fd);
+      return;
+    }
+    if (result == -1 &&
+        (connect_errno == EINPROGRESS || connect_errno == EINTR)) {
+      probe->attempt_fds[index] = fd;
+      probe->next_attempt_ms = now + X_CONNECTION_ATTEMPT_DELAY_MS;
+      continue;
+    }
+    /* Connection failed, close the socket and move on to the next address
+     * right away */
+    close(fd);
+    if (connect_errno == EAGAIN) {
+      /* The listen queue of a local server is full, try the same address
+       * again a bit later */
+      --probe->next_address;
+      probe->next_attempt_ms = now + X_CONNECT_RETRY_DELAY_MS;
+    }
+  }
+
+  if (probe->next_address < probe->num_addresses)
+    return;
+  for (size_t i = 0; i < probe->num_addresses; ++i) {
+    if (probe->attempt_fds[i] != -1)
+      return;
+  }
+  x_probe_fail(probe, "Failed to connect to X server");
+}
+
+/* Prepare everything needed to connect to the display, then start connecting
+ * to its X server */
+static void x_probe_start(struct x_probe *probe) {
+  struct x_connection *c = &probe->connection;
+  c->timings.start_ms = monotonic_now_ms();
+  unsigned int connect_timeout_ms = probe->options->connect_timeout_ms;
+  if (connect_timeout_ms)
+    probe->connect_deadline_ms = c->timings.start_ms + connect_timeout_ms;
+
+  struct x_display_name name;
+  const char *error = 0;
+  if (parse_x_display_name(probe->display_name, &name, &error) != 0 ||
+      x_get_display_addresses(&name, &c->timings, &probe->addresses,
+                              &probe->num_addresses, &error) != 0) {
+    x_probe_fail(probe, error);
+    return;
+  }
+
+  /* We can now try to find the appropriate authentication method to connect to
+   * the selected display. We read the Xauthority file to determine which
+   * protocol and authentication data should be used, if any. */
+  double start = monotonic_now_ms();
+  int failed = xauth_get_auth_info(
+      &name, probe->options->use_xauth_index, &probe->auth_info,
+      &probe->auth_protocol_name_len, &probe->auth_data_len, &error);
+  timings_add_phase(&c->timings, "Xauthority lookup", start);
+  if (failed) {
+    x_probe_fail(probe, error);
+    return;
+  }
+
+  probe->attempt_fds =
+      malloc((probe->num_addresses ? probe->num_addresses : 1) * sizeof(int));
+  if (!probe->attempt_fds) {
+    x_probe_fail(probe, "Memory allocation failed");
+    return;
+  }
+  for (size_t i = 0; i < probe->num_addresses; ++i)
+    probe->attempt_fds[i] = -1;
+  probe->phase_start_ms = monotonic_now_ms();
+  probe->state = X_PROBE_CONNECTING;
+  x_probe_attempt_connections(probe);
+}
+
+/* Handle all the complete answers received so far */
+static void x_probe_process_input(struct x_probe *probe) {
+  struct x_connection *c = &probe->connection;
+  if (probe->state == X_PROBE_SETUP) {
+    int result =
+        x_receive_setup_response(c, probe->error, sizeof(probe->error));
+    if (result > 0)
+      return;
+    if (result < 0) {
+      x_probe_fail(probe, probe->error);
+      return;
+    }
+    timings_add_phase(&c->timings, "Connection setup", probe->phase_start_ms);
+    const struct x_probe_options *options = probe->options;
+    if (options->use_cache && options->num_extension_names == 0 &&
+        (options->sections & (X_SECTION_SERVER | X_SECTION_EXTENSIONS |
+                              X_SECTION_MONITORS | X_SECTION_CLIENTS))) {
+      double start = monotonic_now_ms();
+      probe->cached = x_cache_load(probe) == 0;
+      timings_add_phase(&c->timings, "Cache lookup", start);
+    }
+    probe->state = X_PROBE_RUNNING;
+    x_probe_run_stages(probe, 0);
+  }
+
+  const char *reply;
+  size_t reply_len;
+  while (probe->state == X_PROBE_RUNNING &&
+         (reply = x_next_reply(c, &reply_len))) {
+    uint16_t sequence_number;
+    memcpy(&sequence_number, reply + 2, sizeof(sequence_number));
+    if (probe->pinging) {
+      x_probe_handle_ping(probe, sequence_number, reply);
+      continue;
+    }
+    uint16_t index = sequence_number - probe->first_sequence_number;
+    if (index >= probe->num_pending) {
+      x_probe_fail(probe, "Unexpected message received from X server");
+      return;
+    }
+    const struct x_pending_reply *pending = &probe->pending[index];
+    pending->handle(probe, pending->arg, reply, reply_len);
+    if (++probe->num_answered == probe->num_pending &&
+        probe->state == X_PROBE_RUNNING) {
+      timings_add_phase(&c->timings, probe->phase_name,
+                        probe->phase_start_ms);
+      x_probe_run_stages(probe, probe->stage + 1);
+    }
+  }
+}
+
+/* React to the readiness of a socket of a probe in progress, which is either
+ * the connection to the server or one of the connection attempts */
+static void x_probe_handle_events(struct x_probe *probe, int fd,
+                                  short revents) {
+  struct x_connection *c = &probe->connection;
+  if (probe->state == X_PROBE_CONNECTING) {
+    for (size_t i = 0; i < probe->num_addresses; ++i) {
+      if (probe->attempt_fds[i] != fd)
+        continue;
+      int error = 0;
+      socklen_t error_len = sizeof(error);
+      probe->attempt_fds[i] = -1;
+      if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1 ||
+          error != 0) {
+        /* This attempt failed, do not wait any longer before trying the next
+         * address */
+        close(fd);
+        probe->next_attempt_ms = 0;
+        x_probe_attempt_connections(probe);
+      } else {
+        x_probe_connected(probe, fd);
+      }
+      break;
+    }
+    return;
+  }
+  if (fd != c->fd)
+    return;
+
+  if (revents & POLLOUT)
+    x_probe_flush(probe);
+  if (probe->state < X_PROBE_DONE && (revents & (POLLIN | POLLHUP | POLLERR))) {
+    if (input_buffer_receive(&c->input, c->fd) != 0) {
+      x_probe_fail(probe, "Failed to read from X server");
+      return;
+    }
+    if (probe->state != X_PROBE_IDLE)
+      x_probe_reset_read_deadline(probe);
+    x_probe_process_input(probe);
+  }
+}
+
+static int x_probe_in_progress(const struct x_probe *probe) {
+  return probe->state < X_PROBE_DONE;
+}
+
+static double earliest_deadline(double first, double second) {
+  if (first == 0 || (second != 0 && second < first))
+    return second;
+  return first;
+}
+
+/* Time at which the probe has something to do even if none of its sockets is
+ * ready, or zero if there is none */
+static double x_probe_next_timer(const struct x_probe *probe) {
+  if (probe->state == X_PROBE_IDLE)
+    return probe->next_refresh_ms;
+  if (probe->state != X_PROBE_CONNECTING) {
+    const struct x_probe_options *options = probe->options;
+    if (probe->pinging && probe->next_ping_ms &&
+        probe->info.ping.num_sent < options->num_pings &&
+        probe->num_pings_in_flight < options->ping_depth)
+      return earliest_deadline(probe->read_deadline_ms, probe->next_ping_ms);
+    return probe->read_deadline_ms;
+  }
+  double next = probe->connect_deadline_ms;
+  if (probe->next_address < probe->num_addresses)
+    next = earliest_deadline(next, probe->next_attempt_ms);
+  return next;
+}
+
+/* Probe again a display being watched. Connections which failed are
+ * established again from scratch. */
+static void x_probe_refresh(struct x_probe *probe) {
+  if (probe->connection.fd == -1) {
+    const struct x_probe_options *options = probe->options;
+    const char *display_name = probe->display_name;
+    x_probe_free(probe);
+    x_probe_init(probe, options, display_name, 0);
+    x_probe_start(probe);
+    return;
+  }
+  probe->state = X_PROBE_RUNNING;
+  x_probe_run_stages(probe, X_PROBE_REFRESH_STAGE);
+}
+
+static void x_probe_handle_timers(struct x_probe *probe, double now) {
+  if (probe->state == X_PROBE_IDLE) {
+    if (now >= probe->next_refresh_ms)
+      x_probe_refresh(probe);
+  } else if (probe->state == X_PROBE_CONNECTING) {
+    if (probe->connect_deadline_ms && now >= probe->connect_deadline_ms)
+      x_probe_fail(probe, "Timed out connecting to X server");
+    else
+      x_probe_attempt_connections(probe);
+  } else if (probe->read_deadline_ms && now >= probe->read_deadline_ms) {
+    x_probe_fail(probe, "Timed out waiting for X server");
+  } else if (probe->pinging) {
+    x_probe_send_pings(probe);
+  }
+}
+
+/* Queue the sockets a probe is waiting on for poll. Returns non-zero on
+ * allocation failure. */
+static int x_probe_add_poll_fds(struct x_probe *probe, struct pollfd **fds,
+                                struct x_probe ***fd_probes, size_t *num_fds,
+                                size_t *capacity) {
+  size_t needed = 1;
+  if (probe->state == X_PROBE_CONNECTING)
+    needed = probe->num_addresses;
+  else if (probe->connection.fd == -1)
+    return 0; /* Waiting to reconnect */
+  if (*capacity - *num_fds < needed) {
+    size_t new_capacity = *capacity ? 2 * *capacity : 64;
+    while (new_capacity - *num_fds < needed)
+      new_capacity *= 2;
+    struct pollfd *new_fds = realloc(*fds, new_capacity * sizeof(**fds));
+    if (!new_fds)
+      return 1;
+    *fds = new_fds;
+    struct x_probe **new_fd_probes =
+        realloc(*fd_probes, new_capacity * sizeof(**fd_probes));
+    if (!new_fd_probes)
+      return 1;
+    *fd_probes = new_fd_probes;
+    *capacity = new_capacity;
+  }
+
+  struct pollfd entry = {.fd = probe->connection.fd, .events = POLLIN};
+  if (probe->state == X_PROBE_CONNECTING) {
+    entry.events = POLLOUT;
+    for (size_t i = 0; i < probe->num_addresses; ++i) {
+      if (probe->attempt_fds[i] == -1)
+        continue;
+      entry.fd = probe->attempt_fds[i];
+      (*fd_probes)[*num_fds] = probe;
+      (*fds)[(*num_fds)++] = entry;
+    }
+    return 0;
+  }
+  if (probe->connection.output.len > 0)
+    entry.events |= POLLOUT;
+  (*fd_probes)[*num_fds] = probe;
+  (*fds)[(*num_fds)++] = entry;
+  return 0;
+}
+
+/* Timeout for poll to wake up at the given time, or to wait forever if it is
+ * zero */
+static int poll_timeout_ms(double next_timer) {
+  if (next_timer == 0)
+    return -1;
+  double delay_ms = next_timer - monotonic_now_ms();
+  return delay_ms <= 0 ? 0 : delay_ms >= INT_MAX ? INT_MAX : (int)delay_ms + 1;
+}
+
+/* Probe several displays concurrently from a single event loop. At most
+ * max_active probes are in progress at any time. Every probe is handed to the
+ * report function in order, as soon as it and all the probes before it are
+ * finished. */
+static void x_probe_displays(struct x_probe *probes, size_t num_probes,
+                             size_t max_active,
+                             void (*report)(struct x_probe *probe,
+                                            void *context),
+                             void *context) {
+  struct pollfd *fds = 0;
+  struct x_probe **fd_probes = 0;
+  size_t fds_capacity = 0;
+
+  size_t next_start = 0;
+  size_t next_report = 0;
+  for (;;) {
+    while (next_report < next_start &&
+           !x_probe_in_progress(&probes[next_report]))
+      report(&probes[next_report++], context);
+    if (next_report == num_probes)
+      break;
+
+    /* Gather the sockets and the timers of the probes in progress, and start
+     * new probes as long as there is room for them. Probes which fail right
+     * away are reported in the next iteration. */
+    size_t num_fds = 0;
+    size_t num_active = 0;
+    double next_timer = 0;
+    for (size_t i = next_report; i < next_start || num_active < max_active;
+         ++i) {
+      if (i >= next_start) {
+        if (next_start == num_probes)
+          break;
+        x_probe_start(&probes[next_start++]);
+      }
+      struct x_probe *probe = &probes[i];
+      if (!x_probe_in_progress(probe))
+        continue;
+      ++num_active;
+      next_timer = earliest_deadline(next_timer, x_probe_next_timer(probe));
+      if (x_probe_add_poll_fds(probe, &fds, &fd_probes, &num_fds,
+                               &fds_capacity) != 0)
+        die("Memory allocation failed");
+    }
+    if (num_active == 0)
+      continue;
+
+    if (poll(fds, num_fds, poll_timeout_ms(next_timer)) == -1) {
+      if (errno == EINTR)
+        continue;
+      die("Failed to wait for X server connections");
+    }
+    for (size_t i = 0; i < num_fds; ++i) {
+      if (fds[i].revents && x_probe_in_progress(fd_probes[i]))
+        x_probe_handle_events(fd_probes[i], fds[i].fd, fds[i].revents);
+    }
+    double now = monotonic_now_ms();
+    for (size_t i = next_report; i < next_start; ++i) {
+      if (x_probe_in_progress(&probes[i]))
+        x_probe_handle_timers(&probes[i], now);
+    }
+  }
+  free(fd_probes);
+  free(fds);
+}
+
+/* Watch several displays from a single event loop, which never returns.
+ * Every probe is handed to the report function whenever it completes or
+ * fails, then refreshed interval milliseconds later. */
+NORETURN static void x_watch_displays(struct x_probe *probes,
+                                      size_t num_probes,
+                                      unsigned int interval_ms,
+                                      void (*report)(struct x_probe *probe,
+                                                     void *context),
+                                      void *context) {
+  struct pollfd *fds = 0;
+  struct x_probe **fd_probes = 0;
+  size_t fds_capacity = 0;
+
+  for (size_t i = 0; i < num_probes; ++i)
+    x_probe_start(&probes[i]);
+  for (;;) {
+    size_t num_fds = 0;
+    double next_timer = 0;
+    for (size_t i = 0; i < num_probes; ++i) {
+      struct x_probe *probe = &probes[i];
+      if (probe->state == X_PROBE_DONE || probe->state == X_PROBE_FAILED) {
+        report(probe, context);
+        probe->state = X_PROBE_IDLE;
+        probe->next_refresh_ms = monotonic_now_ms() + interval_ms;
+      }
+      next_timer = earliest_deadline(next_timer, x_probe_next_timer(probe));
+      if (x_probe_add_poll_fds(probe, &fds, &fd_probes, &num_fds,
+                               &fds_capacity) != 0)
+        die("Memory allocation failed");
+    }
+
+    if (poll(fds, num_fds, poll_timeout_ms(next_timer)) == -1) {
+      if (errno == EINTR)
+        continue;
+      die("Failed to wait for X server connections");
+    }
+    for (size_t i = 0; i < num_fds; ++i) {
+      if (fds[i].revents && x_probe_in_progress(fd_probes[i]))
+        x_probe_handle_events(fd_probes[i], fds[i].fd, fds[i].revents);
+    }
+    double now = monotonic_now_ms();
+    for (size_t i = 0; i < num_probes; ++i) {
+      if (x_probe_in_progress(&probes[i]))
+        x_probe_handle_timers(&probes[i], now);
+    }
+  }
+}
+
+/* Number of connections that can be open at the same time, leaving some file
+ * descriptors for everything else */
+static size_t x_max_active_probes(void) {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY)
+    return 1024;
+  return limit.rlim_cur > 64 ? (size_t)limit.rlim_cur - 32 : 16;
+}
+
+#define LEFT_PAD 0
+#define FIELD_WIDTH 45
+
+#define STRINGIFY_IMPL(x) #x
+#define STRINGIFY(x) STRINGIFY_IMPL(x)
+#define FILL "........................................"
+#define SPACE "                                        "
+#define PRINT_FIELD(out, name, format, ...)                                    \
+  output_printf(out,                                                           \
+                "%." STRINGIFY(LEFT_PAD) "s%." STRINGIFY(FIELD_WIDTH)          \
+                                             "s " format "\n",                 \
+                SPACE, name FILL, __VA_ARGS__)
+/* Same as PRINT_FIELD for names that are not string literals */
+#define PRINT_NAMED_FIELD(out, name, format, ...)                              \
+  output_printf(out, "%." STRINGIFY(LEFT_PAD) "s%s%.*s " format "\n", SPACE,   \
+                name, fill_length(FIELD_WIDTH, name), FILL, __VA_ARGS__)
+
+static int fill_length(size_t field_width, const char *name) {
+  size_t name_len = strlen(name);
+  return name_len < field_width ? (int)(field_width - name_len) : 0;
+}
+
+static void print_x_server(struct output_stream *out,
+                           const struct x_setup_data *setup_data,
+                           const struct x_server_info *info) {
+  const char *image_byte_order =
+      setup_data->data.image_byte_order == X_BYTE_ORDER_LITTLE_ENDIAN
+          ? "little endian"
+          : "big endian";
+  const char *bitmap_format_bit_order =
+      setup_data->data.bitmap_format_bit_order ==
+              X_BITMAP_FORMAT_BIT_ORDER_LEAST_SIGNIFICANT
+          ? "least significant"
+          : "most significant";
+  unsigned int release_major = setup_data->data.release_number / 10000000;
+  unsigned int release_minor = (setup_data->data.release_number / 100000) % 100;
+  unsigned int release_patch = (setup_data->data.release_number / 1000) % 100;
+  unsigned int release_build = setup_data->data.release_number % 1000;
+
+  output_printf(out, "\n");
+  PRINT_FIELD(out, "Vendor", "%.*s", (int)setup_data->data.vendor_length,
+              setup_data->vendor_name);
+  PRINT_FIELD(out, "Version", "%u.%u", setup_data->version_major,
+              setup_data->version_minor);
+  if (release_build != 0)
+    PRINT_FIELD(out, "Release number", "%u.%u.%u.%u", release_major,
+                release_minor, release_patch, release_build);
+  else
+    PRINT_FIELD(out, "Release number", "%u.%u.%u", release_major,
+                release_minor, release_patch);
+  output_printf(out, "\n");
+  PRINT_FIELD(out, "Resource ID base", "0x%08x",
+              setup_data->data.resource_id_base);
+  PRINT_FIELD(out, "Resource ID mask", "0x%08x",
+              setup_data->data.resource_id_mask);
+  PRINT_FIELD(out, "Motion buffer size", "%u",
+              setup_data->data.motion_buffer_size);
+  PRINT_FIELD(out, "Maximum request length", "%zu bytes",
+              info->max_request_len);
+  PRINT_FIELD(out, "Image byte order", "%s", image_byte_order);
+  PRINT_FIELD(out, "Bitmap format bit order", "%s first",
+              bitmap_format_bit_order);
+  PRINT_FIELD(out, "Bitmap format scanline unit", "%u",
+              setup_data->data.bitmap_format_scanline_unit);
+  PRINT_FIELD(out, "Bitmap format scanline pad", "%u",
+              setup_data->data.bitmap_format_scanline_pad);
+  PRINT_FIELD(out, "Max keycode", "%u", setup_data->data.max_keycode);
+  PRINT_FIELD(out, "Min keycode", "%u", setup_data->data.min_keycode);
+  PRINT_FIELD(out, "Number of pixmap formats", "%u",
+              setup_data->data.num_pixmap_formats);
+  PRINT_FIELD(out, "Number of screens", "%u", setup_data->data.num_roots);
+}
+
+static void print_x_pixmap_formats(struct output_stream *out,
+                                   const struct x_setup_data *setup_data) {
+  output_printf(out, "\nPixmap formats:\n");
+  for (size_t i = 0; i < setup_data->data.num_pixmap_formats; ++i) {
+    struct x_format format = x_get_pixmap_format(setup_data, i);
+    output_printf(out,
+                  "  * depth = %2u, bits per pixel = %2u, scanline pad = %u\n",
+                  format.depth, format.bits_per_pixel, format.scanline_pad);
+  }
+}
+
+static void print_x_visual_stats(struct output_stream *out,
+                                 const struct x_screen_iterator *screen) {
+  struct x_visual_stats stats;
+  x_visual_stats_compute(&stats, screen);
+#undef LEFT_PAD
+#undef FIELD_WIDTH
+#define LEFT_PAD 6
+#define FIELD_WIDTH 39
+  output_printf(out, "    Visual classes:\n");
+  for (size_t i = 0; i < sizeof(stats.classes) / sizeof(stats.classes[0]); ++i)
+    if (stats.classes[i])
+      PRINT_NAMED_FIELD(out, visual_class_to_string(i), "%zu",
+                        stats.classes[i]);
+  output_printf(out, "    Bits per RGB value:\n");
+  for (size_t i = 0; i < sizeof(stats.bits_per_rgb_values) /
+                             sizeof(stats.bits_per_rgb_values[0]);
+       ++i) {
+    if (!stats.bits_per_rgb_values[i])
+      continue;
+    char name[8];
+    snprintf(name, sizeof(name), "%zu", i);
+    PRINT_NAMED_FIELD(out, name, "%zu", stats.bits_per_rgb_values[i]);
+  }
+}
+
+static void print_x_screens(struct output_stream *out,
+                            const struct x_setup_data *setup_data,
+                            int print_visuals, int print_visual_stats) {
+  output_printf(out, "\nScreens:\n");
+  struct x_screen_iterator screen = x_screens_begin(setup_data);
+  while (x_screens_next(&screen)) {
+    output_printf(out, "  Screen #%zu\n", screen.index);
+#undef LEFT_PAD
+#undef FIELD_WIDTH
 #define LEFT_PAD 4
 #define FIELD_WIDTH 41
     const char *backing_stores =
-        screen->data.backing_stores == X_BACKING_STORES_NEVER
+        screen.data.backing_stores == X_BACKING_STORES_NEVER
             ? "never"
-            : (screen->data.backing_stores == X_BACKING_STORES_WHEN_MAPPED
+            : (screen.data.backing_stores == X_BACKING_STORES_WHEN_MAPPED
                    ? "when mapped"
                    : "always");
 
-    PRINT_FIELD("Root", "0x%08x", screen->data.root);
-    PRINT_FIELD("Default colormap", "0x%08x", screen->data.default_colormap);
-    PRINT_FIELD("White pixel", "0x%08x", screen->data.white_pixel);
-    PRINT_FIELD("Black pixel", "0x%08x", screen->data.black_pixel);
-    PRINT_FIELD("Current input mask", "0x%08x",
-                screen->data.current_input_mask);
+    PRINT_FIELD(out, "Root", "0x%08x", screen.data.root);
+    PRINT_FIELD(out, "Default colormap", "0x%08x",
+                screen.data.default_colormap);
+    PRINT_FIELD(out, "White pixel", "0x%08x", screen.data.white_pixel);
+    PRINT_FIELD(out, "Black pixel", "0x%08x", screen.data.black_pixel);
+    PRINT_FIELD(out, "Current input mask", "0x%08x",
+                screen.data.current_input_mask);
+#undef LEFT_PAD
+#undef FIELD_WIDTH
+#define LEFT_PAD 6
+#define FIELD_WIDTH 39
+    for (size_t i = 0; i < sizeof(x_event_masks) / sizeof(x_event_masks[0]);
+         ++i)
+      PRINT_NAMED_FIELD(out, x_event_masks[i].label, "%s",
+                        bool_to_string(screen.data.current_input_mask &
+                                       x_event_masks[i].mask));
+
+#undef LEFT_PAD
+#undef FIELD_WIDTH
+#define LEFT_PAD 4
+#define FIELD_WIDTH 41
+    PRINT_FIELD(out, "Size", "%ux%u pixels (%ux%u mm)",
+                screen.data.width_in_pixels, screen.data.height_in_pixels,
+                screen.data.width_in_millimeters,
+                screen.data.height_in_millimeters);
+    PRINT_FIELD(out, "Installed maps", "min = %u, max = %u",
+                screen.data.min_installed_maps, screen.data.max_installed_maps);
+    PRINT_FIELD(out, "Root visual id", "0x%08x", screen.data.root_visual_id);
+    PRINT_FIELD(out, "Backing stores", "%s", backing_stores);
+    PRINT_FIELD(out, "Save unders", "%s",
+                bool_to_string(screen.data.save_unders));
+    PRINT_FIELD(out, "Root depth", "%u", screen.data.root_depth);
+    PRINT_FIELD(out, "Number of allowed depths", "%u",
+                screen.data.num_allowed_depths);
+
+    output_printf(out, "    Allowed depths:\n");
+    struct x_depth_iterator depth = x_depths_begin(&screen);
+    while (x_depths_next(&depth)) {
+      output_printf(out, "      * depth = %2u, number of visuals: %u\n",
+                    depth.data.depth, depth.data.num_visuals);
+      if (!print_visuals)
+        continue;
+      struct x_visual_iterator visual = x_visuals_begin(&depth);
+      while (x_visuals_next(&visual))
+        output_printf(out,
+                      "        - id = 0x%08x, class = %s, bits per RGB value = "
+                      "%u, colormap entries = %u, masks = 0x%08x 0x%08x "
+                      "0x%08x\n",
+                      visual.data.visual_id,
+                      visual_class_to_string(visual.data.visual_class),
+                      visual.data.bits_per_rgb_value,
+                      visual.data.colormap_entries, visual.data.red_mask,
+                      visual.data.green_mask, visual.data.blue_mask);
+    }
+    if (print_visual_stats)
+      print_x_visual_stats(out, &screen);
+  }
+}
+
+/* Refresh rate of the mode of a CRTC in hertz, or 0 if unknown */
+static double x_crtc_refresh_rate(const struct x_server_info *info,
+                                  const struct x_crtc *crtc) {
+  for (size_t i = 0; i < info->num_modes; ++i) {
+    const struct x_mode *mode = &info->modes[i];
+    if (mode->id != crtc->mode)
+      continue;
+    double vtotal = mode->vtotal;
+    if (mode->flags & X_RANDR_MODE_FLAG_DOUBLE_SCAN)
+      vtotal *= 2;
+    if (mode->flags & X_RANDR_MODE_FLAG_INTERLACE)
+      vtotal /= 2;
+    if (mode->htotal == 0 || vtotal == 0)
+      return 0;
+    return mode->dot_clock / (mode->htotal * vtotal);
+  }
+  return 0;
+}
+
+/* CRTC showing an output, or null if the output is off */
+static const struct x_crtc *x_output_crtc(const struct x_server_info *info,
+                                          const struct x_output *output) {
+  if (output->crtc == 0)
+    return 0;
+  for (size_t i = 0; i < info->num_crtcs; ++i) {
+    const struct x_crtc *crtc = &info->crtcs[i];
+    if (crtc->screen == output->screen && crtc->id == output->crtc)
+      return crtc->failed || crtc->mode == 0 ? 0 : crtc;
+  }
+  return 0;
+}
+
+static const char *x_monitor_source_to_string(int source) {
+  switch (source) {
+  case X_MONITOR_SOURCE_RANDR:
+    return "RANDR";
+  case X_MONITOR_SOURCE_XINERAMA:
+    return "XINERAMA";
+  default:
+    return 0;
+  }
+}
+
+static const char *x_output_connection_to_string(uint8_t connection) {
+  switch (connection) {
+  case X_RANDR_CONNECTED:
+    return "connected";
+  case X_RANDR_DISCONNECTED:
+    return "disconnected";
+  default:
+    return "unknown";
+  }
+}
+
+static void print_x_monitors(struct output_stream *out,
+                             const struct x_setup_data *setup_data,
+                             const struct x_server_info *info) {
+  if (info->monitors_failed) {
+    fprintf(stderr, "ERROR: Failed to query X monitors\n");
+    return;
+  }
+
+#undef FIELD_WIDTH
+#define FIELD_WIDTH 41
+  switch (info->monitor_source) {
+  case X_MONITOR_SOURCE_RANDR:
+    output_printf(out, "\nMonitors (RANDR): %zu\n", info->num_outputs);
+    for (size_t i = 0; i < info->num_outputs; ++i) {
+      const struct x_output *output = &info->outputs[i];
+      const char *name = output->failed ? "unknown" : output->name;
+      output_printf(out, "  * %s%.*s ", name, fill_length(FIELD_WIDTH, name),
+                    FILL);
+      const struct x_crtc *crtc = x_output_crtc(info, output);
+      if (output->failed)
+        output_printf(out, "unknown");
+      else if (!crtc)
+        output_printf(out, "%s, off",
+                      x_output_connection_to_string(output->connection));
+      else
+        output_printf(out, "%ux%u+%d+%d, %.2f Hz, %ux%u mm", crtc->width,
+                      crtc->height, crtc->x, crtc->y,
+                      x_crtc_refresh_rate(info, crtc), output->mm_width,
+                      output->mm_height);
+      if (setup_data->data.num_roots > 1)
+        output_printf(out, ", screen %zu", output->screen);
+      output_printf(out, "\n");
+    }
+    break;
+  case X_MONITOR_SOURCE_XINERAMA:
+    output_printf(out, "\nMonitors (XINERAMA): %zu\n", info->num_crtcs);
+    for (size_t i = 0; i < info->num_crtcs; ++i) {
+      const struct x_crtc *crtc = &info->crtcs[i];
+      char name[32];
+      snprintf(name, sizeof(name), "Screen #%zu", i);
+      output_printf(out, "  * %s%.*s %ux%u+%d+%d\n", name,
+                    fill_length(FIELD_WIDTH, name), FILL, crtc->width,
+                    crtc->height, crtc->x, crtc->y);
+    }
+    break;
+  default:
+    output_printf(out, "\nMonitors: unknown (RANDR 1.3 and XINERAMA "
+                       "unavailable)\n");
+  }
+}
+
+static void print_x_font_path(struct output_stream *out,
+                              const struct x_server_info *info) {
+  if (info->font_path_failed) {
+    fprintf(stderr, "ERROR: Failed get X font search paths\n");
+    return;
+  }
+
+  output_printf(out, "\nFont search paths:\n");
+  const char *curr_data = info->font_path;
+  const char *data_end = info->font_path + info->font_path_len;
+  for (size_t i = 0; i < info->num_font_paths && curr_data < data_end; ++i) {
+    uint8_t path_len = 0;
+    memcpy(&path_len, curr_data, 1);
+    curr_data += 1;
+    if (path_len > data_end - curr_data)
+      break;
+    output_printf(out, "  * %.*s\n", (int)path_len, curr_data);
+    curr_data += path_len;
+  }
+}
+
+/* Number of items of a property value, which are at most 32 bits wide */
+static size_t x_property_num_items(const struct x_property *property) {
+  return property->format == 8 || property->format == 16 ||
+                 property->format == 32
+             ? property->value_len / (property->format / 8)
+             : 0;
+}
+
+static uint32_t x_property_item(const struct x_property *property,
+                                size_t index) {
+  uint8_t value8;
+  uint16_t value16;
+  uint32_t value32;
+  switch (property->format) {
+  case 8:
+    memcpy(&value8, property->value + index, sizeof(value8));
+    return value8;
+  case 16:
+    memcpy(&value16, property->value + 2 * index, sizeof(value16));
+    return value16;
+  default:
+    memcpy(&value32, property->value + 4 * index, sizeof(value32));
+    return value32;
+  }
+}
+
+/* Checks that a format 8 property value is valid UTF-8 text. A truncated
+ * value may end in the middle of a character, which is then left out of
+ * *text_len. */
+static int x_property_is_utf8(const struct x_property *property,
+                              size_t *text_len) {
+  const unsigned char *data = (const unsigned char *)property->value;
+  size_t len = property->value_len;
+  size_t i = 0;
+  while (i < len) {
+    size_t seq_len = 0;
+    uint32_t code = 0;
+    uint32_t min_code = 0;
+    if (data[i] < 0x80) {
+      ++i;
+      continue;
+    } else if ((data[i] & 0xe0) == 0xc0) {
+      seq_len = 2;
+      code = data[i] & 0x1f;
+      min_code = 0x80;
+    } else if ((data[i] & 0xf0) == 0xe0) {
+      seq_len = 3;
+      code = data[i] & 0x0f;
+      min_code = 0x800;
+    } else if ((data[i] & 0xf8) == 0xf0) {
+      seq_len = 4;
+      code = data[i] & 0x07;
+      min_code = 0x10000;
+    } else {
+      return 0;
+    }
+    size_t available = seq_len < len - i ? seq_len : len - i;
+    for (size_t j = 1; j < available; ++j) {
+      if ((data[i + j] & 0xc0) != 0x80)
+        return 0;
+      code = code << 6 | (data[i + j] & 0x3f);
+    }
+    if (available < seq_len) {
+      if (property->value_len == property->total_len)
+        return 0;
+      break;
+    }
+    if (code < min_code || code > 0x10ffff ||
+        (code >= 0xd800 && code <= 0xdfff))
+      return 0;
+    i += seq_len;
+  }
+  *text_len = i;
+  return 1;
+}
+
+/* Whether the items of a property are resource identifiers */
+static int x_property_holds_ids(const struct x_property *property) {
+  switch (property->type) {
+  case X_ATOM_COLORMAP:
+  case X_ATOM_CURSOR:
+  case X_ATOM_DRAWABLE:
+  case X_ATOM_FONT:
+  case X_ATOM_PIXMAP:
+  case X_ATOM_VISUALID:
+  case X_ATOM_WINDOW:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/* Print the strings of a property of format 8, which are separated by null
+ * bytes, the last one being optionally terminated by one */
+static void print_x_property_strings(struct output_stream *out,
+                                     const struct x_property *property) {
+  size_t len = property->value_len;
+  if (len > 0 && property->value[len - 1] == '\0' &&
+      property->value_len == property->total_len)
+    --len;
+  output_printf(out, "\"");
+  for (size_t i = 0; i < len; ++i) {
+    unsigned char c = property->value[i];
+    if (c == '\0')
+      output_printf(out, "\", \"");
+    else if (c == '\n')
+      output_printf(out, "\\n");
+    else if (c == '\t')
+      output_printf(out, "\\t");
+    else if (c == '"' || c == '\\')
+      output_printf(out, "\\%c", c);
+    else if (c < 0x20 || c == 0x7f)
+      output_printf(out, "\\%03o", c);
+    else
+      output_write(out, (const char *)&c, 1);
+  }
+  output_printf(out, "\"");
+}
+
+static void print_x_root_properties(struct output_stream *out,
+                                    const struct x_setup_data *setup_data,
+                                    const struct x_server_info *info) {
+  if (info->properties_failed) {
+    fprintf(stderr, "ERROR: Failed to query X root window properties\n");
+    return;
+  }
+
+  output_printf(out, "\nRoot window properties:\n");
+  struct x_screen_iterator screen = x_screens_begin(setup_data);
+  while (x_screens_next(&screen)) {
+    output_printf(out, "  Screen #%zu\n", screen.index);
+    for (size_t i = 0; i < info->num_root_properties; ++i) {
+      const struct x_property *property = &info->root_properties[i];
+      if (property->screen != screen.index)
+        continue;
+      const char *name = x_server_info_atom_name(info, property->atom);
+      if (name)
+        output_printf(out, "    * %s", name);
+      else
+        output_printf(out, "    * 0x%08x", property->atom);
+      if (property->failed) {
+        output_printf(out, ": unknown\n");
+        continue;
+      }
+      if (property->type == 0) {
+        output_printf(out, ": deleted\n");
+        continue;
+      }
+      const char *type = x_server_info_atom_name(info, property->type);
+      if (type)
+        output_printf(out, "(%s) = ", type);
+      else
+        output_printf(out, "(0x%08x) = ", property->type);
+      size_t num_items = x_property_num_items(property);
+      if (property->format == 8) {
+        print_x_property_strings(out, property);
+      } else {
+        for (size_t j = 0; j < num_items; ++j) {
+          uint32_t item = x_property_item(property, j);
+          const char *separator = j > 0 ? ", " : "";
+          const char *atom_name = property->type == X_ATOM_ATOM
+                                      ? x_server_info_atom_name(info, item)
+                                      : 0;
+          if (atom_name)
+            output_printf(out, "%s%s", separator, atom_name);
+          else if (property->type == X_ATOM_ATOM ||
+                   x_property_holds_ids(property))
+            output_printf(out, "%s0x%08x", separator, item);
+          else if (property->type == X_ATOM_INTEGER)
+            output_printf(out, "%s%ld", separator,
+                          property->format == 16 ? (long)(int16_t)item
+                                                 : (long)(int32_t)item);
+          else
+            output_printf(out, "%s%lu", separator, (unsigned long)item);
+        }
+      }
+      if (property->value_len < property->total_len)
+        output_printf(out, " (truncated, %zu bytes)", property->total_len);
+      output_printf(out, "\n");
+    }
+  }
+}
+
+static void print_x_extensions(struct output_stream *out,
+                               const struct x_server_info *info) {
+  if (info->extensions_failed) {
+    fprintf(stderr, "ERROR: Failed to query supported X extensions\n");
+    return;
+  }
+
+#undef FIELD_WIDTH
+#define FIELD_WIDTH 41
+  size_t num_present = 0;
+  for (size_t i = 0; i < info->num_extensions; ++i)
+    num_present +=
+        info->extensions[i].listed && info->extensions[i].opcode != 0;
+  output_printf(out, "\nSupported extensions: %zu\n", num_present);
+  for (size_t i = 0; i < info->num_extensions; ++i) {
+    const struct x_extension *extension = &info->extensions[i];
+    if (extension->listed && extension->opcode) {
+      output_printf(out, "  * %s%.*s ", extension->name,
+                    fill_length(FIELD_WIDTH, extension->name), FILL);
+      if (!extension->version_failed)
+        output_printf(out, "v%u.%u\n", extension->version_major,
+                      extension->version_minor);
+      else
+        output_printf(out, "unknown version\n");
+    }
+  }
+}
+
+static void print_x_clients(struct output_stream *out,
+                            const struct x_server_info *info) {
+  if (info->clients_failed) {
+    fprintf(stderr, "ERROR: Failed to query X clients\n");
+    return;
+  }
+  if (!info->clients_available) {
+    output_printf(out, "\nClients: unknown (X-Resource unavailable)\n");
+    return;
+  }
+
+#undef LEFT_PAD
+#undef FIELD_WIDTH
+#define LEFT_PAD 2
+#define FIELD_WIDTH 43
+  output_printf(out, "\nClients (X-Resource): %zu\n", info->num_clients);
+  PRINT_FIELD(out, "Pixmap bytes", "%llu",
+              (unsigned long long)info->total_pixmap_bytes);
+  PRINT_FIELD(out, "Resources", "%llu",
+              (unsigned long long)info->total_resources);
+  if (info->num_vanished_clients > 0)
+    PRINT_FIELD(out, "Disconnected while probing", "%zu",
+                info->num_vanished_clients);
+  output_printf(out, "  Top %zu by pixmap bytes:\n", info->num_top_clients);
+#undef LEFT_PAD
+#undef FIELD_WIDTH
+#define LEFT_PAD 4
+#define FIELD_WIDTH 41
+  for (size_t i = 0; i < info->num_top_clients; ++i) {
+    const struct x_client_usage *client = &info->top_clients[i];
+    char name[16];
+    snprintf(name, sizeof(name), "0x%08x", client->resource_base);
+    PRINT_NAMED_FIELD(out, name, "%llu pixmap bytes, %llu resources",
+                      (unsigned long long)client->pixmap_bytes,
+                      (unsigned long long)client->num_resources);
+  }
+}
+
+static void print_x_ping(struct output_stream *out,
+                         const struct x_probe_options *options,
+                         const struct x_server_info *info) {
+  const struct x_ping_stats *stats = &info->ping;
+  output_printf(out, "\nPing (GetInputFocus): %zu round-trips, up to %zu in "
+                     "flight\n",
+                stats->num_received, options->ping_depth);
 #undef LEFT_PAD
 #undef FIELD_WIDTH
-#define LEFT_PAD 6
-#define FIELD_WIDTH 39
-    PRINT_FIELD("Key press", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_KEY_PRESS));
-    PRINT_FIELD("Key release", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_KEY_RELEASE));
-    PRINT_FIELD("Button press", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_BUTTON_PRESS));
-    PRINT_FIELD("Button release", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_BUTTON_RELEASE));
-    PRINT_FIELD("Enter window", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_ENTER_WINDOW));
-    PRINT_FIELD("Leave window", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_LEAVE_WINDOW));
-    PRINT_FIELD("Pointer motion", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_POINTER_MOTION));
-    PRINT_FIELD("Pointer motion hint", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_POINTER_MOTION_HINT));
-    PRINT_FIELD("Button 1 motion", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_BUTTON1_MOTION));
-    PRINT_FIELD("Button 2 motion", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_BUTTON2_MOTION));
-    PRINT_FIELD("Button 3 motion", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_BUTTON3_MOTION));
-    PRINT_FIELD("Button 4 motion", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_BUTTON4_MOTION));
-    PRINT_FIELD("Button 5 motion", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_BUTTON5_MOTION));
-    PRINT_FIELD("Button motion", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_BUTTON_MOTION));
-    PRINT_FIELD("Keymap state", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_KEYMAP_STATE));
-    PRINT_FIELD("Exposure", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_EXPOSURE));
-    PRINT_FIELD("Visibility change", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_VISIBILITY_CHANGE));
-    PRINT_FIELD("Structure notify", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_STRUCTURE_NOTIFY));
-    PRINT_FIELD("Resize redirect", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_RESIZE_REDIRECT));
-    PRINT_FIELD("Substructure notify", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_SUBSTRUCTURE_NOTIFY));
-    PRINT_FIELD("Substructure redirect", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_SUBSTRUCTURE_REDIRECT));
-    PRINT_FIELD("Focus change", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_FOCUS_CHANGE));
-    PRINT_FIELD("Property change", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_PROPERTY_CHANGE));
-    PRINT_FIELD("Colormap change", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_COLORMAP_CHANGE));
-    PRINT_FIELD("Owner grab button", "%s",
-                bool_to_string(screen->data.current_input_mask &
-                               X_EVENT_MASK_OWNER_GRAB_BUTTON));
+#define LEFT_PAD 2
+#define FIELD_WIDTH 43
+  PRINT_FIELD(out, "Minimum", "%.3f ms", stats->min_ms);
+  PRINT_FIELD(out, "Mean", "%.3f ms",
+              stats->num_received ? stats->total_ms / stats->num_received : 0);
+  PRINT_FIELD(out, "50th percentile", "%.3f ms",
+              x_ping_stats_percentile(stats, 0.5));
+  PRINT_FIELD(out, "90th percentile", "%.3f ms",
+              x_ping_stats_percentile(stats, 0.9));
+  PRINT_FIELD(out, "99th percentile", "%.3f ms",
+              x_ping_stats_percentile(stats, 0.99));
+  PRINT_FIELD(out, "99.9th percentile", "%.3f ms",
+              x_ping_stats_percentile(stats, 0.999));
+  PRINT_FIELD(out, "Maximum", "%.3f ms", stats->max_ms);
+  double duration_ms = stats->end_ms - stats->start_ms;
+  PRINT_FIELD(out, "Round-trips per second", "%.0f",
+              duration_ms > 0 ? stats->num_received * 1000 / duration_ms : 0);
+  if (stats->num_errors > 0)
+    PRINT_FIELD(out, "Errors", "%zu", stats->num_errors);
+}
 
+static const char *x_core_request_name(unsigned int opcode) {
+  switch (opcode) {
+  case X_OPCODE_GET_GEOMETRY:
+    return "GetGeometry";
+  case X_OPCODE_GET_ATOM_NAME:
+    return "GetAtomName";
+  case X_OPCODE_GET_PROPERTY:
+    return "GetProperty";
+  case X_OPCODE_LIST_PROPERTIES:
+    return "ListProperties";
+  case X_OPCODE_GET_FONT_PATH:
+    return "GetFontPath";
+  case X_OPCODE_QUERY_EXTENSION:
+    return "QueryExtension";
+  case X_OPCODE_LIST_EXTENSIONS:
+    return "ListExtensions";
+  default:
+    return "unknown";
+  }
+}
+
+static void print_timings(struct output_stream *out,
+                          const struct x_connection *c) {
+  const struct timings *timings = &c->timings;
+  output_printf(out, "\nTimings:\n");
+  output_printf(out, "  Phases:\n");
 #undef LEFT_PAD
 #undef FIELD_WIDTH
 #define LEFT_PAD 4
 #define FIELD_WIDTH 41
-    PRINT_FIELD("Size", "%ux%u pixels (%ux%u mm)", screen->data.width_in_pixels,
-                screen->data.height_in_pixels,
-                screen->data.width_in_millimeters,
-                screen->data.height_in_millimeters);
-    PRINT_FIELD("Installed maps", "min = %u, max = %u",
-                screen->data.min_installed_maps,
-                screen->data.max_installed_maps);
-    PRINT_FIELD("Root visual id", "0x%08x", screen->data.root_visual_id);
-    PRINT_FIELD("Backing stores", "%s", backing_stores);
-    PRINT_FIELD("Save unders", "%s", bool_to_string(screen->data.save_unders));
-    PRINT_FIELD("Root depth", "%u", screen->data.root_depth);
-    PRINT_FIELD("Number of allowed depths", "%u",
-                screen->data.num_allowed_depths);
-
-    printf("    Allowed depths:\n");
-    for (size_t j = 0; j < screen->data.num_allowed_depths; ++j)
-      printf("      * depth = %2u, number of visuals: %u\n",
-             screen->allowed_depths[j].data.depth,
-             screen->allowed_depths[j].data.num_visuals);
-  }
-}
-
-static void print_x_font_path(void) {
-  struct x_get_font_path_request request = {
-      .opcode = X_OPCODE_GET_FONT_PATH,
-      .request_len = sizeof(struct x_get_font_path_request) / 4,
-  };
-  char *additional_data = 0;
-
-  /* Request the font search paths from the X server */
-  ssize_t num_written = write_n(x_connection.fd, &request, sizeof(request));
-  if (num_written != sizeof(request))
-    goto font_error;
-
-  struct x_get_font_path_reply reply = {0};
-  ssize_t num_read = read_n(x_connection.fd, &reply, sizeof(reply));
-  /* If we fail, don't try to understand why and just return */
-  if (num_read != sizeof(reply) || reply.status != X_REPLY)
-    goto font_error;
-
-  size_t additional_data_len = 4 * reply.data_len;
-  additional_data = malloc(additional_data_len);
-  if (!additional_data)
-    goto font_error;
-  num_read = read(x_connection.fd, additional_data, additional_data_len);
-  if (num_read != (ssize_t)additional_data_len)
-    goto font_error;
-
-  printf("\nFont search paths:\n");
-  char path[256] = {0};
-  const char *curr_data = additional_data;
-  for (size_t i = 0; i < reply.num_strings; ++i) {
+  for (size_t i = 0; i < timings->num_phases; ++i)
+    PRINT_NAMED_FIELD(out, timings->phases[i].name, "%.3f ms",
+                      timings->phases[i].duration_ms);
+  PRINT_FIELD(out, "Total", "%.3f ms", timings->end_ms - timings->start_ms);
+
+  output_printf(out, "  Requests:\n");
+  for (size_t i = 0; i < timings->num_requests; ++i) {
+    const struct request_timing *request = &timings->requests[i];
+    char name[64];
+    if (request->opcode < 128) {
+      snprintf(name, sizeof(name), "#%u %s", request->sequence_number,
+               x_core_request_name(request->opcode));
+    } else {
+      const char *extension_name =
+          timings->extension_names[request->opcode - 128];
+      snprintf(name, sizeof(name), "#%u %s:%u", request->sequence_number,
+               extension_name ? extension_name : "unknown",
+               request->minor_opcode);
+    }
+    if (request->sent_ms >= 0 && request->reply_ms >= 0)
+      PRINT_NAMED_FIELD(out, name, "%.3f ms",
+                        request->reply_ms - request->sent_ms);
+    else
+      PRINT_NAMED_FIELD(out, name, "%s", "no reply");
+  }
+
+  output_printf(out, "  Input/output:\n");
+  const struct input_buffer *input = &c->input;
+  const struct output_buffer *output = &c->output;
+  PRINT_FIELD(out, "System calls", "%zu (%zu reads, %zu writes)",
+              input->num_syscalls + output->num_syscalls, input->num_syscalls,
+              output->num_syscalls);
+  PRINT_FIELD(out, "Bytes sent", "%zu", output->num_bytes);
+  PRINT_FIELD(out, "Bytes received", "%zu", input->num_bytes);
+  if (c->num_discarded_events > 0)
+    PRINT_FIELD(out, "Events discarded", "%zu", c->num_discarded_events);
+}
+
+/* Structured output. A report is a tree of objects, arrays and scalar values
+ * which every backend serializes in its own way, as it is being written. Keys
+ * are ignored for the elements of arrays. */
+#define REPORT_MAX_DEPTH 16
+
+enum report_value_kind {
+  REPORT_VALUE_STRING,
+  REPORT_VALUE_NUMBER, /* Also used for booleans */
+  REPORT_VALUE_NULL,
+};
+
+struct report_writer;
+
+struct report_writer_ops {
+  void (*begin)(struct report_writer *w, const char *key, int is_array);
+  void (*end)(struct report_writer *w);
+  void (*scalar)(struct report_writer *w, const char *key, const char *value,
+                 size_t value_len, enum report_value_kind kind);
+};
+
+struct report_writer {
+  const struct report_writer_ops *ops;
+  struct output_stream *out;
+  const char *display_name;
+  size_t depth;
+  struct {
+    int is_array;
+    size_t num_elements;
+    size_t path_len; /* Length of the path before this level */
+  } levels[REPORT_MAX_DEPTH];
+  char path[512]; /* Line protocol only */
+  size_t path_len;
+};
+
+static void report_begin_object(struct report_writer *w, const char *key) {
+  w->ops->begin(w, key, 0);
+}
+
+static void report_begin_array(struct report_writer *w, const char *key) {
+  w->ops->begin(w, key, 1);
+}
+
+static void report_end(struct report_writer *w) { w->ops->end(w); }
+
+static void report_string_n(struct report_writer *w, const char *key,
+                            const char *value, size_t value_len) {
+  w->ops->scalar(w, key, value, value_len, REPORT_VALUE_STRING);
+}
+
+static void report_string(struct report_writer *w, const char *key,
+                          const char *value) {
+  report_string_n(w, key, value, strlen(value));
+}
+
+static void report_uint(struct report_writer *w, const char *key,
+                        unsigned long long value) {
+  char buffer[32];
+  int len = snprintf(buffer, sizeof(buffer), "%llu", value);
+  w->ops->scalar(w, key, buffer, len, REPORT_VALUE_NUMBER);
+}
+
+static void report_int(struct report_writer *w, const char *key,
+                       long long value) {
+  char buffer[32];
+  int len = snprintf(buffer, sizeof(buffer), "%lld", value);
+  w->ops->scalar(w, key, buffer, len, REPORT_VALUE_NUMBER);
+}
+
+static void report_double(struct report_writer *w, const char *key,
+                          double value) {
+  char buffer[64];
+  int len = snprintf(buffer, sizeof(buffer), "%.3f", value);
+  w->ops->scalar(w, key, buffer, len, REPORT_VALUE_NUMBER);
+}
+
+static void report_bool(struct report_writer *w, const char *key, int value) {
+  w->ops->scalar(w, key, value ? "true" : "false", value ? 4 : 5,
+                 REPORT_VALUE_NUMBER);
+}
+
+static void report_null(struct report_writer *w, const char *key) {
+  w->ops->scalar(w, key, "null", 4, REPORT_VALUE_NULL);
+}
+
+/* Bookkeeping shared by the backends. Returns the index of the new element
+ * in its parent array, if any. */
+static size_t report_add_element(struct report_writer *w) {
+  return w->depth > 0 ? w->levels[w->depth - 1].num_elements++ : 0;
+}
+
+static void report_push_level(struct report_writer *w, int is_array) {
+  if (w->depth == REPORT_MAX_DEPTH)
+    die("Report nested too deeply");
+  w->levels[w->depth].is_array = is_array;
+  w->levels[w->depth].num_elements = 0;
+  w->levels[w->depth].path_len = w->path_len;
+  ++w->depth;
+}
+
+/* JSON backend, writing one object per line (JSON Lines) */
+static void json_write_string(struct output_stream *out, const char *value,
+                              size_t value_len) {
+  output_write(out, "\"", 1);
+  size_t start = 0;
+  for (size_t i = 0; i < value_len; ++i) {
+    unsigned char c = value[i];
+    if (c >= 0x20 && c != '"' && c != '\\')
+      continue;
+    output_write(out, value + start, i - start);
+    if (c == '"' || c == '\\')
+      output_printf(out, "\\%c", c);
+    else
+      output_printf(out, "\\u%04x", c);
+    start = i + 1;
+  }
+  output_write(out, value + start, value_len - start);
+  output_write(out, "\"", 1);
+}
+
+static void json_write_prefix(struct report_writer *w, const char *key) {
+  if (report_add_element(w) > 0)
+    output_write(w->out, ",", 1);
+  if (w->depth > 0 && !w->levels[w->depth - 1].is_array) {
+    json_write_string(w->out, key, strlen(key));
+    output_write(w->out, ":", 1);
+  }
+}
+
+static void json_begin(struct report_writer *w, const char *key,
+                       int is_array) {
+  json_write_prefix(w, key);
+  output_write(w->out, is_array ? "[" : "{", 1);
+  report_push_level(w, is_array);
+}
+
+static void json_end(struct report_writer *w) {
+  --w->depth;
+  output_write(w->out, w->levels[w->depth].is_array ? "]" : "}", 1);
+  if (w->depth == 0)
+    output_write(w->out, "\n", 1);
+}
+
+static void json_scalar(struct report_writer *w, const char *key,
+                        const char *value, size_t value_len,
+                        enum report_value_kind kind) {
+  json_write_prefix(w, key);
+  if (kind == REPORT_VALUE_STRING)
+    json_write_string(w->out, value, value_len);
+  else
+    output_write(w->out, value, value_len);
+}
+
+static const struct report_writer_ops json_writer_ops = {
+    .begin = json_begin,
+    .end = json_end,
+    .scalar = json_scalar,
+};
+
+/* Line protocol backend, writing one "display path=value" line per scalar
+ * value. Paths are made of the keys of the enclosing objects and the indices
+ * of the enclosing arrays, separated by dots. */
+static void line_push_segment(struct report_writer *w, const char *key) {
+  size_t index = report_add_element(w);
+  if (w->depth == 0)
+    return; /* The root of the report has no name */
+  char index_string[32];
+  if (w->levels[w->depth - 1].is_array) {
+    snprintf(index_string, sizeof(index_string), "%zu", index);
+    key = index_string;
+  }
+  int len = snprintf(w->path + w->path_len, sizeof(w->path) - w->path_len,
+                     "%s%s", w->path_len > 0 ? "." : "", key);
+  if (len > 0)
+    w->path_len += len;
+  if (w->path_len >= sizeof(w->path))
+    w->path_len = sizeof(w->path) - 1;
+}
+
+static void line_begin(struct report_writer *w, const char *key,
+                       int is_array) {
+  size_t path_len = w->path_len;
+  line_push_segment(w, key);
+  report_push_level(w, is_array);
+  w->levels[w->depth - 1].path_len = path_len;
+}
+
+static void line_end(struct report_writer *w) {
+  --w->depth;
+  w->path_len = w->levels[w->depth].path_len;
+  w->path[w->path_len] = '\0';
+}
+
+static void line_scalar(struct report_writer *w, const char *key,
+                        const char *value, size_t value_len,
+                        enum report_value_kind kind) {
+  size_t path_len = w->path_len;
+  line_push_segment(w, key);
+  /* Missing values are simply left out */
+  if (kind != REPORT_VALUE_NULL) {
+    output_printf(w->out, "%s %.*s=", w->display_name, (int)w->path_len,
+                  w->path);
+    /* Values extend to the end of the line, so only line breaks and the
+     * escape character itself need escaping */
+    size_t start = 0;
+    for (size_t i = 0; i < value_len; ++i) {
+      if (value[i] != '\n' && value[i] != '\\')
+        continue;
+      output_write(w->out, value + start, i - start);
+      output_write(w->out, value[i] == '\n' ? "\\n" : "\\\\", 2);
+      start = i + 1;
+    }
+    output_write(w->out, value + start, value_len - start);
+    output_write(w->out, "\n", 1);
+  }
+  w->path_len = path_len;
+  w->path[w->path_len] = '\0';
+}
+
+static const struct report_writer_ops line_writer_ops = {
+    .begin = line_begin,
+    .end = line_end,
+    .scalar = line_scalar,
+};
+
+static void report_x_server(struct report_writer *w,
+                            const struct x_setup_data *setup_data,
+                            const struct x_server_info *info) {
+  const struct x_setup_data_impl *data = &setup_data->data;
+  char release[64];
+  unsigned int release_number = data->release_number;
+  if (release_number % 1000 != 0)
+    snprintf(release, sizeof(release), "%u.%u.%u.%u", release_number / 10000000,
+             (release_number / 100000) % 100, (release_number / 1000) % 100,
+             release_number % 1000);
+  else
+    snprintf(release, sizeof(release), "%u.%u.%u", release_number / 10000000,
+             (release_number / 100000) % 100, (release_number / 1000) % 100);
+
+  report_string_n(w, "vendor", setup_data->vendor_name, data->vendor_length);
+  report_begin_object(w, "protocol_version");
+  report_uint(w, "major", setup_data->version_major);
+  report_uint(w, "minor", setup_data->version_minor);
+  report_end(w);
+  report_uint(w, "release_number", release_number);
+  report_string(w, "release", release);
+  report_uint(w, "resource_id_base", data->resource_id_base);
+  report_uint(w, "resource_id_mask", data->resource_id_mask);
+  report_uint(w, "motion_buffer_size", data->motion_buffer_size);
+  report_uint(w, "maximum_request_length", info->max_request_len);
+  report_string(w, "image_byte_order",
+                data->image_byte_order == X_BYTE_ORDER_LITTLE_ENDIAN
+                    ? "little endian"
+                    : "big endian");
+  report_string(w, "bitmap_format_bit_order",
+                data->bitmap_format_bit_order ==
+                        X_BITMAP_FORMAT_BIT_ORDER_LEAST_SIGNIFICANT
+                    ? "least significant"
+                    : "most significant");
+  report_uint(w, "bitmap_format_scanline_unit",
+              data->bitmap_format_scanline_unit);
+  report_uint(w, "bitmap_format_scanline_pad",
+              data->bitmap_format_scanline_pad);
+  report_uint(w, "min_keycode", data->min_keycode);
+  report_uint(w, "max_keycode", data->max_keycode);
+  report_uint(w, "num_screens", data->num_roots);
+}
+
+static void report_x_pixmap_formats(struct report_writer *w,
+                                    const struct x_setup_data *setup_data) {
+  const struct x_setup_data_impl *data = &setup_data->data;
+  report_begin_array(w, "pixmap_formats");
+  for (size_t i = 0; i < data->num_pixmap_formats; ++i) {
+    struct x_format format = x_get_pixmap_format(setup_data, i);
+    report_begin_object(w, 0);
+    report_uint(w, "depth", format.depth);
+    report_uint(w, "bits_per_pixel", format.bits_per_pixel);
+    report_uint(w, "scanline_pad", format.scanline_pad);
+    report_end(w);
+  }
+  report_end(w);
+}
+
+static void report_x_visual_stats(struct report_writer *w,
+                                  const struct x_screen_iterator *screen) {
+  struct x_visual_stats stats;
+  x_visual_stats_compute(&stats, screen);
+  report_begin_object(w, "visual_classes");
+  for (size_t i = 0; i < sizeof(stats.classes) / sizeof(stats.classes[0]); ++i)
+    if (stats.classes[i])
+      report_uint(w, visual_class_to_string(i), stats.classes[i]);
+  report_end(w);
+  report_begin_object(w, "bits_per_rgb_values");
+  for (size_t i = 0; i < sizeof(stats.bits_per_rgb_values) /
+                             sizeof(stats.bits_per_rgb_values[0]);
+       ++i) {
+    if (!stats.bits_per_rgb_values[i])
+      continue;
+    char key[8];
+    snprintf(key, sizeof(key), "%zu", i);
+    report_uint(w, key, stats.bits_per_rgb_values[i]);
+  }
+  report_end(w);
+}
+
+static void report_x_screens(struct report_writer *w,
+                             const struct x_setup_data *setup_data,
+                             const struct x_server_info *info,
+                             int report_visuals, int report_visual_stats) {
+  report_begin_array(w, "screens");
+  struct x_screen_iterator screen = x_screens_begin(setup_data);
+  while (x_screens_next(&screen)) {
+    report_begin_object(w, 0);
+    report_uint(w, "root", screen.data.root);
+    report_uint(w, "default_colormap", screen.data.default_colormap);
+    report_uint(w, "white_pixel", screen.data.white_pixel);
+    report_uint(w, "black_pixel", screen.data.black_pixel);
+    report_uint(w, "current_input_mask", screen.data.current_input_mask);
+    report_begin_object(w, "current_input_events");
+    for (size_t i = 0; i < sizeof(x_event_masks) / sizeof(x_event_masks[0]);
+         ++i)
+      report_bool(w, x_event_masks[i].key,
+                  screen.data.current_input_mask & x_event_masks[i].mask);
+    report_end(w);
+    /* Root windows are resized along with their screen, see RANDR */
+    unsigned int width = screen.data.width_in_pixels;
+    unsigned int height = screen.data.height_in_pixels;
+    if (screen.index < info->num_root_geometries) {
+      width = info->root_geometries[screen.index].width;
+      height = info->root_geometries[screen.index].height;
+    }
+    report_uint(w, "width_in_pixels", width);
+    report_uint(w, "height_in_pixels", height);
+    report_uint(w, "width_in_millimeters", screen.data.width_in_millimeters);
+    report_uint(w, "height_in_millimeters",
+                screen.data.height_in_millimeters);
+    report_uint(w, "min_installed_maps", screen.data.min_installed_maps);
+    report_uint(w, "max_installed_maps", screen.data.max_installed_maps);
+    report_uint(w, "root_visual_id", screen.data.root_visual_id);
+    report_string(w, "backing_stores",
+                  screen.data.backing_stores == X_BACKING_STORES_NEVER
+                      ? "never"
+                      : (screen.data.backing_stores ==
+                                 X_BACKING_STORES_WHEN_MAPPED
+                             ? "when mapped"
+                             : "always"));
+    report_bool(w, "save_unders", screen.data.save_unders);
+    report_uint(w, "root_depth", screen.data.root_depth);
+
+    report_begin_array(w, "allowed_depths");
+    struct x_depth_iterator depth = x_depths_begin(&screen);
+    while (x_depths_next(&depth)) {
+      report_begin_object(w, 0);
+      report_uint(w, "depth", depth.data.depth);
+      report_uint(w, "num_visuals", depth.data.num_visuals);
+      if (report_visuals) {
+        report_begin_array(w, "visuals");
+        struct x_visual_iterator visual = x_visuals_begin(&depth);
+        while (x_visuals_next(&visual)) {
+          report_begin_object(w, 0);
+          report_uint(w, "id", visual.data.visual_id);
+          report_string(w, "class",
+                        visual_class_to_string(visual.data.visual_class));
+          report_uint(w, "bits_per_rgb_value", visual.data.bits_per_rgb_value);
+          report_uint(w, "colormap_entries", visual.data.colormap_entries);
+          report_uint(w, "red_mask", visual.data.red_mask);
+          report_uint(w, "green_mask", visual.data.green_mask);
+          report_uint(w, "blue_mask", visual.data.blue_mask);
+          report_end(w);
+        }
+        report_end(w);
+      }
+      report_end(w);
+    }
+    report_end(w);
+    if (report_visual_stats)
+      report_x_visual_stats(w, &screen);
+    report_end(w);
+  }
+  report_end(w);
+}
+
+static void report_x_monitors(struct report_writer *w,
+                              const struct x_server_info *info) {
+  if (info->monitors_failed) {
+    fprintf(stderr, "ERROR: Failed to query X monitors\n");
+    report_null(w, "monitors");
+    return;
+  }
+
+  report_begin_object(w, "monitors");
+  const char *source = x_monitor_source_to_string(info->monitor_source);
+  if (source)
+    report_string(w, "source", source);
+  else
+    report_null(w, "source");
+  report_begin_array(w, "monitors");
+  if (info->monitor_source == X_MONITOR_SOURCE_RANDR) {
+    for (size_t i = 0; i < info->num_outputs; ++i) {
+      const struct x_output *output = &info->outputs[i];
+      report_begin_object(w, 0);
+      report_uint(w, "screen", output->screen);
+      if (output->failed) {
+        report_null(w, "name");
+        report_null(w, "connection");
+      } else {
+        report_string(w, "name", output->name);
+        report_string(w, "connection",
+                      x_output_connection_to_string(output->connection));
+      }
+      const struct x_crtc *crtc = x_output_crtc(info, output);
+      if (crtc) {
+        report_begin_object(w, "geometry");
+        report_int(w, "x", crtc->x);
+        report_int(w, "y", crtc->y);
+        report_uint(w, "width", crtc->width);
+        report_uint(w, "height", crtc->height);
+        report_end(w);
+        double refresh_rate = x_crtc_refresh_rate(info, crtc);
+        if (refresh_rate > 0)
+          report_double(w, "refresh_rate_hz", refresh_rate);
+        else
+          report_null(w, "refresh_rate_hz");
+      } else {
+        report_null(w, "geometry");
+        report_null(w, "refresh_rate_hz");
+      }
+      if (output->failed) {
+        report_null(w, "width_in_millimeters");
+        report_null(w, "height_in_millimeters");
+      } else {
+        report_uint(w, "width_in_millimeters", output->mm_width);
+        report_uint(w, "height_in_millimeters", output->mm_height);
+      }
+      report_end(w);
+    }
+  } else {
+    for (size_t i = 0; i < info->num_crtcs; ++i) {
+      const struct x_crtc *crtc = &info->crtcs[i];
+      report_begin_object(w, 0);
+      report_uint(w, "screen", 0);
+      report_null(w, "name");
+      report_null(w, "connection");
+      report_begin_object(w, "geometry");
+      report_int(w, "x", crtc->x);
+      report_int(w, "y", crtc->y);
+      report_uint(w, "width", crtc->width);
+      report_uint(w, "height", crtc->height);
+      report_end(w);
+      report_null(w, "refresh_rate_hz");
+      report_null(w, "width_in_millimeters");
+      report_null(w, "height_in_millimeters");
+      report_end(w);
+    }
+  }
+  report_end(w);
+  report_end(w);
+}
+
+static void report_x_font_path(struct report_writer *w,
+                               const struct x_server_info *info) {
+  if (info->font_path_failed) {
+    fprintf(stderr, "ERROR: Failed get X font search paths\n");
+    report_null(w, "font_paths");
+    return;
+  }
+
+  report_begin_array(w, "font_paths");
+  const char *curr_data = info->font_path;
+  const char *data_end = info->font_path + info->font_path_len;
+  for (size_t i = 0; i < info->num_font_paths && curr_data < data_end; ++i) {
     uint8_t path_len = 0;
     memcpy(&path_len, curr_data, 1);
     curr_data += 1;
-    memcpy(path, curr_data, path_len);
-    path[path_len] = '\0';
+    if (path_len > data_end - curr_data)
+      break;
+    report_string_n(w, 0, curr_data, path_len);
     curr_data += path_len;
-    printf("  * %s\n", path);
   }
+  report_end(w);
+}
 
-  free(additional_data);
-  return;
+static void report_x_root_properties(struct report_writer *w,
+                                     const struct x_server_info *info) {
+  if (info->properties_failed) {
+    fprintf(stderr, "ERROR: Failed to query X root window properties\n");
+    report_null(w, "root_properties");
+    return;
+  }
 
-font_error:
-  free(additional_data);
-  fprintf(stderr, "ERROR: Failed get X font search paths\n");
+  report_begin_array(w, "root_properties");
+  for (size_t i = 0; i < info->num_root_properties; ++i) {
+    const struct x_property *property = &info->root_properties[i];
+    report_begin_object(w, 0);
+    report_uint(w, "screen", property->screen);
+    report_uint(w, "atom", property->atom);
+    const char *name = x_server_info_atom_name(info, property->atom);
+    if (name)
+      report_string(w, "name", name);
+    else
+      report_null(w, "name");
+    if (property->failed || property->type == 0) {
+      report_null(w, "type");
+      report_null(w, "format");
+      report_null(w, "value");
+      report_end(w);
+      continue;
+    }
+    const char *type = x_server_info_atom_name(info, property->type);
+    if (type)
+      report_string(w, "type", type);
+    else
+      report_null(w, "type");
+    report_uint(w, "format", property->format);
+    /* Format 8 values are reported as strings when they are valid UTF-8, and
+     * as arrays of bytes otherwise, such as Latin-1 text or binary data */
+    size_t text_len = 0;
+    if (property->format == 8 && x_property_is_utf8(property, &text_len)) {
+      report_string_n(w, "value", property->value, text_len);
+    } else {
+      report_begin_array(w, "value");
+      size_t num_items = x_property_num_items(property);
+      for (size_t j = 0; j < num_items; ++j) {
+        uint32_t item = x_property_item(property, j);
+        if (property->type == X_ATOM_ATOM) {
+          const char *atom_name = x_server_info_atom_name(info, item);
+          if (atom_name)
+            report_string(w, 0, atom_name);
+          else
+            report_null(w, 0);
+        } else if (property->type == X_ATOM_INTEGER) {
+          report_int(w, 0,
+                     property->format == 8    ? (long long)(int8_t)item
+                     : property->format == 16 ? (long long)(int16_t)item
+                                              : (long long)(int32_t)item);
+        } else {
+          report_uint(w, 0, item);
+        }
+      }
+      report_end(w);
+    }
+    report_bool(w, "truncated", property->value_len < property->total_len);
+    report_end(w);
+  }
+  report_end(w);
 }
 
-/* To sort extension names alphabetically */
-static int string_comparator(const void *lhs, const void *rhs) {
-  const char *const *first = (const char *const *)lhs;
-  const char *const *second = (const char *const *)rhs;
-  return strcmp(*first, *second);
+static void report_x_extensions(struct report_writer *w,
+                                const struct x_server_info *info) {
+  if (info->extensions_failed) {
+    fprintf(stderr, "ERROR: Failed to query supported X extensions\n");
+    report_null(w, "extensions");
+    return;
+  }
+
+  report_begin_array(w, "extensions");
+  for (size_t i = 0; i < info->num_extensions; ++i) {
+    const struct x_extension *extension = &info->extensions[i];
+    if (!extension->listed || !extension->opcode)
+      continue;
+    report_begin_object(w, 0);
+    report_string(w, "name", extension->name);
+    report_uint(w, "major_opcode", extension->opcode);
+    report_uint(w, "first_event", extension->first_event);
+    report_uint(w, "first_error", extension->first_error);
+    if (!extension->version_failed) {
+      report_begin_object(w, "version");
+      report_uint(w, "major", extension->version_major);
+      report_uint(w, "minor", extension->version_minor);
+      report_end(w);
+    } else {
+      report_null(w, "version");
+    }
+    report_end(w);
+  }
+  report_end(w);
 }
 
-static void print_x_extensions(void) {
-  struct x_list_extensions_request request = {
-      .opcode = X_OPCODE_LIST_EXTENSIONS,
-      .request_len = sizeof(struct x_list_extensions_request) / 4,
-  };
-  struct x_list_extensions_reply reply = {0};
-  char *additional_data = 0;
-  char **extension_names = 0;
-
-  /* Request the list of supported extensions from the X server */
-  ssize_t num_written = write_n(x_connection.fd, &request, sizeof(request));
-  if (num_written != sizeof(request))
-    goto extensions_error;
-
-  ssize_t num_read = read_n(x_connection.fd, &reply, sizeof(reply));
-  /* If we fail, don't try to understand why and just return */
-  if (num_read != sizeof(reply) || reply.status != X_REPLY)
-    goto extensions_error;
-
-  size_t additional_data_len = 4 * reply.data_len;
-  additional_data = malloc(additional_data_len);
-  if (!additional_data)
-    goto extensions_error;
-  num_read = read(x_connection.fd, additional_data, additional_data_len);
-  if (num_read != (ssize_t)additional_data_len)
-    goto extensions_error;
-
-  extension_names = calloc(reply.num_names, sizeof(char *));
-  if (!extension_names)
-    goto extensions_error;
-  const char *curr_data = additional_data;
-  for (size_t i = 0; i < reply.num_names; ++i) {
-    uint8_t name_len = 0;
-    memcpy(&name_len, curr_data, 1);
-    curr_data += 1;
-    extension_names[i] = calloc(name_len + 1, 1);
-    if (!extension_names[i])
-      goto extensions_error;
-    memcpy(extension_names[i], curr_data, name_len);
-    extension_names[i][name_len] = '\0';
-    curr_data += name_len;
+static void report_x_clients(struct report_writer *w,
+                             const struct x_server_info *info) {
+  if (info->clients_failed) {
+    fprintf(stderr, "ERROR: Failed to query X clients\n");
+    report_null(w, "clients");
+    return;
+  }
+  if (!info->clients_available) {
+    report_null(w, "clients");
+    return;
   }
 
-#undef FIELD_WIDTH
-#define FIELD_WIDTH 41
-  qsort(extension_names, reply.num_names, sizeof(char *), string_comparator);
-  printf("\nSupported extensions: %u\n", reply.num_names);
-  for (size_t i = 0; i < reply.num_names; ++i) {
-    const char *extension_name = extension_names[i];
-    /* The Nvidia implementation doesn't seem to provide a documented version
-     * querying request. Delegate to GLX instead */
-    if (strcmp(extension_names[i], X_EXTENSION_NAME_NV_GLX) == 0)
-      extension_name = X_EXTENSION_NAME_GLX;
-    unsigned int opcode = x_get_extension_opcode(extension_name);
-    if (opcode) {
-      unsigned int version_major = 0;
-      unsigned int version_minor = 0;
-      printf("  * %s%.*s ", extension_names[i],
-             (int)(FIELD_WIDTH - strlen(extension_names[i])), FILL);
-      if (x_get_extension_version(extension_name, opcode, &version_major,
-                                  &version_minor) == 0)
-        printf("v%u.%u\n", version_major, version_minor);
-      else
-        printf("unknown version\n");
+  report_begin_object(w, "clients");
+  report_uint(w, "count", info->num_clients);
+  report_uint(w, "pixmap_bytes", info->total_pixmap_bytes);
+  report_uint(w, "resources", info->total_resources);
+  report_uint(w, "disconnected", info->num_vanished_clients);
+  report_begin_array(w, "top");
+  for (size_t i = 0; i < info->num_top_clients; ++i) {
+    const struct x_client_usage *client = &info->top_clients[i];
+    report_begin_object(w, 0);
+    report_uint(w, "resource_base", client->resource_base);
+    report_uint(w, "pixmap_bytes", client->pixmap_bytes);
+    report_uint(w, "resources", client->num_resources);
+    report_end(w);
+  }
+  report_end(w);
+  report_end(w);
+}
+
+/* The histogram only lists its buckets which are not empty */
+static void report_x_ping(struct report_writer *w,
+                          const struct x_probe_options *options,
+                          const struct x_server_info *info) {
+  const struct x_ping_stats *stats = &info->ping;
+  report_begin_object(w, "ping");
+  report_uint(w, "count", stats->num_received);
+  report_uint(w, "depth", options->ping_depth);
+  report_uint(w, "interval_ms", options->ping_interval_ms);
+  report_uint(w, "errors", stats->num_errors);
+  report_double(w, "min_ms", stats->min_ms);
+  report_double(w, "mean_ms", stats->num_received
+                                  ? stats->total_ms / stats->num_received
+                                  : 0);
+  report_double(w, "p50_ms", x_ping_stats_percentile(stats, 0.5));
+  report_double(w, "p90_ms", x_ping_stats_percentile(stats, 0.9));
+  report_double(w, "p99_ms", x_ping_stats_percentile(stats, 0.99));
+  report_double(w, "p999_ms", x_ping_stats_percentile(stats, 0.999));
+  report_double(w, "max_ms", stats->max_ms);
+  double duration_ms = stats->end_ms - stats->start_ms;
+  report_double(w, "per_second",
+                duration_ms > 0 ? stats->num_received * 1000 / duration_ms
+                                : 0);
+  report_begin_array(w, "histogram");
+  for (size_t i = 0; i < X_PING_NUM_BUCKETS; ++i) {
+    if (stats->buckets[i] == 0)
+      continue;
+    report_begin_object(w, 0);
+    report_double(w, "max_ms", x_ping_bucket_highest(i) / 1000.0);
+    report_uint(w, "count", stats->buckets[i]);
+    report_end(w);
+  }
+  report_end(w);
+  report_end(w);
+}
+
+static void report_timings(struct report_writer *w,
+                           const struct x_connection *c) {
+  const struct timings *timings = &c->timings;
+  report_begin_object(w, "timings");
+  report_begin_array(w, "phases");
+  for (size_t i = 0; i < timings->num_phases; ++i) {
+    report_begin_object(w, 0);
+    report_string(w, "name", timings->phases[i].name);
+    report_double(w, "duration_ms", timings->phases[i].duration_ms);
+    report_end(w);
+  }
+  report_end(w);
+  report_double(w, "total_ms", timings->end_ms - timings->start_ms);
+
+  report_begin_array(w, "requests");
+  for (size_t i = 0; i < timings->num_requests; ++i) {
+    const struct request_timing *request = &timings->requests[i];
+    report_begin_object(w, 0);
+    report_uint(w, "sequence_number", request->sequence_number);
+    if (request->opcode < 128) {
+      report_string(w, "request", x_core_request_name(request->opcode));
+    } else {
+      const char *extension_name =
+          timings->extension_names[request->opcode - 128];
+      report_string(w, "extension",
+                    extension_name ? extension_name : "unknown");
+      report_uint(w, "minor_opcode", request->minor_opcode);
     }
+    if (request->sent_ms >= 0 && request->reply_ms >= 0)
+      report_double(w, "latency_ms", request->reply_ms - request->sent_ms);
+    else
+      report_null(w, "latency_ms");
+    report_end(w);
   }
+  report_end(w);
+
+  report_uint(w, "reads", c->input.num_syscalls);
+  report_uint(w, "writes", c->output.num_syscalls);
+  report_uint(w, "bytes_sent", c->output.num_bytes);
+  report_uint(w, "bytes_received", c->input.num_bytes);
+  report_uint(w, "discarded_events", c->num_discarded_events);
+  report_end(w);
+}
 
-  for (size_t i = 0; i < reply.num_names; ++i)
-    free(extension_names[i]);
-  free(extension_names);
-  free(additional_data);
-  return;
+#define X_DEFAULT_CONNECT_TIMEOUT_MS 10000
+#define X_DEFAULT_READ_TIMEOUT_MS 10000
+#define X_DEFAULT_TOP_CLIENTS 10
+#define X_DEFAULT_PINGS 100
+#define X_MAX_PINGS 10000000
+
+static void usage(const char *program_name) {
+  fprintf(stderr,
+          "Usage: %s [options] [display...]\n"
+          "\n"
+          "Print information about the X server of every given display, or of\n"
+          "the display named by the DISPLAY environment variable if there is\n"
+          "none. All the displays are probed concurrently.\n"
+          "\n"
+          "Options:\n"
+          "  --visuals       List the visuals of every allowed depth\n"
+          "  --visual-stats  Count the visuals of every screen by class and\n"
+          "                  by bits per RGB value\n"
+          "  --timings       Report the time spent in every phase and request\n"
+          "  --only=SECTIONS Only probe and print the given comma-separated\n"
+          "                  sections: server, formats, screens, monitors,\n"
+          "                  font-paths, extensions, properties, clients and\n"
+          "                  ping, all but the last three by default\n"
+          "  --top-clients=N Number of clients reported by the clients\n"
+          "                  section, the ones using the most pixmap bytes\n"
+          "                  (default: 10)\n"
+          "  --ping[=N]      Add the ping section, which measures the time of\n"
+          "                  N round-trips to the server (default: %u) once\n"
+          "                  the other sections are probed\n"
+          "  --ping-interval=MS\n"
+          "                  Wait MS milliseconds between pings (default: 0)\n"
+          "  --ping-depth=N  Keep up to N pings in flight (default: 1)\n"
+          "  --extension=NAMES\n"
+          "                  Only look up the given comma-separated\n"
+          "                  extensions instead of all the supported ones,\n"
+          "                  implies --only=extensions unless --only is given\n"
+          "  --watch=MS      Keep the connections open and refresh the screen\n"
+          "                  sizes and the font search paths every MS\n"
+          "                  milliseconds, only printing what changed\n"
+          "  --format=FORMAT Print reports as plain text (text, the default),\n"
+          "                  one JSON object per display and line (json) or\n"
+          "                  one \"display key=value\" line per value (line)\n"
+          "  --xauth-index   Cache an index of the Xauthority file to speed\n"
+          "                  up repeated lookups\n"
+          "  --cache         Cache what never changes during the life of a\n"
+          "                  server to skip most requests on later runs\n"
+          "  --connect-timeout=MS\n"
+          "                  Give up connecting to a server after MS\n"
+          "                  milliseconds (default: %u, 0: never)\n"
+          "  --timeout=MS    Give up on a server that does not send anything\n"
+          "                  for MS milliseconds while an answer is expected\n"
+          "                  (default: %u, 0: never)\n"
+          "  -j N            Spread the displays over N threads, each probing\n"
+          "                  its share of them concurrently\n"
+          "  --help          Print this message and exit\n",
+          program_name, X_DEFAULT_PINGS, X_DEFAULT_CONNECT_TIMEOUT_MS,
+          X_DEFAULT_READ_TIMEOUT_MS);
+}
 
-extensions_error:
-  if (extension_names) {
-    for (size_t i = 0; i < reply.num_names; ++i)
-      free(extension_names[i]);
+/* Parse a number between 1 and max. Returns non-zero if it is invalid. */
+static int parse_count(const char *string, size_t max, size_t *value) {
+  char *end = 0;
+  errno = 0;
+  unsigned long result = strtoul(string, &end, 10);
+  if (errno != 0 || end == string || *end != '\0' || result == 0 ||
+      result > max)
+    return 1;
+  *value = result;
+  return 0;
+}
+
+/* Parse a duration given in milliseconds. Returns non-zero if it is
+ * invalid. */
+static int parse_milliseconds(const char *string, unsigned int *value) {
+  char *end = 0;
+  errno = 0;
+  unsigned long result = strtoul(string, &end, 10);
+  if (errno != 0 || end == string || *end != '\0' || result > UINT_MAX)
+    return 1;
+  *value = result;
+  return 0;
+}
+
+static const struct report_section {
+  const char *name;
+  unsigned int flag;
+} report_sections[] = {
+    {"server", X_SECTION_SERVER},
+    {"formats", X_SECTION_FORMATS},
+    {"screens", X_SECTION_SCREENS},
+    {"monitors", X_SECTION_MONITORS},
+    {"font-paths", X_SECTION_FONT_PATHS},
+    {"extensions", X_SECTION_EXTENSIONS},
+    {"properties", X_SECTION_PROPERTIES},
+    {"clients", X_SECTION_CLIENTS},
+    {"ping", X_SECTION_PING},
+};
+
+/* Parse a comma-separated list of section names. Returns non-zero if one of
+ * them is unknown. */
+static int parse_sections(const char *string, unsigned int *sections) {
+  *sections = 0;
+  while (*string) {
+    size_t len = strcspn(string, ",");
+    size_t i = 0;
+    for (; i < sizeof(report_sections) / sizeof(report_sections[0]); ++i) {
+      if (strlen(report_sections[i].name) == len &&
+          strncmp(string, report_sections[i].name, len) == 0)
+        break;
+    }
+    if (i == sizeof(report_sections) / sizeof(report_sections[0]))
+      return 1;
+    *sections |= report_sections[i].flag;
+    string += len;
+    if (*string == ',')
+      ++string;
+  }
+  return *sections == 0;
+}
+
+/* Add the extensions of a comma-separated list to the names already given.
+ * Returns non-zero on failure. */
+static int parse_extension_names(char *string,
+                                 struct x_probe_options *options) {
+  for (char *name = string; *name;) {
+    size_t len = strcspn(name, ",");
+    int last = name[len] == '\0';
+    name[len] = '\0';
+    if (len > 0) {
+      const char **names =
+          realloc(options->extension_names,
+                  (options->num_extension_names + 1) * sizeof(char *));
+      if (!names)
+        return 1;
+      options->extension_names = names;
+      options->extension_names[options->num_extension_names++] = name;
+    }
+    name += len + !last;
+  }
+  return 0;
+}
+
+enum report_format {
+  REPORT_FORMAT_TEXT,
+  REPORT_FORMAT_JSON,
+  REPORT_FORMAT_LINE,
+};
+
+/* What was last reported about a watched display */
+struct watch_snapshot {
+  char *lines; /* Report in the line protocol */
+  size_t len;
+  char error[256]; /* Set while the display cannot be probed */
+};
+
+struct report_options {
+  enum report_format format;
+  unsigned int sections;
+  struct output_stream *out;
+  int print_visuals;
+  int print_visual_stats;
+  int print_timings;
+  int print_display_names; /* When probing several displays */
+  size_t num_failed;
+  /* When watching, indexed like the probes */
+  const struct x_probe *probes;
+  struct watch_snapshot *snapshots;
+};
+
+static void report_display_text(struct x_probe *probe,
+                                struct report_options *options) {
+  struct output_stream *out = options->out;
+  if (options->print_display_names)
+    output_printf(out, "\n==> %s <==\n", probe->display_name);
+
+  if (probe->state == X_PROBE_FAILED) {
+    /* A single display failing is fatal, like it always was */
+    if (!options->print_display_names) {
+      output_flush(out);
+      die(probe->error);
+    }
+    fprintf(stderr, "ERROR: %s: %s\n", probe->display_name, probe->error);
+    return;
+  }
+
+  const struct x_setup_data *setup_data = &probe->connection.setup_data;
+  unsigned int sections = options->sections;
+  if (sections & X_SECTION_SERVER)
+    print_x_server(out, setup_data, &probe->info);
+  if (sections & X_SECTION_FORMATS)
+    print_x_pixmap_formats(out, setup_data);
+  if (sections & X_SECTION_SCREENS)
+    print_x_screens(out, setup_data, options->print_visuals,
+                    options->print_visual_stats);
+  if (sections & X_SECTION_MONITORS)
+    print_x_monitors(out, setup_data, &probe->info);
+  if (sections & X_SECTION_FONT_PATHS)
+    print_x_font_path(out, &probe->info);
+  if (sections & X_SECTION_EXTENSIONS)
+    print_x_extensions(out, &probe->info);
+  if (sections & X_SECTION_PROPERTIES)
+    print_x_root_properties(out, setup_data, &probe->info);
+  if (sections & X_SECTION_CLIENTS)
+    print_x_clients(out, &probe->info);
+  if (sections & X_SECTION_PING)
+    print_x_ping(out, probe->options, &probe->info);
+  if (options->print_timings)
+    print_timings(out, &probe->connection);
+}
+
+static void report_probe(struct report_writer *w, const struct x_probe *probe,
+                         const struct report_options *options) {
+  report_begin_object(w, 0);
+  report_string(w, "display", probe->display_name);
+  if (probe->state == X_PROBE_FAILED) {
+    report_string(w, "error", probe->error);
+  } else {
+    report_null(w, "error");
+    const struct x_setup_data *setup_data = &probe->connection.setup_data;
+    unsigned int sections = options->sections;
+    if (sections & X_SECTION_SERVER)
+      report_x_server(w, setup_data, &probe->info);
+    if (sections & X_SECTION_FORMATS)
+      report_x_pixmap_formats(w, setup_data);
+    if (sections & X_SECTION_SCREENS)
+      report_x_screens(w, setup_data, &probe->info, options->print_visuals,
+                       options->print_visual_stats);
+    if (sections & X_SECTION_MONITORS)
+      report_x_monitors(w, &probe->info);
+    if (sections & X_SECTION_FONT_PATHS)
+      report_x_font_path(w, &probe->info);
+    if (sections & X_SECTION_EXTENSIONS)
+      report_x_extensions(w, &probe->info);
+    if (sections & X_SECTION_PROPERTIES)
+      report_x_root_properties(w, &probe->info);
+    if (sections & X_SECTION_CLIENTS)
+      report_x_clients(w, &probe->info);
+    if (sections & X_SECTION_PING)
+      report_x_ping(w, probe->options, &probe->info);
+    if (options->print_timings)
+      report_timings(w, &probe->connection);
+  }
+  report_end(w);
+}
+
+/* Structured formats write one self-contained record per display, failed or
+ * not, so that consumers never have to parse the error stream */
+static void report_display_structured(struct x_probe *probe,
+                                      struct report_options *options) {
+  struct report_writer w = {
+      .ops = options->format == REPORT_FORMAT_JSON ? &json_writer_ops
+                                                   : &line_writer_ops,
+      .out = options->out,
+      .display_name = probe->display_name,
+  };
+  if (probe->state == X_PROBE_FAILED)
+    fprintf(stderr, "ERROR: %s: %s\n", probe->display_name, probe->error);
+  report_probe(&w, probe, options);
+}
+
+/* Print everything learned about a display, then release the probe */
+static void report_display(struct x_probe *probe, void *context) {
+  struct report_options *options = context;
+  if (options->format == REPORT_FORMAT_TEXT)
+    report_display_text(probe, options);
+  else
+    report_display_structured(probe, options);
+  if (probe->state == X_PROBE_FAILED)
+    ++options->num_failed;
+  output_flush(options->out);
+  x_probe_free(probe);
+}
+
+/* Parallel probing spreads the displays over worker threads, each running its
+ * own event loop. Workers claim chunks of consecutive displays from a shared
+ * counter, so that a worker stuck with slow servers does not hold the others
+ * back, and render their reports to memory. The main thread writes the
+ * reports in order as soon as they are ready. */
+struct parallel_report {
+  char *data;
+  size_t len;
+  int done;
+};
+
+struct parallel_scan {
+  pthread_mutex_t lock;
+  pthread_cond_t report_done;
+  struct x_probe *probes;
+  size_t num_probes;
+  size_t next_probe; /* First probe not claimed by any worker */
+  size_t chunk_size;
+  size_t max_active; /* For every worker */
+  struct parallel_report *reports; /* Indexed like the probes */
+};
+
+struct parallel_worker {
+  pthread_t thread;
+  struct parallel_scan *scan;
+  struct report_options options;
+  struct output_stream out;
+};
+
+static void parallel_report_display(struct x_probe *probe, void *context) {
+  struct parallel_worker *worker = context;
+  struct parallel_scan *scan = worker->scan;
+  struct parallel_report *parallel_report = &scan->reports[probe -
+                                                           scan->probes];
+  report_display(probe, &worker->options);
+  pthread_mutex_lock(&scan->lock);
+  parallel_report->data = worker->out.memory;
+  parallel_report->len = worker->out.memory_len;
+  parallel_report->done = 1;
+  pthread_cond_signal(&scan->report_done);
+  pthread_mutex_unlock(&scan->lock);
+  worker->out.memory = 0;
+  worker->out.memory_len = 0;
+  worker->out.memory_capacity = 0;
+}
+
+static void *parallel_worker_run(void *context) {
+  struct parallel_worker *worker = context;
+  struct parallel_scan *scan = worker->scan;
+  for (;;) {
+    pthread_mutex_lock(&scan->lock);
+    size_t first = scan->next_probe;
+    size_t num_probes = scan->num_probes - first;
+    if (num_probes > scan->chunk_size)
+      num_probes = scan->chunk_size;
+    scan->next_probe += num_probes;
+    pthread_mutex_unlock(&scan->lock);
+    if (num_probes == 0)
+      return 0;
+    x_probe_displays(scan->probes + first, num_probes, scan->max_active,
+                     parallel_report_display, worker);
   }
-  free(extension_names);
-  free(additional_data);
-  fprintf(stderr, "ERROR: Failed to query supported X extensions");
 }
 
-int main() {
-  printf("xinfo - X server information printer\n\n");
+/* Probe and report several displays with the given number of worker
+ * threads */
+static void report_displays_parallel(struct x_probe *probes, size_t num_probes,
+                                     size_t num_jobs,
+                                     struct report_options *options) {
+  /* Chunks are small enough for the load to be balanced and large enough for
+   * every worker to keep many probes in progress at once */
+  struct parallel_scan scan = {
+      .probes = probes,
+      .num_probes = num_probes,
+      .chunk_size = num_probes / (4 * num_jobs),
+      .max_active = x_max_active_probes() / num_jobs,
+  };
+  if (scan.chunk_size == 0)
+    scan.chunk_size = 1;
+  if (scan.max_active == 0)
+    scan.max_active = 1;
+  scan.reports = calloc(num_probes, sizeof(struct parallel_report));
+  struct parallel_worker *workers =
+      calloc(num_jobs, sizeof(struct parallel_worker));
+  if (!scan.reports || !workers)
+    die("Memory allocation failed");
+  if (pthread_mutex_init(&scan.lock, 0) != 0 ||
+      pthread_cond_init(&scan.report_done, 0) != 0)
+    die("Failed to start worker threads");
+  for (size_t i = 0; i < num_jobs; ++i) {
+    struct parallel_worker *worker = &workers[i];
+    worker->scan = &scan;
+    worker->out.fd = -1;
+    worker->options = *options;
+    worker->options.out = &worker->out;
+    worker->options.num_failed = 0;
+    if (pthread_create(&worker->thread, 0, parallel_worker_run, worker) != 0)
+      die("Failed to start worker threads");
+  }
+
+  for (size_t i = 0; i < num_probes; ++i) {
+    struct parallel_report *parallel_report = &scan.reports[i];
+    pthread_mutex_lock(&scan.lock);
+    while (!parallel_report->done)
+      pthread_cond_wait(&scan.report_done, &scan.lock);
+    pthread_mutex_unlock(&scan.lock);
+    output_write(options->out, parallel_report->data, parallel_report->len);
+    output_flush(options->out);
+    free(parallel_report->data);
+  }
+
+  for (size_t i = 0; i < num_jobs; ++i) {
+    struct parallel_worker *worker = &workers[i];
+    pthread_join(worker->thread, 0);
+    options->num_failed += worker->options.num_failed;
+    if (worker->out.failed)
+      options->out->failed = 1;
+    free(worker->out.memory);
+  }
+  pthread_cond_destroy(&scan.report_done);
+  pthread_mutex_destroy(&scan.lock);
+  free(workers);
+  free(scan.reports);
+}
+
+/* A key and its value in a report in the line protocol */
+struct report_line {
+  const char *key;
+  size_t key_len;
+  const char *value; /* Null if there is no value */
+  size_t value_len;
+};
+
+static int report_line_comparator(const void *lhs, const void *rhs) {
+  const struct report_line *first = lhs;
+  const struct report_line *second = rhs;
+  size_t len = first->key_len < second->key_len ? first->key_len
+                                                : second->key_len;
+  int result = memcmp(first->key, second->key, len);
+  if (result != 0)
+    return result;
+  return (first->key_len > second->key_len) -
+         (first->key_len < second->key_len);
+}
+
+/* Split a report in the line protocol into lines sorted by key, skipping the
+ * display name in front of the keys. Returns null on failure. */
+static struct report_line *split_report_lines(const char *report, size_t len,
+                                              size_t prefix_len,
+                                              size_t *num_lines) {
+  size_t capacity = 1;
+  for (size_t i = 0; i < len; ++i)
+    capacity += report[i] == '\n';
+  struct report_line *lines = malloc(capacity * sizeof(struct report_line));
+  if (!lines)
+    return 0;
+  *num_lines = 0;
+  const char *end = report + len;
+  while (report < end) {
+    const char *line_end = memchr(report, '\n', end - report);
+    if (!line_end)
+      line_end = end;
+    const char *key = report + prefix_len;
+    const char *equal = key < line_end ? memchr(key, '=', line_end - key) : 0;
+    if (equal) {
+      struct report_line line = {
+          .key = key,
+          .key_len = equal - key,
+          .value = equal + 1,
+          .value_len = line_end - equal - 1,
+      };
+      lines[(*num_lines)++] = line;
+    }
+    report = line_end + 1;
+  }
+  qsort(lines, *num_lines, sizeof(struct report_line), report_line_comparator);
+  return lines;
+}
+
+static void report_change(struct report_options *options,
+                          struct report_writer *w, const char *display_name,
+                          const struct report_line *line, int removed) {
+  if (options->format == REPORT_FORMAT_JSON) {
+    char key[sizeof(w->path)];
+    snprintf(key, sizeof(key), "%.*s", (int)line->key_len, line->key);
+    if (removed)
+      report_null(w, key);
+    else
+      report_string_n(w, key, line->value, line->value_len);
+    return;
+  }
+  if (removed)
+    output_printf(options->out, "%s %.*s\n", display_name,
+                  (int)line->key_len, line->key);
+  else
+    output_printf(options->out, "%s %.*s=%.*s\n", display_name,
+                  (int)line->key_len, line->key, (int)line->value_len,
+                  line->value);
+}
+
+/* Print what differs between two reports in the line protocol. Changed and
+ * new values are printed like in the line protocol, or as strings in a
+ * "changes" object in JSON, while removed keys come without a value. Returns
+ * non-zero on failure. */
+static int report_changes(struct report_options *options,
+                          const char *display_name, const char *previous,
+                          size_t previous_len, const char *current,
+                          size_t current_len) {
+  size_t prefix_len = strlen(display_name) + 1;
+  size_t num_before = 0;
+  size_t num_after = 0;
+  struct report_line *before =
+      split_report_lines(previous, previous_len, prefix_len, &num_before);
+  struct report_line *after =
+      split_report_lines(current, current_len, prefix_len, &num_after);
+  if (!before || !after) {
+    free(before);
+    free(after);
+    return 1;
+  }
 
-  x_connect();
-  print_x_connection_data();
-  print_x_font_path();
-  print_x_extensions();
-  x_disconnect();
+  struct report_writer w = {
+      .ops = &json_writer_ops,
+      .out = options->out,
+      .display_name = display_name,
+  };
+  int any_change = 0;
+  size_t i = 0;
+  size_t j = 0;
+  while (i < num_before || j < num_after) {
+    int order = i == num_before ? 1
+                : j == num_after
+                    ? -1
+                    : report_line_comparator(&before[i], &after[j]);
+    const struct report_line *line = order < 0 ? &before[i] : &after[j];
+    int changed = order != 0 || before[i].value_len != after[j].value_len ||
+                  memcmp(before[i].value, after[j].value,
+                         after[j].value_len) != 0;
+    if (changed) {
+      if (!any_change && options->format == REPORT_FORMAT_JSON) {
+        report_begin_object(&w, 0);
+        report_string(&w, "display", display_name);
+        report_begin_object(&w, "changes");
+      }
+      any_change = 1;
+      report_change(options, &w, display_name, line, order < 0);
+    }
+    i += order <= 0;
+    j += order >= 0;
+  }
+  if (any_change && options->format == REPORT_FORMAT_JSON) {
+    report_end(&w);
+    report_end(&w);
+  }
+  free(before);
+  free(after);
   return 0;
 }
+
+/* Print the first report of a watched display in full, and then only what
+ * changed in the following ones. Failures are only reported when they first
+ * happen, the next successful report is compared to the last one before the
+ * failure. */
+static void report_watched_display(struct x_probe *probe, void *context) {
+  struct report_options *options = context;
+  struct watch_snapshot *snapshot =
+      &options->snapshots[probe - options->probes];
+  if (probe->state == X_PROBE_FAILED) {
+    if (strcmp(snapshot->error, probe->error) != 0) {
+      snprintf(snapshot->error, sizeof(snapshot->error), "%s", probe->error);
+      if (options->format == REPORT_FORMAT_TEXT)
+        fprintf(stderr, "ERROR: %s: %s\n", probe->display_name, probe->error);
+      else
+        report_display_structured(probe, options);
+    }
+    output_flush(options->out);
+    return;
+  }
+  snapshot->error[0] = '\0';
+
+  static struct output_stream lines = {.fd = -1};
+  lines.memory_len = 0;
+  struct report_writer w = {
+      .ops = &line_writer_ops,
+      .out = &lines,
+      .display_name = probe->display_name,
+  };
+  report_probe(&w, probe, options);
+  output_flush(&lines);
+  if (lines.failed)
+    die("Memory allocation failed");
+
+  if (!snapshot->lines) {
+    if (options->format == REPORT_FORMAT_TEXT)
+      report_display_text(probe, options);
+    else
+      report_display_structured(probe, options);
+  } else if (report_changes(options, probe->display_name, snapshot->lines,
+                            snapshot->len, lines.memory,
+                            lines.memory_len) != 0) {
+    die("Memory allocation failed");
+  }
+  output_flush(options->out);
+
+  size_t copy_len = lines.memory_len ? lines.memory_len : 1;
+  char *copy = realloc(snapshot->lines, copy_len);
+  if (!copy)
+    die("Memory allocation failed");
+  memcpy(copy, lines.memory, lines.memory_len);
+  snapshot->lines = copy;
+  snapshot->len = lines.memory_len;
+}
+
+int main(int argc, char **argv) {
+  static struct output_stream out = {.fd = STDOUT_FILENO};
+  struct report_options options = {.out = &out};
+  struct x_probe_options probe_options = {
+      .connect_timeout_ms = X_DEFAULT_CONNECT_TIMEOUT_MS,
+      .read_timeout_ms = X_DEFAULT_READ_TIMEOUT_MS,
+      .num_top_clients = X_DEFAULT_TOP_CLIENTS,
+      .num_pings = X_DEFAULT_PINGS,
+      .ping_depth = 1,
+  };
+  int sections_given = 0;
+  int ping_given = 0;
+  size_t num_jobs = 1;
+  const char **display_names = calloc(argc, sizeof(char *));
+  size_t num_displays = 0;
+  if (!display_names)
+    die("Memory allocation failed");
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--visuals") == 0) {
+      options.print_visuals = 1;
+    } else if (strcmp(argv[i], "--visual-stats") == 0) {
+      options.print_visual_stats = 1;
+    } else if (strcmp(argv[i], "--xauth-index") == 0) {
+      probe_options.use_xauth_index = 1;
+    } else if (strcmp(argv[i], "--cache") == 0) {
+      probe_options.use_cache = 1;
+    } else if (strncmp(argv[i], "--connect-timeout=", 18) == 0) {
+      if (parse_milliseconds(argv[i] + 18,
+                             &probe_options.connect_timeout_ms) != 0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--timeout=", 10) == 0) {
+      if (parse_milliseconds(argv[i] + 10, &probe_options.read_timeout_ms) !=
+          0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--top-clients=", 14) == 0) {
+      if (parse_count(argv[i] + 14, 1024, &probe_options.num_top_clients) !=
+          0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--ping") == 0) {
+      ping_given = 1;
+    } else if (strncmp(argv[i], "--ping=", 7) == 0) {
+      if (parse_count(argv[i] + 7, X_MAX_PINGS, &probe_options.num_pings) !=
+          0) {
+        usage(argv[0]);
+        return 1;
+      }
+      ping_given = 1;
+    } else if (strncmp(argv[i], "--ping-interval=", 16) == 0) {
+      if (parse_milliseconds(argv[i] + 16, &probe_options.ping_interval_ms) !=
+          0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--ping-depth=", 13) == 0) {
+      if (parse_count(argv[i] + 13, 1024, &probe_options.ping_depth) != 0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--timings") == 0) {
+      options.print_timings = 1;
+    } else if (strncmp(argv[i], "--watch=", 8) == 0) {
+      if (parse_milliseconds(argv[i] + 8, &probe_options.watch_interval_ms) !=
+              0 ||
+          probe_options.watch_interval_ms == 0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--only=", 7) == 0) {
+      if (parse_sections(argv[i] + 7, &probe_options.sections) != 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      sections_given = 1;
+    } else if (strncmp(argv[i], "--extension=", 12) == 0) {
+      if (parse_extension_names(argv[i] + 12, &probe_options) != 0)
+        die("Memory allocation failed");
+    } else if (strcmp(argv[i], "--format=text") == 0) {
+      options.format = REPORT_FORMAT_TEXT;
+    } else if (strcmp(argv[i], "--format=json") == 0) {
+      options.format = REPORT_FORMAT_JSON;
+    } else if (strcmp(argv[i], "--format=line") == 0) {
+      options.format = REPORT_FORMAT_LINE;
+    } else if (strcmp(argv[i], "-j") == 0) {
+      if (i + 1 == argc || parse_count(argv[++i], 1024, &num_jobs) != 0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--help") == 0) {
+      usage(argv[0]);
+      return 0;
+    } else if (argv[i][0] != '-') {
+      display_names[num_displays++] = argv[i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (num_displays == 0) {
+    /* The DISPLAY environment variable contains the name of the display on
+     * which the application was started */
+    display_names[0] = getenv("DISPLAY");
+    if (!display_names[0]) {
+      fprintf(stderr, "WARNING: No DISPLAY environment variable found, trying "
+                      "default X display name ':0'\n");
+      display_names[0] = ":0";
+    }
+    num_displays = 1;
+  }
+  options.print_display_names = num_displays > 1;
+  /* Naming extensions is enough to select only them */
+  if (!sections_given)
+    probe_options.sections =
+        probe_options.num_extension_names > 0 ? 0 : X_SECTION_DEFAULT;
+  if (probe_options.num_extension_names > 0)
+    probe_options.sections |= X_SECTION_EXTENSIONS;
+  if (ping_given)
+    probe_options.sections |= X_SECTION_PING;
+  options.sections = probe_options.sections;
+  /* Timings would pile up forever */
+  if (probe_options.watch_interval_ms && options.print_timings)
+    die("--timings cannot be combined with --watch");
+  if (probe_options.watch_interval_ms && num_jobs > 1)
+    die("-j cannot be combined with --watch");
+  if (num_jobs > num_displays)
+    num_jobs = num_displays;
+
+  struct x_probe *probes = calloc(num_displays, sizeof(struct x_probe));
+  if (!probes)
+    die("Memory allocation failed");
+  for (size_t i = 0; i < num_displays; ++i)
+    x_probe_init(&probes[i], &probe_options, display_names[i],
+                 options.print_timings);
+
+  if (options.format == REPORT_FORMAT_TEXT)
+    output_printf(&out, "xinfo - X server information printer\n");
+
+  if (probe_options.watch_interval_ms) {
+    if (num_displays > x_max_active_probes())
+      die("Too many displays to watch at once");
+    options.probes = probes;
+    options.snapshots = calloc(num_displays, sizeof(struct watch_snapshot));
+    if (!options.snapshots)
+      die("Memory allocation failed");
+    x_watch_displays(probes, num_displays, probe_options.watch_interval_ms,
+                     report_watched_display, &options);
+  } else if (num_jobs > 1) {
+    report_displays_parallel(probes, num_displays, num_jobs, &options);
+  } else {
+    x_probe_displays(probes, num_displays, x_max_active_probes(),
+                     report_display, &options);
+  }
+  free(probes);
+  free(display_names);
+  free(probe_options.extension_names);
+  output_flush(&out);
+  return options.num_failed > 0 || out.failed;
+}